@@ -1,5 +1,7 @@
 #include "ADThread.h"
 #include <signal.h>
+#include <errno.h>
+#include <time.h>
 #include <iostream>
 using namespace std;
 /*****************************************************************************/
@@ -16,7 +18,7 @@ void *thread_function(void *thread_attr)
 	return NULL;
 }
 /*****************************************************************************/
-ADThread::ADThread():th_type(THREAD_TYPE_NONE),/*user_thread_func(NULL),*/user_data(NULL),init_flag(false)
+ADThread::ADThread():th_type(THREAD_TYPE_NONE),/*user_thread_func(NULL),*/user_data(NULL),init_flag(false),wakeup_pending(false),wait_timeout_ms(0)
 {
 	/* Initialize and set thread detached attribute */
 	if(sem_init(&one_shot_sema,0,0)!=0)//dont wake-up thread in first shot
@@ -32,7 +34,7 @@ ADThread::ADThread():th_type(THREAD_TYPE_NONE),/*user_thread_func(NULL),*/user_d
 	//cout<<"ADThread:constructor"<<endl;
 }
 /*****************************************************************************/
-ADThread::ADThread(THRD_TYPE type,/*CustomThreadFunc_t custom_func,*/void *usr_dat)
+ADThread::ADThread(THRD_TYPE type,/*CustomThreadFunc_t custom_func,*/void *usr_dat):wakeup_pending(false),wait_timeout_ms(0)
 {
 	th_type=type;
 	//user_thread_func=custom_func;
@@ -82,7 +84,12 @@ int ADThread::my_thread_func(int thread_id)
 		//wait only if this is a monoshot thread
 		if(th_type==THREAD_TYPE_MONOSHOT)
 		{
-			sem_wait(&one_shot_sema);
+			if(wait_timeout_ms==0)
+				sem_wait(&one_shot_sema);
+			else
+				wait_with_timeout();
+			//clear before calling consumer, so that work queued during the callback triggers a new wakeup
+			wakeup_pending.store(false);
 			if(is_user_callback_object_attached()==0)
 				user_monoshot_callback_function(user_data);//call consumer
 			//if(user_thread_func!=NULL)
@@ -100,6 +107,35 @@ int ADThread::my_thread_func(int thread_id)
 	return 0;
 }
 /*****************************************************************************/
+//returns on wakeup or when wait_timeout_ms has passed, consumer is called in both cases.
+//the deadline is taken from CLOCK_MONOTONIC, so a step of the wall clock does not stall the thread
+//(sem_clockwait() needs glibc 2.30, older ones fall back to CLOCK_REALTIME)
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 30))
+#define ADTHREAD_WAIT_CLOCK CLOCK_MONOTONIC
+#define ADTHREAD_SEM_WAIT(sem,ts) sem_clockwait(sem,CLOCK_MONOTONIC,ts)
+#else
+#define ADTHREAD_WAIT_CLOCK CLOCK_REALTIME
+#define ADTHREAD_SEM_WAIT(sem,ts) sem_timedwait(sem,ts)
+#endif
+int ADThread::wait_with_timeout(void)
+{
+	struct timespec ts;
+	clock_gettime(ADTHREAD_WAIT_CLOCK,&ts);
+	ts.tv_sec  += wait_timeout_ms/1000;
+	ts.tv_nsec += (long)(wait_timeout_ms%1000)*1000000L;
+	if(ts.tv_nsec>=1000000000L)
+	{
+		ts.tv_sec++;
+		ts.tv_nsec-=1000000000L;
+	}
+	while(ADTHREAD_SEM_WAIT(&one_shot_sema,&ts)!=0)
+	{
+		if(errno!=EINTR)
+			return -1;//ETIMEDOUT
+	}
+	return 0;
+}
+/*****************************************************************************/
 int ADThread::start_thread(void)//thread* th)
 {
 	if(thread_state==THREAD_STATE_ACTIVE)
@@ -149,3 +185,21 @@ int ADThread::wakeup_thread(void)
 	return 0;
 }
 /*****************************************************************************/
+//a burst of N wakeups results in a single sem_post(and a single context switch)
+//as long as the thread has not yet started processing the previous one.
+int ADThread::wakeup_thread_coalesced(void)
+{
+	if(th_type!=THREAD_TYPE_MONOSHOT)
+		return 0;
+	if(wakeup_pending.exchange(true)==false)
+		sem_post(&one_shot_sema);
+	return 0;
+}
+/*****************************************************************************/
+//to be called from the consumer callback(i.e by the thread itself), applies to the next wait
+int ADThread::set_wait_timeout(unsigned int ms)
+{
+	wait_timeout_ms=ms;
+	return 0;
+}
+/*****************************************************************************/
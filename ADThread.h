@@ -4,6 +4,7 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <semaphore.h>
+#include <atomic>
 
 class ADThreadProducer; //subject
 class ADThreadConsumer //observer
@@ -81,7 +82,9 @@ class ADThread : public ADThreadProducer
 	pthread_t thread;
 	pthread_attr_t attr;
 	sem_t one_shot_sema;
-
+	std::atomic<bool> wakeup_pending;//set while a coalesced wakeup is posted but not yet consumed
+	unsigned int wait_timeout_ms;//0: monoshot thread sleeps till next wakeup
+	int wait_with_timeout(void);
 
 	public:
 	ADThread();
@@ -94,6 +97,8 @@ class ADThread : public ADThreadProducer
 	int my_thread_func(int thread_id);
 	int stop_thread();
 	int wakeup_thread(void);
+	int wakeup_thread_coalesced(void);//posts only if no wakeup is pending, consumer must drain all work per call
+	int set_wait_timeout(unsigned int ms);//consumer is also called if no wakeup arrives within ms(0: no timeout)
 };
 
 #endif
@@ -0,0 +1,235 @@
+#pragma once
+//bounded lock-free ring of preallocated slots (sequence-numbered slots as described by D.Vyukov)
+//any number of threads may push, the owner thread pops. producers may also pop when the
+//drop-oldest policy needs to make room, hence the dequeue side is safe for concurrent callers too.
+#include <atomic>
+#include <vector>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <sched.h>
+#include <time.h>
+
+typedef enum RING_POLICY_T
+{
+    RING_POLICY_BLOCK,       //producer waits till a slot is freed by the consumer
+    RING_POLICY_DROP_OLDEST, //oldest queued entry is discarded to make room for the new one
+    RING_POLICY_REJECT,      //new entry is refused and push() returns -1
+    RING_POLICY_NONE
+}RING_POLICY;
+
+//"block", "drop-oldest" or "reject", returns RING_POLICY_NONE for anything else
+inline RING_POLICY RingPolicyFromString(const char *name)
+{
+    if (strcmp(name, "block") == 0)
+        return RING_POLICY_BLOCK;
+    if (strcmp(name, "drop-oldest") == 0)
+        return RING_POLICY_DROP_OLDEST;
+    if (strcmp(name, "reject") == 0)
+        return RING_POLICY_REJECT;
+    return RING_POLICY_NONE;
+}
+
+struct RingStats
+{
+    size_t   Capacity;
+    size_t   Depth;     //entries currently queued
+    size_t   HighWater; //max depth seen since startup
+    uint64_t Pushed;
+    uint64_t Popped;    //includes entries discarded by drop-oldest
+    uint64_t Dropped;   //discarded by drop-oldest policy
+    uint64_t Rejected;  //refused by reject policy
+    uint64_t Blocked;   //number of pushes which had to wait for a free slot
+};
+
+template <typename T>
+class BoundedRing
+{
+    struct Slot
+    {
+        std::atomic<size_t> Seq;
+        T Value;
+    };
+    //keep producer and consumer indexes on separate cache lines
+    char pad0[64];
+    std::atomic<size_t> EnqueuePos;
+    char pad1[64 - sizeof(std::atomic<size_t>)];
+    std::atomic<size_t> DequeuePos;
+    char pad2[64 - sizeof(std::atomic<size_t>)];
+    std::vector<Slot> Slots;
+    size_t Mask;
+    RING_POLICY Policy;
+    std::atomic<size_t> HighWater;
+    std::atomic<uint64_t> Pushed, Popped, Dropped, Rejected, Blocked;
+
+    static size_t roundup_pow2(size_t n)
+    {
+        size_t size = 2;
+        while (size < n)
+            size <<= 1;
+        return size;
+    }
+    bool try_push(T &item)
+    {
+        size_t pos = EnqueuePos.load(std::memory_order_relaxed);
+        Slot *slot;
+        for (;;)
+        {
+            slot = &Slots[pos & Mask];
+            size_t seq = slot->Seq.load(std::memory_order_acquire);
+            intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+            if (diff == 0)
+            {
+                if (EnqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                    break;
+            }
+            else if (diff < 0)
+                return false; //ring is full
+            else
+                pos = EnqueuePos.load(std::memory_order_relaxed);
+        }
+        slot->Value = std::move(item);
+        slot->Seq.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+    void update_high_water(void)
+    {
+        size_t depth = size();
+        size_t seen = HighWater.load(std::memory_order_relaxed);
+        while (depth > seen && !HighWater.compare_exchange_weak(seen, depth, std::memory_order_relaxed))
+            ;
+    }
+
+  public:
+    BoundedRing(size_t capacity, RING_POLICY policy = RING_POLICY_BLOCK)
+        : EnqueuePos(0), DequeuePos(0), Slots(roundup_pow2(capacity)), Policy(policy), HighWater(0), Pushed(0),
+          Popped(0), Dropped(0), Rejected(0), Blocked(0)
+    {
+        Mask = Slots.size() - 1;
+        for (size_t i = 0; i < Slots.size(); i++)
+            Slots[i].Seq.store(i, std::memory_order_relaxed);
+    }
+    //returns 0 on success, 1 if an old entry had to be dropped, -1 if the entry was rejected
+    int push(T &&item)
+    {
+        return push(std::move(item), [](T &) {});
+    }
+    //onDrop(entry) is called for every entry dropped by RING_POLICY_DROP_OLDEST
+    template <typename DropFunc>
+    int push(T &&item, DropFunc onDrop)
+    {
+        int ret = 0;
+        int spins = 0;
+        bool waited = false;
+        while (!try_push(item))
+        {
+            if (Policy == RING_POLICY_REJECT)
+            {
+                Rejected.fetch_add(1, std::memory_order_relaxed);
+                return -1;
+            }
+            else if (Policy == RING_POLICY_DROP_OLDEST)
+            {
+                T victim;
+                if (pop(victim))
+                {
+                    onDrop(victim);
+                    Dropped.fetch_add(1, std::memory_order_relaxed);
+                    ret = 1;
+                }
+            }
+            else //block: spin for a moment, then back off with short sleeps
+            {
+                if (!waited)
+                {
+                    Blocked.fetch_add(1, std::memory_order_relaxed);
+                    waited = true;
+                }
+                if (++spins < 64)
+                    sched_yield();
+                else
+                {
+                    struct timespec ts = {0, 100000}; //100us
+                    nanosleep(&ts, NULL);
+                }
+            }
+        }
+        Pushed.fetch_add(1, std::memory_order_relaxed);
+        update_high_water();
+        return ret;
+    }
+    bool pop(T &item)
+    {
+        size_t pos = DequeuePos.load(std::memory_order_relaxed);
+        Slot *slot;
+        for (;;)
+        {
+            slot = &Slots[pos & Mask];
+            size_t seq = slot->Seq.load(std::memory_order_acquire);
+            intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+            if (diff == 0)
+            {
+                if (DequeuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                    break;
+            }
+            else if (diff < 0)
+                return false; //ring is empty
+            else
+                pos = DequeuePos.load(std::memory_order_relaxed);
+        }
+        item = std::move(slot->Value);
+        slot->Seq.store(pos + Mask + 1, std::memory_order_release);
+        Popped.fetch_add(1, std::memory_order_relaxed);
+        return true;
+    }
+    //claims every ready entry (up to max) with a single index update and moves them to out.
+    //returns the number of entries appended to out.
+    size_t pop_batch(std::vector<T> &out, size_t max)
+    {
+        size_t pos = DequeuePos.load(std::memory_order_relaxed);
+        size_t count;
+        for (;;)
+        {
+            count = 0;
+            while (count < max)
+            {
+                Slot &slot = Slots[(pos + count) & Mask];
+                if (slot.Seq.load(std::memory_order_acquire) != pos + count + 1)
+                    break; //not yet published by producer (or ring is empty)
+                count++;
+            }
+            if (count == 0)
+                return 0;
+            if (DequeuePos.compare_exchange_weak(pos, pos + count, std::memory_order_relaxed))
+                break;
+            //pos was reloaded by a failed cas(another pop raced with us), rescan
+        }
+        for (size_t i = 0; i < count; i++)
+        {
+            Slot &slot = Slots[(pos + i) & Mask];
+            out.push_back(std::move(slot.Value));
+            slot.Seq.store(pos + i + Mask + 1, std::memory_order_release);
+        }
+        Popped.fetch_add(count, std::memory_order_relaxed);
+        return count;
+    }
+    size_t size(void) const
+    {
+        size_t head = EnqueuePos.load(std::memory_order_relaxed);
+        size_t tail = DequeuePos.load(std::memory_order_relaxed);
+        return (head > tail) ? (head - tail) : 0;
+    }
+    size_t capacity(void) const { return Slots.size(); }
+    bool empty(void) const { return size() == 0; }
+    void get_stats(RingStats &stats) const
+    {
+        stats.Capacity = capacity();
+        stats.Depth = size();
+        stats.HighWater = HighWater.load(std::memory_order_relaxed);
+        stats.Pushed = Pushed.load(std::memory_order_relaxed);
+        stats.Popped = Popped.load(std::memory_order_relaxed);
+        stats.Dropped = Dropped.load(std::memory_order_relaxed);
+        stats.Rejected = Rejected.load(std::memory_order_relaxed);
+        stats.Blocked = Blocked.load(std::memory_order_relaxed);
+    }
+};
@@ -0,0 +1,147 @@
+#include "IpcFraming.h"
+#include <string.h>
+
+IPC_FRAMING ipc_framing_from_string(const char *name)
+{
+    if (strcmp(name, "auto") == 0)
+        return IPC_FRAMING_AUTO;
+    if (strcmp(name, "ndjson") == 0)
+        return IPC_FRAMING_NDJSON;
+    if (strcmp(name, "length") == 0)
+        return IPC_FRAMING_LENGTH_PREFIX;
+    return IPC_FRAMING_NONE;
+}
+
+namespace DomainSock
+{
+FrameDecoder::FrameDecoder(IPC_FRAMING mode, size_t maxFrame) : Mode(mode), MaxFrame(maxFrame), Start(0), Scan(0)
+{
+}
+//makes sure that at least want bytes can be appended to Buf
+int FrameDecoder::make_room(size_t want)
+{
+    if (Buf == nullptr)
+    {
+        Buf = PayloadBuffer::Create(IPC_READ_CHUNK > want ? IPC_READ_CHUNK : want);
+        Start = Scan = 0;
+        return (Buf == nullptr) ? -1 : 0;
+    }
+    size_t len = Buf->length();
+    if (Buf->capacity() - len >= want)
+        return 0;
+    size_t pending = len - Start;
+    if (Buf.use_count() == 1)
+    {
+        //no frame of this buffer is referenced anymore, compact in place and grow if needed
+        if (Start > 0)
+        {
+            memmove(Buf->data(), Buf->data() + Start, pending);
+            Buf->set_length(pending);
+            Scan -= Start;
+            Start = 0;
+        }
+        size_t cap = Buf->capacity();
+        while (cap - pending < want)
+            cap *= 2;
+        return Buf->reserve(cap);
+    }
+    //frames handed out still point into this buffer, continue with the incomplete tail in a fresh one
+    size_t cap = IPC_READ_CHUNK;
+    while (cap < pending + want)
+        cap *= 2;
+    PayloadRef fresh = PayloadBuffer::Create(cap);
+    if (fresh == nullptr)
+        return -1;
+    memcpy(fresh->data(), Buf->data() + Start, pending);
+    fresh->set_length(pending);
+    Scan -= Start;
+    Start = 0;
+    Buf = std::move(fresh);
+    return 0;
+}
+char *FrameDecoder::write_ptr(size_t &space)
+{
+    if (make_room(IPC_READ_MIN_FREE) != 0)
+    {
+        space = 0;
+        return NULL;
+    }
+    space = Buf->capacity() - Buf->length();
+    return Buf->data() + Buf->length();
+}
+void FrameDecoder::commit(size_t len)
+{
+    Buf->set_length(Buf->length() + len);
+}
+int FrameDecoder::next_frame(PayloadSpan &frame)
+{
+    if (Buf == nullptr)
+        return 0;
+    const char *data = Buf->data();
+    size_t len = Buf->length();
+    if (Mode == IPC_FRAMING_AUTO)
+    {
+        if (Start >= len)
+            return 0;
+        Mode = (data[Start] == '\0') ? IPC_FRAMING_LENGTH_PREFIX : IPC_FRAMING_NDJSON;
+    }
+    if (Mode == IPC_FRAMING_LENGTH_PREFIX)
+    {
+        if (len - Start < 4)
+            return 0;
+        const unsigned char *p = (const unsigned char *)data + Start;
+        size_t flen = ((size_t)p[0] << 24) | ((size_t)p[1] << 16) | ((size_t)p[2] << 8) | (size_t)p[3];
+        if (flen > MaxFrame)
+            return -1;
+        if (len - Start - 4 < flen)
+            return 0;
+        frame = PayloadSpan(Buf, Start + 4, flen);
+        Start += 4 + flen;
+        Scan = Start;
+        return 1;
+    }
+    for (;;) //ndjson
+    {
+        if (Scan < Start)
+            Scan = Start;
+        const char *nl = (const char *)memchr(data + Scan, '\n', len - Scan);
+        if (nl == NULL)
+        {
+            Scan = len;//dont search these bytes again when more data arrives
+            return (len - Start > MaxFrame) ? -1 : 0;
+        }
+        size_t end = nl - data;
+        size_t begin = Start;
+        size_t flen = end - begin;
+        if (flen > 0 && data[end - 1] == '\r')
+            flen--;
+        Start = Scan = end + 1;
+        if (flen == 0)
+            continue;//empty line, e.g keep-alive
+        if (flen > MaxFrame)
+            return -1;
+        frame = PayloadSpan(Buf, begin, flen);
+        return 1;
+    }
+}
+int FrameDecoder::finish(PayloadSpan &frame)
+{
+    if (Buf == nullptr || Start >= Buf->length())
+        return 0;
+    if (Mode == IPC_FRAMING_LENGTH_PREFIX || (Mode == IPC_FRAMING_AUTO && Buf->data()[Start] == '\0'))
+        return 0;//truncated length-prefixed message, nothing to recover
+    frame = PayloadSpan(Buf, Start, Buf->length() - Start);
+    Start = Scan = Buf->length();
+    return 1;
+}
+void FrameDecoder::release_idle()
+{
+    if (Buf == nullptr || Start < Buf->length())
+        return;
+    if (Buf.use_count() == 1 && Buf->capacity() <= IPC_READ_CHUNK)
+        Buf->set_length(0);//keep it for the next read
+    else
+        Buf.reset();//still referenced by queued messages(or oversized), let them own it
+    Start = Scan = 0;
+}
+} // namespace DomainSock
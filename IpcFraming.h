@@ -0,0 +1,50 @@
+#pragma once
+//framing layer for the domain-socket protocol, splits a byte stream into messages.
+//ndjson        : every message is terminated by '\n' (a trailing message without '\n' is taken at EOF)
+//length-prefix : every message is preceded by its length as 4 byte big-endian integer
+//auto          : decided per connection on the first byte, 0x00 means length-prefix(a length is always
+//                below 16MB, so its first byte is zero) and anything else means ndjson.
+#include "PayloadBuffer.h"
+#include <stddef.h>
+
+typedef enum IPC_FRAMING_T
+{
+    IPC_FRAMING_AUTO,
+    IPC_FRAMING_NDJSON,
+    IPC_FRAMING_LENGTH_PREFIX,
+    IPC_FRAMING_NONE
+}IPC_FRAMING;
+#define IPC_MAX_FRAME_SIZE (256 * 1024) //larger messages are a protocol error, connection gets closed
+#define IPC_READ_CHUNK 4096             //size of a fresh reassembly buffer
+#define IPC_READ_MIN_FREE 512           //min free space offered to recv(), buffer is recycled below that
+
+//"auto", "ndjson" or "length", returns IPC_FRAMING_NONE for anything else
+IPC_FRAMING ipc_framing_from_string(const char *name);
+
+namespace DomainSock
+{
+    //per connection reassembly buffer. data is received straight into a PayloadBuffer and
+    //complete messages are handed out as spans of that buffer(no copy), only an incomplete
+    //message at the end of the buffer is moved when the buffer has to be recycled.
+    class FrameDecoder
+    {
+        IPC_FRAMING Mode;
+        size_t MaxFrame;
+        PayloadRef Buf;
+        size_t Start;//first byte not yet handed out as a frame
+        size_t Scan;//ndjson: bytes before this offset are known to have no '\n'
+        int make_room(size_t want);
+      public:
+        FrameDecoder(IPC_FRAMING mode, size_t maxFrame = IPC_MAX_FRAME_SIZE);
+        //where to recv() into, space is set to the number of bytes available; NULL on alloc failure
+        char *write_ptr(size_t &space);
+        void commit(size_t len);//len bytes were written at write_ptr()
+        //returns 1 and sets frame if a complete message is available, 0 if more data is
+        //needed and -1 on protocol error(oversized message)
+        int next_frame(PayloadSpan &frame);
+        //called on EOF, returns 1 if an unterminated ndjson message was pending
+        int finish(PayloadSpan &frame);
+        void release_idle();//drop the buffer if nothing is pending, keeps idle connections cheap
+        IPC_FRAMING mode() const { return Mode; }//IPC_FRAMING_AUTO till the first byte was seen
+    };
+} // namespace DomainSock
@@ -0,0 +1,314 @@
+#include "JsonScanner.h"
+#include <string.h>
+
+#define JSON_MAX_DEPTH 64
+
+namespace
+{
+struct Cursor
+{
+    const char *p;
+    const char *end;
+};
+
+void skip_ws(Cursor &c)
+{
+    while (c.p < c.end && (*c.p == ' ' || *c.p == '\t' || *c.p == '\n' || *c.p == '\r'))
+        c.p++;
+}
+bool is_hex(char ch)
+{
+    return (ch >= '0' && ch <= '9') || (ch >= 'a' && ch <= 'f') || (ch >= 'A' && ch <= 'F');
+}
+//c.p is on the opening quote, on success c.p is behind the closing quote
+int scan_string(Cursor &c, JsonValueSpan *val)
+{
+    const char *start = ++c.p;
+    bool escaped = false;
+    while (c.p < c.end)
+    {
+        unsigned char ch = (unsigned char)*c.p;
+        if (ch == '"')
+        {
+            if (val != NULL)
+            {
+                val->Ptr = start;
+                val->Len = c.p - start;
+                val->Type = JSON_TYPE_STRING;
+                val->Escaped = escaped;
+            }
+            c.p++;
+            return 0;
+        }
+        if (ch < 0x20)
+            return -1;//control chars must be escaped
+        if (ch == '\\')
+        {
+            escaped = true;
+            if (++c.p >= c.end)
+                return -1;
+            switch (*c.p)
+            {
+            case '"': case '\\': case '/': case 'b': case 'f': case 'n': case 'r': case 't':
+                break;
+            case 'u':
+                if (c.end - c.p < 5 || !is_hex(c.p[1]) || !is_hex(c.p[2]) || !is_hex(c.p[3]) || !is_hex(c.p[4]))
+                    return -1;
+                c.p += 4;
+                break;
+            default:
+                return -1;
+            }
+        }
+        c.p++;
+    }
+    return -1;//unterminated
+}
+int scan_number(Cursor &c)
+{
+    if (c.p < c.end && *c.p == '-')
+        c.p++;
+    if (c.p >= c.end)
+        return -1;
+    if (*c.p == '0')
+        c.p++;
+    else if (*c.p >= '1' && *c.p <= '9')
+        while (c.p < c.end && *c.p >= '0' && *c.p <= '9')
+            c.p++;
+    else
+        return -1;
+    if (c.p < c.end && *c.p == '.')
+    {
+        const char *digits = ++c.p;
+        while (c.p < c.end && *c.p >= '0' && *c.p <= '9')
+            c.p++;
+        if (c.p == digits)
+            return -1;
+    }
+    if (c.p < c.end && (*c.p == 'e' || *c.p == 'E'))
+    {
+        c.p++;
+        if (c.p < c.end && (*c.p == '+' || *c.p == '-'))
+            c.p++;
+        const char *digits = c.p;
+        while (c.p < c.end && *c.p >= '0' && *c.p <= '9')
+            c.p++;
+        if (c.p == digits)
+            return -1;
+    }
+    return 0;
+}
+int scan_literal(Cursor &c, const char *word)
+{
+    size_t n = strlen(word);
+    if ((size_t)(c.end - c.p) < n || memcmp(c.p, word, n) != 0)
+        return -1;
+    c.p += n;
+    return 0;
+}
+int scan_value(Cursor &c, int depth, JsonValueSpan *val);
+//c.p is on '{' or '[', keys/values are only looked up for the top-level object
+int scan_container(Cursor &c, int depth, const char *const *keys, JsonValueSpan *values, int nkeys)
+{
+    if (depth > JSON_MAX_DEPTH)
+        return -1;
+    bool object = (*c.p == '{');
+    char close = object ? '}' : ']';
+    c.p++;
+    skip_ws(c);
+    if (c.p < c.end && *c.p == close)
+    {
+        c.p++;
+        return 0;
+    }
+    for (;;)
+    {
+        JsonValueSpan *target = NULL;
+        if (object)
+        {
+            JsonValueSpan key;
+            if (c.p >= c.end || *c.p != '"' || scan_string(c, &key) != 0)
+                return -1;
+            for (int i = 0; i < nkeys; i++)
+            {
+                if (!key.Escaped && strlen(keys[i]) == key.Len && memcmp(keys[i], key.Ptr, key.Len) == 0)
+                    target = &values[i];
+            }
+            skip_ws(c);
+            if (c.p >= c.end || *c.p != ':')
+                return -1;
+            c.p++;
+            skip_ws(c);
+        }
+        if (scan_value(c, depth + 1, target) != 0)
+            return -1;
+        skip_ws(c);
+        if (c.p >= c.end)
+            return -1;
+        if (*c.p == close)
+        {
+            c.p++;
+            return 0;
+        }
+        if (*c.p != ',')
+            return -1;
+        c.p++;
+        skip_ws(c);
+    }
+}
+//c.p is on the first char of a value, val(if not NULL) receives its location
+int scan_value(Cursor &c, int depth, JsonValueSpan *val)
+{
+    if (c.p >= c.end)
+        return -1;
+    const char *start = c.p;
+    JSON_TYPE type;
+    int ret;
+    switch (*c.p)
+    {
+    case '"':
+        return scan_string(c, val);
+    case '{':
+        type = JSON_TYPE_OBJECT;
+        ret = scan_container(c, depth, NULL, NULL, 0);
+        break;
+    case '[':
+        type = JSON_TYPE_ARRAY;
+        ret = scan_container(c, depth, NULL, NULL, 0);
+        break;
+    case 't':
+        type = JSON_TYPE_TRUE;
+        ret = scan_literal(c, "true");
+        break;
+    case 'f':
+        type = JSON_TYPE_FALSE;
+        ret = scan_literal(c, "false");
+        break;
+    case 'n':
+        type = JSON_TYPE_NULL;
+        ret = scan_literal(c, "null");
+        break;
+    default:
+        type = JSON_TYPE_NUMBER;
+        ret = scan_number(c);
+        break;
+    }
+    if (ret == 0 && val != NULL)
+    {
+        val->Ptr = start;
+        val->Len = c.p - start;
+        val->Type = type;
+        val->Escaped = false;
+    }
+    return ret;
+}
+int hex_value(const char *p)
+{
+    int v = 0;
+    for (int i = 0; i < 4; i++)
+    {
+        char ch = p[i];
+        v <<= 4;
+        if (ch >= '0' && ch <= '9')
+            v |= ch - '0';
+        else if (ch >= 'a' && ch <= 'f')
+            v |= ch - 'a' + 10;
+        else
+            v |= ch - 'A' + 10;
+    }
+    return v;
+}
+void append_utf8(std::string &out, unsigned long cp)
+{
+    if (cp < 0x80)
+        out += (char)cp;
+    else if (cp < 0x800)
+    {
+        out += (char)(0xC0 | (cp >> 6));
+        out += (char)(0x80 | (cp & 0x3F));
+    }
+    else if (cp < 0x10000)
+    {
+        out += (char)(0xE0 | (cp >> 12));
+        out += (char)(0x80 | ((cp >> 6) & 0x3F));
+        out += (char)(0x80 | (cp & 0x3F));
+    }
+    else
+    {
+        out += (char)(0xF0 | (cp >> 18));
+        out += (char)(0x80 | ((cp >> 12) & 0x3F));
+        out += (char)(0x80 | ((cp >> 6) & 0x3F));
+        out += (char)(0x80 | (cp & 0x3F));
+    }
+}
+} // namespace
+
+int json_scan_object(const char *data, size_t len, const char *const *keys, JsonValueSpan *values, int nkeys)
+{
+    for (int i = 0; i < nkeys; i++)
+    {
+        values[i].Ptr = NULL;
+        values[i].Len = 0;
+        values[i].Type = JSON_TYPE_NONE;
+        values[i].Escaped = false;
+    }
+    Cursor c = {data, data + len};
+    skip_ws(c);
+    if (c.p >= c.end || *c.p != '{')
+        return -1;
+    if (scan_container(c, 0, keys, values, nkeys) != 0)
+        return -1;
+    skip_ws(c);
+    return (c.p == c.end) ? 0 : -1;//trailing garbage
+}
+
+int json_string_value(const JsonValueSpan &value, std::string &out)
+{
+    if (value.Type != JSON_TYPE_STRING)
+        return -1;
+    if (!value.Escaped)
+    {
+        out.assign(value.Ptr, value.Len);
+        return 0;
+    }
+    out.clear();
+    const char *p = value.Ptr;
+    const char *end = value.Ptr + value.Len;
+    while (p < end)
+    {
+        if (*p != '\\')
+        {
+            out += *p++;
+            continue;
+        }
+        p++;//scanner already verified that an escape is complete
+        switch (*p)
+        {
+        case 'b': out += '\b'; break;
+        case 'f': out += '\f'; break;
+        case 'n': out += '\n'; break;
+        case 'r': out += '\r'; break;
+        case 't': out += '\t'; break;
+        case 'u':
+        {
+            unsigned long cp = hex_value(p + 1);
+            p += 4;
+            if (cp >= 0xD800 && cp <= 0xDBFF)//high surrogate, has to be followed by a low one
+            {
+                if (end - p < 7 || p[1] != '\\' || p[2] != 'u')
+                    return -1;
+                unsigned long lo = hex_value(p + 3);
+                if (lo < 0xDC00 || lo > 0xDFFF)
+                    return -1;
+                cp = 0x10000 + ((cp - 0xD800) << 10) + (lo - 0xDC00);
+                p += 6;
+            }
+            append_utf8(out, cp);
+            break;
+        }
+        default: out += *p; break;//quote, backslash and slash
+        }
+        p++;
+    }
+    return 0;
+}
@@ -0,0 +1,32 @@
+#pragma once
+//single pass json scanner: validates one json object and reports where the values of a few
+//top-level keys are located inside the input, without building a tree or allocating memory.
+#include <string>
+#include <stddef.h>
+
+typedef enum JSON_TYPE_T
+{
+    JSON_TYPE_NONE,//key not present
+    JSON_TYPE_STRING,
+    JSON_TYPE_NUMBER,
+    JSON_TYPE_OBJECT,
+    JSON_TYPE_ARRAY,
+    JSON_TYPE_TRUE,
+    JSON_TYPE_FALSE,
+    JSON_TYPE_NULL
+}JSON_TYPE;
+
+struct JsonValueSpan
+{
+    const char *Ptr;//for strings: first char after the opening quote, still escaped
+    size_t Len;//for strings: without quotes
+    JSON_TYPE Type;
+    bool Escaped;//string contains escape sequences
+};
+
+//scans data[0..len) which has to be a single json object(surrounding whitespace allowed).
+//for every keys[i] found at top-level, values[i] is set(last one wins for duplicate keys),
+//keys not found get JSON_TYPE_NONE. returns 0 on success, -1 on invalid json.
+int json_scan_object(const char *data, size_t len, const char *const *keys, JsonValueSpan *values, int nkeys);
+//converts a JSON_TYPE_STRING value into utf-8, returns -1 on invalid escape sequences
+int json_string_value(const JsonValueSpan &value, std::string &out);
@@ -4,9 +4,23 @@
 //{
 //    "topic": "test/topic_relay","data": { "position": 1, "powerstate": "on" }
 //}
-//after receiving json string from linux-domain-socket-client, topic and data is separated using cJSON lib
-//and then topic and date will be pushed to a queue in publisher class for publishing
+//after receiving json string from linux-domain-socket-client, topic and data is separated using JsonScanner
+//and then topic and data(the original bytes of the data value) will be pushed to a queue in publisher class for publishing
 //clients use /tmp/aws-iot-demo-agent-ipc-node as linux-domain-socket-node.
+//messages are either terminated by '\n'(ndjson) or prefixed with a 4 byte big-endian length,
+//see IpcFraming.h, so any number of messages can be streamed over one connection.
+//many clients may stay connected at the same time, they are served by one epoll loop.
+//optional "qos": 0|1 and "retain": true|false override the topic policy of the publisher.
+//optionally a SOCK_DGRAM socket is served too(same event loop): every datagram is exactly one message,
+//no framing and no connection needed, up to IPC_DGRAM_BATCH datagrams are taken with one recvmmsg().
+//acks: a stream client which sets "id"(string or number) gets replies on the same connection, in the
+//framing it uses, e.g {"id":7,"status":"accepted"} and later {"id":7,"status":"delivered"}.
+//"ack": "accepted"|"delivered"|"all"|"none" selects the stages per request(default: setAckStages()),
+//final states are delivered, spooled, failed(with "error":<aws error code>), dropped or rejected.
+//acks of different requests may arrive in any order, the id is what correlates them.
+//flow control: every message counts against the credit of its client(and a total credit) till the
+//publisher is done with it. a client without credit is not read anymore, so the kernel socket buffer
+//fills up and blocks the producer, instead of the queues of the agent growing.
 
 #include "LinuxDomainSocketSrv.h"
 #include <stdio.h>
@@ -15,17 +29,57 @@
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <sys/types.h>
-#include <cjson/cJSON.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <errno.h>
+#include <string.h>
+#include <new>
+#include <algorithm>
+#include "JsonScanner.h"
 
-static const unsigned int nIncomingConnections = 5;
+static const unsigned int nIncomingConnections = 128;
+static const int nMaxEvents = 64;
+
+int ipc_ack_stages_from_string(const char *name, size_t len)
+{
+    static const struct { const char *Name; int Stages; } names[] = {
+        {"accepted", IPC_ACK_ACCEPTED}, {"delivered", IPC_ACK_DELIVERED}, {"all", IPC_ACK_ALL}, {"none", 0}};
+    for (const auto &entry : names)
+    {
+        if (strlen(entry.Name) == len && memcmp(entry.Name, name, len) == 0)
+            return entry.Stages;
+    }
+    return -1;
+}
 
 namespace DomainSock
 {
 
-LinuxDomainSocketSrv::LinuxDomainSocketSrv(const char* sockpath,TopicPublisher::Publisher *ptr)
+LinuxDomainSocketSrv::LinuxDomainSocketSrv(const char* sockpath,TopicPublisher::Publisher *ptr,IPC_FRAMING framing,const char* dgrampath)
+    :MessagesReceived(Metrics::Registry::global().counter("ipc_messages_received_total","Messages received on the domain socket")),
+     ParseFailures(Metrics::Registry::global().counter("ipc_parse_failures_total","Domain socket messages which were not valid publish requests")),
+     AcksSent(Metrics::Registry::global().counter("ipc_acks_sent_total","Acks sent to domain socket clients")),
+     ClientPauses(Metrics::Registry::global().counter("ipc_client_pauses_total","Times a domain socket client was not read for lack of credit"))
 {
         pPublisher=ptr;
+        Framing=framing;
+        ListenFd=-1;
+        EpollFd=-1;
+        NextSerial=0;
+        ClientCredit=IPC_CLIENT_CREDIT_DEFAULT;
+        TotalCredit=0;
+        TotalOutstanding=0;
+        OutstandingGauge=Metrics::Registry::global().addGauge("ipc_outstanding_messages","Domain socket messages queued or in flight in the publisher",
+                                                             [this]() { return (int64_t)TotalOutstanding.load(std::memory_order_relaxed); });
+        AckStages=IPC_ACK_ALL;
         strncpy(socket_path,sockpath,SOCK_MAX_PATH);
+        if(dgrampath!=NULL)
+            DgramPath=dgrampath;
+        AckEventFd=eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if(AckEventFd==-1)
+            printf("Error on eventfd() call, acks of the delivered stage and flow control are disabled \n");
+        else
+            pPublisher->setAckSink(this);
         //set server thread properties
         ServerThread.subscribe_thread_callback(this);
         ServerThread.set_thread_properties(THREAD_TYPE_NOBLOCK,(void *)this);
@@ -33,17 +87,21 @@ LinuxDomainSocketSrv::LinuxDomainSocketSrv(const char* sockpath,TopicPublisher::
 }
 LinuxDomainSocketSrv::~LinuxDomainSocketSrv()
 {
+    pPublisher->setAckSink(NULL);
     ServerThread.stop_thread();
+    CloseAll();
+    if( AckEventFd != -1 )
+        close(AckEventFd);
+    Metrics::Registry::global().removeGauge(OutstandingGauge);
 }
+//single threaded event loop: all clients are non-blocking and multiplexed with epoll on ServerThread
 int LinuxDomainSocketSrv::RunServer()
 {
     //create server side
-    int s = 0;
-    int s2 = 0;
-    struct sockaddr_un local, remote;
+    struct sockaddr_un local;
     int len = 0;
-    s = socket(AF_UNIX, SOCK_STREAM, 0);
-    if( -1 == s )
+    ListenFd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if( -1 == ListenFd )
     {
         printf("Error on socket() call \n");
         return 1;
@@ -53,92 +111,675 @@ int LinuxDomainSocketSrv::RunServer()
     strcpy( local.sun_path, socket_path );
     unlink(local.sun_path);
     len = strlen(local.sun_path) + sizeof(local.sun_family);
-    if( bind(s, (struct sockaddr*)&local, len) != 0)
+    if( bind(ListenFd, (struct sockaddr*)&local, len) != 0)
     {
         printf("Error on binding socket \n");
+        CloseAll();
         return 1;
     }
-    if( listen(s, nIncomingConnections) != 0 )
+    if( listen(ListenFd, nIncomingConnections) != 0 )
     {
         printf("Error on listen call \n");
         ;
     }
 
+    EpollFd = epoll_create1(EPOLL_CLOEXEC);
+    if( -1 == EpollFd )
+    {
+        printf("Error on epoll_create1() call \n");
+        CloseAll();
+        return 1;
+    }
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;//NULL marks the listening socket
+    if( epoll_ctl(EpollFd, EPOLL_CTL_ADD, ListenFd, &ev) != 0 )
+    {
+        printf("Error on epoll_ctl() call \n");
+        CloseAll();
+        return 1;
+    }
+
+    if( !DgramPath.empty() && OpenDatagramSocket() != 0 )
+    {
+        CloseAll();
+        return 1;
+    }
+    if( AckEventFd != -1 )
+    {
+        ev.events = EPOLLIN;
+        ev.data.ptr = &AckEventFd;//marks the ack queue
+        if( epoll_ctl(EpollFd, EPOLL_CTL_ADD, AckEventFd, &ev) != 0 )
+        {
+            printf("Error on epoll_ctl() call \n");
+            CloseAll();
+            return 1;
+        }
+    }
+
+    printf("Waiting for connection.... \n");
+    struct epoll_event events[nMaxEvents];
     bool bWaiting = true;
     while (bWaiting)
     {
-        unsigned int sock_len = 0;
-        printf("Waiting for connection.... \n");
-        if( (s2 = accept(s, (struct sockaddr*)&remote, &sock_len)) == -1 )
+        int n = epoll_wait(EpollFd, events, nMaxEvents, -1);
+        if( n < 0 )
         {
-            printf("Error on accept() call \n");
-            return 1;
+            if( errno == EINTR )
+                continue;
+            printf("Error on epoll_wait() call \n");
+            break;
         }
-        printf("Server connected \n");
-        int data_recv = 0;
-        char recv_buf[100];
-        char send_buf[200];
-        do{
-            memset(recv_buf, 0, 100*sizeof(char));
-            memset(send_buf, 0, 200*sizeof(char));
-            data_recv = recv(s2, recv_buf, 100, 0);
-            if(data_recv > 0)
+        //level triggered: a client with more pending data than IPC_READS_PER_TURN is reported
+        //again in the next round, after every other ready client had its turn
+        for (int i = 0; i < n && bWaiting; i++)
+        {
+            ClientConnection *client = (ClientConnection*)events[i].data.ptr;
+            if( client == NULL )
             {
-                printf("Data received: %d : %s \n", data_recv, recv_buf);
-                std::string strTopic,strData;
-                if(ParseJsonData(recv_buf,strTopic,strData) ==0)
-                {
-                    //serialized the publish requests through publisher thread(external publish request may come from linux-domain-socket)
-                    pPublisher->publishTopic(strTopic,strData);
-                }
-                //strcpy(send_buf, "Got message: ");
-                //strcat(send_buf, recv_buf);
-                if(strstr(recv_buf, "quit")!=0)
-                {
-                    //printf("Exit command received -> quitting \n");
+                AcceptClients();
+                continue;
+            }
+            if( events[i].data.ptr == &AckEventFd )
+            {
+                bool quit = false;
+                SendCompletedAcks(quit);
+                if( quit )
+                    bWaiting = false;
+                continue;
+            }
+            if( client == DgramClient.get() )
+            {
+                bool quit = false;
+                if( !client->Paused )
+                    ReadDatagrams(quit);
+                if( quit )
                     bWaiting = false;
-                    break;
-                }
-                //if( send(s2, send_buf, strlen(send_buf)*sizeof(char), 0) == -1 )
-                //    printf("Error on send() call \n");
+                continue;
             }
-            else
-                printf("Error on recv() call \n");
-        }while(data_recv > 0);
-        close(s2);
+            //clients are only closed here, acks of other clients just shut them down(this array
+            //may still hold events of them)
+            bool quit = false;
+            uint32_t ev = events[i].events;
+            int ret = 0;
+            if( ev & EPOLLOUT )
+                ret = FlushClient(*client);
+            if( ret == 0 && !client->ReadClosed && !client->Paused && (ev & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) )
+                ret = ReadClient(*client, quit);
+            else if( ret == 0 && !client->Paused && (ev & (EPOLLHUP | EPOLLERR)) )
+                ret = -1;
+            if( ret == 0 )
+                ret = FlushClient(*client);//acks of the accepted stage
+            if( ret == 0 && client->ReadClosed && client->PendingAcks == 0 && client->Output.empty() )
+                ret = -1;
+            if( ret != 0 )
+                CloseClient(client);
+            if( quit )
+                bWaiting = false;
+        }
+    }
+    CloseAll();
+    return 0;
+}
+int LinuxDomainSocketSrv::AcceptClients()
+{
+    for (;;)
+    {
+        int fd = accept4(ListenFd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if( fd == -1 )
+        {
+            if( errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR )
+                printf("Error on accept() call \n");
+            return 0;
+        }
+        if( Clients.size() >= IPC_MAX_CLIENTS )
+        {
+            printf("Too many clients, rejecting connection \n");
+            close(fd);
+            continue;
+        }
+        std::unique_ptr<ClientConnection> client(new ClientConnection(fd, ++NextSerial, Framing));
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLRDHUP;
+        client->Events = ev.events;
+        ev.data.ptr = client.get();
+        if( epoll_ctl(EpollFd, EPOLL_CTL_ADD, fd, &ev) != 0 )
+        {
+            printf("Error on epoll_ctl() call \n");
+            close(fd);
+            continue;
+        }
+        ClientsBySerial[client->Serial] = client.get();
+        Clients[fd] = std::move(client);
+        //printf("Server connected \n");
+    }
+}
+int LinuxDomainSocketSrv::ReadClient(ClientConnection &client, bool &quit)
+{
+    PayloadSpan frame;
+    for (int turn = 0; turn < IPC_READS_PER_TURN; turn++)
+    {
+        //frames received earlier go first, the socket is only read with credit left
+        if( DrainFrames(client, quit) != 0 )
+            return -1;
+        if( quit )
+            return 0;
+        if( !HasCredit(client) )
+        {
+            PauseClient(client);
+            return 0;
+        }
+        size_t space = 0;
+        char *recv_buf = client.Decoder.write_ptr(space);
+        if( recv_buf == NULL )
+        {
+            printf("Out of memory for client buffer \n");
+            return -1;
+        }
+        int data_recv = recv(client.Fd, recv_buf, space, 0);
+        if( data_recv == 0 )
+        {
+            //client closed the connection(or only its sending side and waits for acks),
+            //an unterminated last message is still valid
+            if( client.Decoder.finish(frame) == 1 )
+                quit = ProcessFrame(frame, &client);
+            client.ReadClosed = true;
+            UpdateEvents(client);
+            return 0;
+        }
+        if( data_recv < 0 )
+        {
+            if( errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR )
+                break;//drained for now
+            printf("Error on recv() call \n");
+            return -1;
+        }
+        client.Decoder.commit(data_recv);
+        //printf("Data received: %d \n", data_recv);
+    }
+    if( DrainFrames(client, quit) != 0 )
+        return -1;
+    client.Decoder.release_idle();
+    return 0;//more data may be pending, epoll will report this client again
+}
+int LinuxDomainSocketSrv::DrainFrames(ClientConnection &client, bool &quit)
+{
+    PayloadSpan frame;
+    int ret = 0;
+    while( HasCredit(client) && (ret = client.Decoder.next_frame(frame)) == 1 )
+    {
+        if( ProcessFrame(frame, &client) )
+        {
+            quit = true;
+            return 0;
+        }
+    }
+    if( ret < 0 )
+    {
+        printf("Message too large, closing connection \n");
+        return -1;
     }
     return 0;
 }
+bool LinuxDomainSocketSrv::HasCredit(const ClientConnection &client) const
+{
+    if( AckEventFd == -1 )
+        return true;
+    //the total applies even if a single client may use all of it
+    if( ClientCredit != 0 && client.Outstanding >= ClientCredit )
+        return false;
+    return TotalCredit == 0 || TotalOutstanding.load(std::memory_order_relaxed) < TotalCredit;
+}
+void LinuxDomainSocketSrv::PauseClient(ClientConnection &client)
+{
+    if( client.Paused )
+        return;
+    client.Paused = true;
+    PausedClients.push_back(client.Serial);
+    ClientPauses.add();
+    UpdateEvents(client);
+}
+//called after credit was returned, clients are only shut down here(closed by the next epoll round)
+void LinuxDomainSocketSrv::ResumeClients(bool &quit)
+{
+    std::vector<uint64_t> paused;
+    paused.swap(PausedClients);
+    for (size_t i = 0; i < paused.size(); i++)
+    {
+        auto it = ClientsBySerial.find(paused[i]);
+        if( it == ClientsBySerial.end() )
+            continue;//client is gone
+        ClientConnection &client = *it->second;
+        if( quit || !HasCredit(client) )
+        {
+            PausedClients.push_back(client.Serial);
+            continue;
+        }
+        client.Paused = false;
+        UpdateEvents(client);//back in epoll, a shut down client is closed by the next round
+        if( &client == DgramClient.get() )
+            continue;
+        if( DrainFrames(client, quit) != 0 || FlushClient(client) != 0 )
+            shutdown(client.Fd, SHUT_RDWR);
+        else if( !HasCredit(client) )
+            PauseClient(client);//buffered frames used it up again
+    }
+}
+int LinuxDomainSocketSrv::OpenDatagramSocket()
+{
+    struct sockaddr_un local;
+    if( DgramPath.length() >= sizeof(local.sun_path) )
+    {
+        printf("datagram socket path too long \n");
+        return -1;
+    }
+    DgramArena.reset(new (std::nothrow) char[IPC_DGRAM_BATCH * IPC_DGRAM_MAX_SIZE]);//pages are touched on demand
+    if( !DgramArena )
+    {
+        printf("Out of memory for datagram buffer \n");
+        return -1;
+    }
+    int fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if( -1 == fd )
+    {
+        printf("Error on datagram socket() call \n");
+        return -1;
+    }
+    DgramClient.reset(new ClientConnection(fd, ++NextSerial, IPC_FRAMING_NONE));
+    ClientsBySerial[DgramClient->Serial] = DgramClient.get();
+    memset(&local, 0, sizeof(local));
+    local.sun_family = AF_UNIX;
+    strcpy( local.sun_path, DgramPath.c_str() );
+    unlink(local.sun_path);
+    if( bind(fd, (struct sockaddr*)&local, sizeof(local)) != 0 )
+    {
+        printf("Error on binding datagram socket %s \n", DgramPath.c_str());
+        return -1;
+    }
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = DgramClient.get();
+    DgramClient->Events = ev.events;
+    if( epoll_ctl(EpollFd, EPOLL_CTL_ADD, fd, &ev) != 0 )
+    {
+        printf("Error on epoll_ctl() call \n");
+        return -1;
+    }
+    return 0;
+}
+//the datagrams of one recvmmsg() call are copied into a single PayloadBuffer, one allocation per batch
+void LinuxDomainSocketSrv::ReadDatagrams(bool &quit)
+{
+    struct mmsghdr msgs[IPC_DGRAM_BATCH];
+    struct iovec iovs[IPC_DGRAM_BATCH];
+    for (int turn = 0; turn < IPC_READS_PER_TURN; turn++)
+    {
+        if( !HasCredit(*DgramClient) )
+        {
+            PauseClient(*DgramClient);//datagrams wait in the socket, senders block once it is full
+            return;
+        }
+        for (int i = 0; i < IPC_DGRAM_BATCH; i++)
+        {
+            iovs[i].iov_base = DgramArena.get() + (size_t)i * IPC_DGRAM_MAX_SIZE;
+            iovs[i].iov_len = IPC_DGRAM_MAX_SIZE;
+            memset(&msgs[i].msg_hdr, 0, sizeof(msgs[i].msg_hdr));
+            msgs[i].msg_hdr.msg_iov = &iovs[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+        }
+        int n = recvmmsg(DgramClient->Fd, msgs, IPC_DGRAM_BATCH, MSG_DONTWAIT, NULL);
+        if( n <= 0 )
+        {
+            if( n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR )
+                printf("Error on recvmmsg() call \n");
+            return;
+        }
+        size_t total = 0;
+        for (int i = 0; i < n; i++)
+        {
+            if( !(msgs[i].msg_hdr.msg_flags & MSG_TRUNC) )
+                total += msgs[i].msg_len;
+        }
+        PayloadRef batch = PayloadBuffer::Create(total ? total : 1);
+        if( batch == nullptr )
+        {
+            printf("Out of memory for datagram batch \n");
+            return;
+        }
+        size_t used = 0;
+        for (int i = 0; i < n && !quit; i++)
+        {
+            if( msgs[i].msg_hdr.msg_flags & MSG_TRUNC )
+            {
+                printf("Datagram too large, dropping it \n");
+                MessagesReceived.add();
+                ParseFailures.add();
+                continue;
+            }
+            memcpy(batch->data() + used, iovs[i].iov_base, msgs[i].msg_len);
+            batch->set_length(used + msgs[i].msg_len);
+            quit = ProcessFrame(PayloadSpan(batch, used, msgs[i].msg_len), DgramClient.get());
+            used += msgs[i].msg_len;
+        }
+        if( quit || n < IPC_DGRAM_BATCH )
+            return;//drained for now
+    }
+}
+bool LinuxDomainSocketSrv::ProcessFrame(const PayloadSpan &frame, ClientConnection *client)
+{
+    if( frame.length() == 4 && memcmp(frame.data(), "quit", 4) == 0 )
+    {
+        //printf("Exit command received -> quitting \n");
+        return true;
+    }
+    std::string strTopic;
+    PayloadSpan payload;
+    int qos, retain;
+    AckRequest ack;
+    bool stream = client != DgramClient.get();//datagram senders get no acks
+    MessagesReceived.add();
+    int ret = ParseJsonData(frame,strTopic,payload,qos,retain,stream ? &ack : NULL);
+    int stages = (!stream || ack.Id.empty()) ? 0 : (ack.Stages < 0 ? AckStages : ack.Stages);
+    if( AckEventFd == -1 )
+        stages &= ~IPC_ACK_DELIVERED;
+    if( ret != 0 )
+    {
+        ParseFailures.add();
+        if( stages )
+            QueueAck(*client, ack.Id, "rejected", "\"invalid request\"");
+        return false;
+    }
+    //every message is tagged for the credit, the tag also finds the client of a delivered-stage ack.
+    //registered before publishing, the publish may complete before publishTopic returns
+    uint64_t tag = 0;
+    if( AckEventFd != -1 )
+        tag = (client->Serial << IPC_TAG_SEQ_BITS) | (client->NextSeq++ & ((1u << IPC_TAG_SEQ_BITS) - 1));
+    if( stages & IPC_ACK_DELIVERED )
+    {
+        std::lock_guard<std::mutex> lock(AckLock);
+        PendingAcks[tag] = PendingAck{client->Serial, ack.Id};
+        client->PendingAcks++;
+    }
+    //serialized the publish requests through publisher thread(external publish request may come from linux-domain-socket)
+    if( pPublisher->publishTopic(std::move(strTopic),std::move(payload),qos,retain,tag) != 0 )
+    {
+        if( stages & IPC_ACK_DELIVERED )
+        {
+            std::lock_guard<std::mutex> lock(AckLock);
+            PendingAcks.erase(tag);
+            client->PendingAcks--;
+        }
+        if( stages )
+            QueueAck(*client, ack.Id, "rejected", "\"queue full\"");
+        return false;
+    }
+    if( tag )
+    {
+        client->Outstanding++;
+        TotalOutstanding.fetch_add(1, std::memory_order_relaxed);
+    }
+    if( stages & IPC_ACK_ACCEPTED )
+        QueueAck(*client, ack.Id, "accepted", NULL);
+    return false;
+}
+//may be called from any thread, the acks are sent by the event loop
+void LinuxDomainSocketSrv::publish_acked(uint64_t tag,PUBLISH_ACK_STATUS status,int errorCode)
+{
+    bool wakeup;
+    {
+        std::lock_guard<std::mutex> lock(AckLock);
+        wakeup = CompletedAcks.empty();
+        CompletedAcks.push_back(CompletedAck{tag, status, errorCode});
+    }
+    if( wakeup )
+    {
+        uint64_t one = 1;
+        ssize_t ret = write(AckEventFd, &one, sizeof(one));//cannot overflow, the loop resets it on every wakeup
+        (void)ret;
+    }
+}
+void LinuxDomainSocketSrv::SendCompletedAcks(bool &quit)
+{
+    uint64_t count;
+    ssize_t ret = read(AckEventFd, &count, sizeof(count));//resets the eventfd, acks are taken from the list
+    (void)ret;
+    struct Resolved
+    {
+        uint64_t Serial;
+        std::string Id;
+        CompletedAck Ack;
+    };
+    std::vector<CompletedAck> done;
+    std::vector<Resolved> acks;
+    {
+        std::lock_guard<std::mutex> lock(AckLock);
+        done.swap(CompletedAcks);
+        for (const CompletedAck &completed : done)
+        {
+            if( PendingAcks.empty() )
+                break;
+            auto it = PendingAcks.find(completed.Tag);
+            if( it == PendingAcks.end() )
+                continue;
+            acks.push_back(Resolved{it->second.Serial, std::move(it->second.Id), completed});
+            PendingAcks.erase(it);
+        }
+    }
+    //credit goes back to the clients
+    for (const CompletedAck &completed : done)
+    {
+        TotalOutstanding.fetch_sub(1, std::memory_order_relaxed);
+        auto it = ClientsBySerial.find(completed.Tag >> IPC_TAG_SEQ_BITS);
+        if( it != ClientsBySerial.end() )
+            it->second->Outstanding--;
+    }
+    std::vector<ClientConnection*> touched;
+    for (const Resolved &resolved : acks)
+    {
+        auto it = ClientsBySerial.find(resolved.Serial);
+        if( it == ClientsBySerial.end() )
+            continue;//client is gone
+        ClientConnection *client = it->second;
+        client->PendingAcks--;
+        char error[32];
+        switch( resolved.Ack.Status )
+        {
+        case PUBLISH_ACK_DELIVERED:
+            QueueAck(*client, resolved.Id, "delivered", NULL);
+            break;
+        case PUBLISH_ACK_SPOOLED:
+            QueueAck(*client, resolved.Id, "spooled", NULL);
+            break;
+        case PUBLISH_ACK_FAILED:
+            snprintf(error, sizeof(error), "%d", resolved.Ack.ErrorCode);
+            QueueAck(*client, resolved.Id, "failed", error);
+            break;
+        default:
+            QueueAck(*client, resolved.Id, "dropped", NULL);
+            break;
+        }
+        if( std::find(touched.begin(), touched.end(), client) == touched.end() )
+            touched.push_back(client);
+    }
+    for (ClientConnection *client : touched)
+    {
+        //closed by the next epoll round(EPOLLHUP)
+        if( FlushClient(*client) != 0 || (client->ReadClosed && client->PendingAcks == 0 && client->Output.empty()) )
+            shutdown(client->Fd, SHUT_RDWR);
+    }
+    ResumeClients(quit);
+}
+//{"id":<id>,"status":"<status>"[,"error":<error>]} in the framing of the client
+void LinuxDomainSocketSrv::QueueAck(ClientConnection &client, const std::string &id, const char *status, const char *error)
+{
+    if( client.Output.size() > IPC_ACK_MAX_OUTPUT )
+    {
+        printf("Client does not read its acks, closing connection \n");
+        shutdown(client.Fd, SHUT_RDWR);
+        return;
+    }
+    std::string ack = "{\"id\":" + id + ",\"status\":\"" + status + "\"";
+    if( error != NULL )
+        ack = ack + ",\"error\":" + error;
+    ack += "}";
+    if( client.Decoder.mode() == IPC_FRAMING_LENGTH_PREFIX )
+    {
+        uint32_t len = ack.length();
+        char prefix[4] = {(char)(len >> 24), (char)(len >> 16), (char)(len >> 8), (char)len};
+        client.Output.append(prefix, 4);
+    }
+    else
+        ack += "\n";
+    client.Output += ack;
+    AcksSent.add();
+}
+int LinuxDomainSocketSrv::FlushClient(ClientConnection &client)
+{
+    size_t sent = 0;
+    while( sent < client.Output.length() )
+    {
+        ssize_t n = send(client.Fd, client.Output.data() + sent, client.Output.length() - sent, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if( n < 0 )
+        {
+            if( errno == EINTR )
+                continue;
+            if( errno == EAGAIN || errno == EWOULDBLOCK )
+                break;
+            return -1;
+        }
+        sent += n;
+    }
+    client.Output.erase(0, sent);
+    UpdateEvents(client);
+    return 0;
+}
+//EPOLLOUT only while acks are waiting, no EPOLLIN once the client shut down its side or while it is paused.
+//a paused client without acks to send is taken out of epoll, EPOLLHUP of a client which already closed
+//would be reported in every round otherwise(its data is still read once it has credit again)
+void LinuxDomainSocketSrv::UpdateEvents(ClientConnection &client)
+{
+    uint32_t events = (client.ReadClosed || client.Paused ? 0 : (EPOLLIN | EPOLLRDHUP)) | (client.Output.empty() ? 0 : EPOLLOUT);
+    if( events == 0 && client.Paused )
+    {
+        if( client.Registered && epoll_ctl(EpollFd, EPOLL_CTL_DEL, client.Fd, NULL) == 0 )
+            client.Registered = false;
+        return;
+    }
+    if( events == client.Events && client.Registered )
+        return;
+    struct epoll_event ev;
+    ev.events = events;
+    ev.data.ptr = &client;
+    if( epoll_ctl(EpollFd, client.Registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, client.Fd, &ev) == 0 )
+    {
+        client.Events = events;
+        client.Registered = true;
+    }
+}
+void LinuxDomainSocketSrv::CloseClient(ClientConnection *client)
+{
+    int fd = client->Fd;
+    if( client->Registered )
+        epoll_ctl(EpollFd, EPOLL_CTL_DEL, fd, NULL);
+    close(fd);
+    ClientsBySerial.erase(client->Serial);
+    Clients.erase(fd);//releases client
+}
+void LinuxDomainSocketSrv::CloseAll()
+{
+    for (auto &it : Clients)
+        close(it.first);
+    Clients.clear();
+    ClientsBySerial.clear();
+    if( EpollFd != -1 )
+        close(EpollFd);
+    if( ListenFd != -1 )
+        close(ListenFd);
+    if( DgramClient )
+        close(DgramClient->Fd);
+    DgramClient.reset();
+    PausedClients.clear();
+    EpollFd = -1;
+    ListenFd = -1;
+}
 int LinuxDomainSocketSrv::thread_callback_function(void* pUserData,ADThreadProducer* pObj)
 {
     return RunServer();
 }
 
-int LinuxDomainSocketSrv::ParseJsonData(const char* data,std::string &resTopic, std::string &resData)
+//single pass over the message: topic is copied out, the data value is forwarded verbatim as a span
+//of the received buffer(no json tree, no re-serialization)
+int LinuxDomainSocketSrv::ParseJsonData(const PayloadSpan &msg,std::string &resTopic, PayloadSpan &resData, int &resQos, int &resRetain,
+                                        AckRequest *resAck)
 {
-    cJSON *extern_data = cJSON_Parse(data);
-    if (extern_data == NULL)
+    static const char *const keys[] = {"topic", "data", "qos", "retain", "id", "ack"};
+    JsonValueSpan values[6];
+    if (json_scan_object(msg.data(), msg.length(), keys, values, resAck ? 6 : 4) != 0)
     {
-        const char *error_ptr = cJSON_GetErrorPtr();
-        if (error_ptr != NULL)
+        printf("Error: invalid json data\n");
+        return -1;//invalid json data
+    }
+    if (resAck != NULL)
+    {
+        //id is taken first, so that an invalid request can still be rejected with its id
+        if (values[4].Type == JSON_TYPE_STRING)
+            resAck->Id.assign(values[4].Ptr - 1, values[4].Len + 2);
+        else if (values[4].Type == JSON_TYPE_NUMBER)
+            resAck->Id.assign(values[4].Ptr, values[4].Len);
+        else if (values[4].Type != JSON_TYPE_NONE)
         {
-            printf("Error before: %s\n", error_ptr);
+            printf("Error: id has to be a string or a number\n");
+            return -1;
+        }
+        if (values[5].Type == JSON_TYPE_STRING)
+            resAck->Stages = ipc_ack_stages_from_string(values[5].Ptr, values[5].Len);
+        if ((values[5].Type == JSON_TYPE_STRING && resAck->Stages < 0) || (values[5].Type != JSON_TYPE_NONE && values[5].Type != JSON_TYPE_STRING))
+        {
+            printf("Error: ack has to be accepted, delivered, all or none\n");
+            resAck->Stages = -1;
+            return -1;
         }
-        return -1;//invalid json data
     }
-
-    //valid json data
-    const cJSON *topic = cJSON_GetObjectItemCaseSensitive(extern_data, "topic");
-    if (cJSON_IsString(topic) && (topic->valuestring != NULL))
+    if (json_string_value(values[0], resTopic) != 0 || resTopic.empty())
     {
-        //printf("topic is: \"%s\"\n", topic->valuestring);
-        resTopic = topic->valuestring;
+        printf("Error: topic is missing\n");
+        return -1;
     }
-
-    const cJSON *dataObj = cJSON_GetObjectItemCaseSensitive(extern_data, "data");
-    //printf("data is: \"%s\"\n", cJSON_Print(dataObj));
-    resData=cJSON_Print(dataObj);
-    cJSON_Delete(extern_data);
+    if (!topic_name_valid(resTopic.data(), resTopic.length()))
+    {
+        printf("Error: topic must not contain wildcards\n");
+        return -1;
+    }
+    if (values[1].Type == JSON_TYPE_NONE)
+    {
+        printf("Error: data is missing\n");
+        return -1;
+    }
+    resQos = PUBLISH_QOS_DEFAULT;
+    if (values[2].Type == JSON_TYPE_NUMBER && values[2].Len == 1 && (values[2].Ptr[0] == '0' || values[2].Ptr[0] == '1'))
+        resQos = values[2].Ptr[0] - '0';
+    else if (values[2].Type != JSON_TYPE_NONE)
+    {
+        printf("Error: qos has to be 0 or 1\n");
+        return -1;
+    }
+    resRetain = PUBLISH_QOS_DEFAULT;
+    if (values[3].Type == JSON_TYPE_TRUE || values[3].Type == JSON_TYPE_FALSE)
+        resRetain = (values[3].Type == JSON_TYPE_TRUE);
+    else if (values[3].Type != JSON_TYPE_NONE)
+    {
+        printf("Error: retain has to be true or false\n");
+        return -1;
+    }
+    //strings are forwarded including their quotes, same as any other json value
+    const char *start = values[1].Ptr;
+    size_t len = values[1].Len;
+    if (values[1].Type == JSON_TYPE_STRING)
+    {
+        start--;
+        len += 2;
+    }
+    resData = PayloadSpan(msg.Buffer, msg.Offset + (start - msg.data()), len);
     return 0;
 }
 } // namespace DomainSock
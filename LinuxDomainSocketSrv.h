@@ -1,22 +1,129 @@
 #pragma once
 #include "ADThread.h"
 #include "Publisher.h"
+#include "IpcFraming.h"
+#include "MetricsRegistry.h"
 #include <string>
+#include <vector>
+#include <unordered_map>
+#include <memory>
+#include <mutex>
+#include <atomic>
 #define SOCK_MAX_PATH 4096
+#define IPC_MAX_CLIENTS 512     //concurrent producer connections served by the event loop
+#define IPC_READS_PER_TURN 4    //max recv() calls per client per event-loop round(fairness between clients)
+#define IPC_DGRAM_BATCH 64      //max datagrams taken with one recvmmsg() call
+#define IPC_DGRAM_MAX_SIZE (64*1024) //larger datagrams are dropped
+#define IPC_ACK_ACCEPTED 0x1    //ack stages: request is queued for publishing
+#define IPC_ACK_DELIVERED 0x2   //publish is done(PUBACK, written for QoS0, spooled or failed)
+#define IPC_ACK_ALL (IPC_ACK_ACCEPTED | IPC_ACK_DELIVERED)
+#define IPC_ACK_MAX_OUTPUT (1024*1024) //unread acks of a client, the connection is closed beyond
+#define IPC_CLIENT_CREDIT_DEFAULT 256 //messages of one client which may be queued or in flight
+#define IPC_TAG_SEQ_BITS 24 //publish tag: client serial << IPC_TAG_SEQ_BITS | sequence number
+
+//"accepted", "delivered", "all" or "none", returns -1 for anything else
+int ipc_ack_stages_from_string(const char *name, size_t len);
+
 namespace DomainSock
 {
-    class LinuxDomainSocketSrv : public ADThreadConsumer
+    struct ClientConnection
+    {
+        int Fd;
+        uint64_t Serial;//unique per connection, fds are reused
+        FrameDecoder Decoder;//per client reassembly buffer
+        std::string Output;//acks not yet sent
+        uint32_t Events;//epoll events currently registered
+        size_t PendingAcks;//delivered-stage acks still to come
+        size_t Outstanding;//messages queued or in flight in the publisher, limited by the credit
+        uint32_t NextSeq;
+        bool ReadClosed;//client shut down its side, connection is kept till all acks are sent
+        bool Paused;//no credit left, socket is not read till messages of it completed
+        bool Registered;//in the epoll set(added right after construction), paused clients may be taken out
+        ClientConnection(int fd, uint64_t serial, IPC_FRAMING framing)
+            : Fd(fd), Serial(serial), Decoder(framing), Events(0), PendingAcks(0), Outstanding(0), NextSeq(0),
+              ReadClosed(false), Paused(false), Registered(true) {}
+    };
+    //"id" and "ack" of a publish request
+    struct AckRequest
+    {
+        std::string Id;//json text of the id(strings with quotes), empty: no ack requested
+        int Stages;//IPC_ACK_* bits, -1: not given(server default applies)
+        AckRequest() : Stages(-1) {}
+    };
+
+    class LinuxDomainSocketSrv : public ADThreadConsumer, public PublishAckSink
     {
         TopicPublisher::Publisher *pPublisher;
         char socket_path[SOCK_MAX_PATH +1];
+        std::string DgramPath;//datagram socket, one publish request per datagram(empty: disabled)
+        IPC_FRAMING Framing;
+        int ListenFd;
+        int EpollFd;
+        std::unique_ptr<ClientConnection> DgramClient;//the datagram socket, shares one credit
+        std::unique_ptr<char[]> DgramArena;//IPC_DGRAM_BATCH slots of IPC_DGRAM_MAX_SIZE for recvmmsg
+        std::unordered_map<int, std::unique_ptr<ClientConnection>> Clients;
+        std::unordered_map<uint64_t, ClientConnection*> ClientsBySerial;
+        uint64_t NextSerial;
+        //acks of the delivered stage: tag -> client and id, completions are queued by publish_acked()
+        //and sent by the event loop(woken up through AckEventFd)
+        struct PendingAck
+        {
+            uint64_t Serial;
+            std::string Id;
+        };
+        struct CompletedAck
+        {
+            uint64_t Tag;
+            PUBLISH_ACK_STATUS Status;
+            int ErrorCode;
+        };
+        int AckStages;//default stages of requests with an id
+        //credit based flow control: every message is tagged and counted till the publisher reports it
+        //done, a client without credit is not read anymore(its socket buffer fills up and blocks it)
+        size_t ClientCredit;//0: unlimited
+        size_t TotalCredit;//all clients together, 0: unlimited
+        std::atomic<size_t> TotalOutstanding;
+        std::vector<uint64_t> PausedClients;
+        int AckEventFd;
+        std::mutex AckLock;
+        std::unordered_map<uint64_t, PendingAck> PendingAcks;
+        std::vector<CompletedAck> CompletedAcks;
         ADThread ServerThread;//thread for linux-domain-socket-server
+        Metrics::Counter &MessagesReceived;
+        Metrics::Counter &ParseFailures;
+        Metrics::Counter &AcksSent;
+        Metrics::Counter &ClientPauses;
+        int OutstandingGauge;
         virtual int monoshot_callback_function(void* pUserData,ADThreadProducer* pObj){return 0;};//we are not using this one
         virtual int thread_callback_function(void* pUserData,ADThreadProducer* pObj);//{return 0;};//we are not using this one..
-        //int ParseJsonData(const char* data);
-        int ParseJsonData(const char* data,std::string &resTopic, std::string &resData);
+        bool ProcessFrame(const PayloadSpan &frame, ClientConnection *client);//returns true if frame was a quit command
+        int AcceptClients();
+        int ReadClient(ClientConnection &client, bool &quit);//returns -1 if client has to be closed
+        int DrainFrames(ClientConnection &client, bool &quit);//frames already received, as far as credit allows
+        bool HasCredit(const ClientConnection &client) const;
+        void PauseClient(ClientConnection &client);
+        void ResumeClients(bool &quit);
+        int OpenDatagramSocket();
+        void ReadDatagrams(bool &quit);
+        void QueueAck(ClientConnection &client, const std::string &id, const char *status, const char *detail);
+        int FlushClient(ClientConnection &client);//returns -1 if client has to be closed
+        void UpdateEvents(ClientConnection &client);
+        void SendCompletedAcks(bool &quit);//also returns credit, paused clients continue
+        void CloseClient(ClientConnection *client);
+        void CloseAll();
       public:
-        LinuxDomainSocketSrv(const char* sockpath,TopicPublisher::Publisher *ptr);
+        //dgrampath: additional SOCK_DGRAM socket(NULL: none), served by the same event loop
+        LinuxDomainSocketSrv(const char* sockpath,TopicPublisher::Publisher *ptr,IPC_FRAMING framing=IPC_FRAMING_AUTO,const char* dgrampath=NULL);
         ~LinuxDomainSocketSrv();
+        void setAckStages(int stages){AckStages=stages;}//IPC_ACK_* bits, has to be called before clients connect
+        //messages per client and of all clients together which may be queued or in flight(0: unlimited),
+        //has to be called before clients connect
+        void setCredit(size_t perClient,size_t total){ClientCredit=perClient;TotalCredit=total;}
         int RunServer();
+        virtual void publish_acked(uint64_t tag,PUBLISH_ACK_STATUS status,int errorCode);
+        //splits a publish request into topic, data(a span of msg) and qos/retain, returns -1 if invalid.
+        //resAck(optional) gets "id"/"ack", also if the request is invalid otherwise
+        static int ParseJsonData(const PayloadSpan &msg,std::string &resTopic, PayloadSpan &resData, int &resQos, int &resRetain,
+                                 AckRequest *resAck=NULL);
     };
 } // namespace DomainSock
\ No newline at end of file
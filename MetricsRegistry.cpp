@@ -0,0 +1,245 @@
+#include "MetricsRegistry.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <algorithm>
+#include <new>
+
+namespace
+{
+//shard of the calling thread, assigned once per thread
+size_t thread_shard(void)
+{
+    static std::atomic<size_t> nextShard(0);
+    static thread_local size_t shard = nextShard.fetch_add(1, std::memory_order_relaxed) % METRICS_SHARDS;
+    return shard;
+}
+//prometheus bucket bounds in microseconds, exported as seconds
+const uint64_t PrometheusBounds[] = {100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000, 100000,
+                                     250000, 500000, 1000000, 2500000, 5000000, 10000000, 30000000, 60000000};
+void append_format(std::string &out, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+void append_format(std::string &out, const char *fmt, ...)
+{
+    char line[512];
+    va_list args;
+    va_start(args, fmt);
+    int len = vsnprintf(line, sizeof(line), fmt, args);
+    va_end(args);
+    if (len > 0)
+        out.append(line, std::min((size_t)len, sizeof(line) - 1));
+}
+} // namespace
+
+namespace Metrics
+{
+Counter::Counter()
+{
+    for (Shard &shard : Shards)
+        shard.Value.store(0, std::memory_order_relaxed);
+}
+void *Counter::operator new(size_t size)
+{
+    void *p = NULL;
+    if (posix_memalign(&p, METRICS_CACHE_LINE, size) != 0)
+        throw std::bad_alloc();
+    return p;
+}
+void Counter::operator delete(void *p)
+{
+    free(p);
+}
+void Counter::add(uint64_t n)
+{
+    Shards[thread_shard()].Value.fetch_add(n, std::memory_order_relaxed);
+}
+uint64_t Counter::value() const
+{
+    uint64_t sum = 0;
+    for (const Shard &shard : Shards)
+        sum += shard.Value.load(std::memory_order_relaxed);
+    return sum;
+}
+
+Histogram::Histogram() : Count(0), Sum(0), Max(0)
+{
+    for (std::atomic<uint64_t> &bucket : Buckets)
+        bucket.store(0, std::memory_order_relaxed);
+}
+size_t Histogram::bucket_index(uint64_t us)
+{
+    if (us < (1u << HISTOGRAM_SUB_BITS))
+        return us;//exact below 16us
+    int bits = 63 - __builtin_clzll(us);
+    if (bits >= HISTOGRAM_MAX_BITS)
+        return HISTOGRAM_BUCKETS - 1;
+    size_t sub = (us >> (bits - HISTOGRAM_SUB_BITS)) & ((1u << HISTOGRAM_SUB_BITS) - 1);
+    return ((size_t)(bits - HISTOGRAM_SUB_BITS + 1) << HISTOGRAM_SUB_BITS) + sub;
+}
+uint64_t Histogram::bucket_upper(size_t index)
+{
+    if (index < (1u << HISTOGRAM_SUB_BITS))
+        return index;
+    size_t group = index >> HISTOGRAM_SUB_BITS;
+    uint64_t sub = index & ((1u << HISTOGRAM_SUB_BITS) - 1);
+    return (((1ull << HISTOGRAM_SUB_BITS) + sub + 1) << (group - 1)) - 1;
+}
+void Histogram::record(uint64_t us)
+{
+    Buckets[bucket_index(us)].fetch_add(1, std::memory_order_relaxed);
+    Count.fetch_add(1, std::memory_order_relaxed);
+    Sum.fetch_add(us, std::memory_order_relaxed);
+    uint64_t max = Max.load(std::memory_order_relaxed);
+    while (us > max && !Max.compare_exchange_weak(max, us, std::memory_order_relaxed))
+        ;
+}
+uint64_t Histogram::countBelow(uint64_t us) const
+{
+    uint64_t count = 0;
+    for (size_t i = 0; i < HISTOGRAM_BUCKETS && bucket_upper(i) <= us; i++)
+        count += Buckets[i].load(std::memory_order_relaxed);
+    return count;
+}
+uint64_t Histogram::percentile(double p) const
+{
+    uint64_t total = 0;
+    for (const std::atomic<uint64_t> &bucket : Buckets)
+        total += bucket.load(std::memory_order_relaxed);
+    if (total == 0)
+        return 0;
+    uint64_t target = (uint64_t)(total * p / 100.0 + 0.5);
+    if (target == 0)
+        target = 1;
+    uint64_t seen = 0;
+    for (size_t i = 0; i < HISTOGRAM_BUCKETS; i++)
+    {
+        seen += Buckets[i].load(std::memory_order_relaxed);
+        if (seen >= target)
+            return std::min(bucket_upper(i), max());
+    }
+    return max();
+}
+
+Registry &Registry::global()
+{
+    static Registry registry;
+    return registry;
+}
+Registry::Entry *Registry::find(const std::string &name)
+{
+    for (auto &entry : Entries)
+    {
+        if (entry->Name == name)
+            return entry.get();
+    }
+    return NULL;
+}
+Counter &Registry::counter(const std::string &name, const std::string &help)
+{
+    std::lock_guard<std::mutex> lock(Lock);
+    Entry *entry = find(name);
+    if (entry != NULL && !entry->C)
+    {
+        fprintf(stderr, "metric %s is already registered with another type\n", name.c_str());
+        abort();
+    }
+    if (entry == NULL)
+    {
+        Entries.emplace_back(new Entry{name, help, std::unique_ptr<Counter>(new Counter()), nullptr, nullptr, 0});
+        entry = Entries.back().get();
+    }
+    return *entry->C;
+}
+Histogram &Registry::histogram(const std::string &name, const std::string &help)
+{
+    std::lock_guard<std::mutex> lock(Lock);
+    Entry *entry = find(name);
+    if (entry != NULL && !entry->H)
+    {
+        fprintf(stderr, "metric %s is already registered with another type\n", name.c_str());
+        abort();
+    }
+    if (entry == NULL)
+    {
+        Entries.emplace_back(new Entry{name, help, nullptr, std::unique_ptr<Histogram>(new Histogram()), nullptr, 0});
+        entry = Entries.back().get();
+    }
+    return *entry->H;
+}
+int Registry::addGauge(const std::string &name, const std::string &help, GaugeFunc fn)
+{
+    std::lock_guard<std::mutex> lock(Lock);
+    if (find(name) != NULL)
+    {
+        fprintf(stderr, "metric %s is already registered\n", name.c_str());
+        abort();
+    }
+    int id = NextGaugeId++;
+    Entries.emplace_back(new Entry{name, help, nullptr, nullptr, std::move(fn), id});
+    return id;
+}
+void Registry::removeGauge(int id)
+{
+    std::lock_guard<std::mutex> lock(Lock);
+    for (auto it = Entries.begin(); it != Entries.end(); ++it)
+    {
+        if ((*it)->GaugeId == id)
+        {
+            Entries.erase(it);
+            return;
+        }
+    }
+}
+void Registry::exportPrometheus(std::string &out)
+{
+    std::lock_guard<std::mutex> lock(Lock);
+    for (auto &entry : Entries)
+    {
+        const char *name = entry->Name.c_str();
+        append_format(out, "# HELP %s %s\n", name, entry->Help.c_str());
+        if (entry->C)
+        {
+            append_format(out, "# TYPE %s counter\n%s %llu\n", name, name, (unsigned long long)entry->C->value());
+        }
+        else if (entry->H)
+        {
+            const Histogram &h = *entry->H;
+            uint64_t count = h.count();
+            append_format(out, "# TYPE %s histogram\n", name);
+            for (uint64_t bound : PrometheusBounds)
+                append_format(out, "%s_bucket{le=\"%g\"} %llu\n", name, bound / 1e6, (unsigned long long)h.countBelow(bound));
+            append_format(out, "%s_bucket{le=\"+Inf\"} %llu\n%s_sum %.6f\n%s_count %llu\n", name, (unsigned long long)count,
+                          name, h.sum() / 1e6, name, (unsigned long long)count);
+        }
+        else if (entry->G)
+        {
+            append_format(out, "# TYPE %s gauge\n%s %lld\n", name, name, (long long)entry->G());
+        }
+    }
+}
+void Registry::exportJson(std::string &out)
+{
+    std::lock_guard<std::mutex> lock(Lock);
+    out += "{";
+    bool first = true;
+    for (auto &entry : Entries)
+    {
+        append_format(out, "%s\"%s\":", first ? "" : ",", entry->Name.c_str());
+        first = false;
+        if (entry->C)
+            append_format(out, "%llu", (unsigned long long)entry->C->value());
+        else if (entry->G)
+            append_format(out, "%lld", (long long)entry->G());
+        else if (entry->H)
+        {
+            const Histogram &h = *entry->H;
+            append_format(out, "{\"count\":%llu,\"sum_us\":%llu,\"max_us\":%llu,\"p50_us\":%llu,\"p90_us\":%llu,\"p99_us\":%llu,\"p999_us\":%llu}",
+                          (unsigned long long)h.count(), (unsigned long long)h.sum(), (unsigned long long)h.max(),
+                          (unsigned long long)h.percentile(50), (unsigned long long)h.percentile(90),
+                          (unsigned long long)h.percentile(99), (unsigned long long)h.percentile(99.9));
+        }
+        else
+            out += "null";
+    }
+    out += "}\n";
+}
+} // namespace Metrics
@@ -0,0 +1,95 @@
+#pragma once
+//process wide registry of counters, gauges and latency histograms. counters and histograms are updated
+//lock-free from any thread(relaxed atomics, counters sharded per thread so that hot paths of different
+//threads do not share cache lines), the registry lock is only taken for registration and export.
+//MetricsServer exports the registry as prometheus text or json on a unix domain socket.
+#include <atomic>
+#include <string>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <functional>
+#include <stdint.h>
+#include <time.h>
+
+#define METRICS_SHARDS 16 //counter shards, threads are spread round robin over them
+#define METRICS_CACHE_LINE 64
+#define HISTOGRAM_SUB_BITS 4 //16 linear sub-buckets per power of two, ~6% relative error
+#define HISTOGRAM_MAX_BITS 36 //values up to 2^36us(~19 hours), larger ones go to the last bucket
+#define HISTOGRAM_BUCKETS (((HISTOGRAM_MAX_BITS - HISTOGRAM_SUB_BITS) + 1) << HISTOGRAM_SUB_BITS)
+
+namespace Metrics
+{
+    inline uint64_t now_us(void)
+    {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+    }
+
+    class Counter
+    {
+        struct alignas(METRICS_CACHE_LINE) Shard
+        {
+            std::atomic<uint64_t> Value;
+        };
+        Shard Shards[METRICS_SHARDS];
+      public:
+        Counter();
+        //c++14 new does not honour alignas beyond max_align_t, so shards could straddle cache lines
+        static void *operator new(size_t size);
+        static void operator delete(void *p);
+        void add(uint64_t n = 1);
+        uint64_t value() const;
+    };
+
+    //HDR style log-linear histogram of microsecond values
+    class Histogram
+    {
+        std::atomic<uint64_t> Buckets[HISTOGRAM_BUCKETS];
+        std::atomic<uint64_t> Count, Sum, Max;
+      public:
+        Histogram();
+        void record(uint64_t us);
+        void recordSince(uint64_t startUs) { record(now_us() - startUs); }
+        uint64_t count() const { return Count.load(std::memory_order_relaxed); }
+        uint64_t sum() const { return Sum.load(std::memory_order_relaxed); }
+        uint64_t max() const { return Max.load(std::memory_order_relaxed); }
+        uint64_t countBelow(uint64_t us) const;//number of values <= us(bucket granularity)
+        uint64_t percentile(double p) const;//upper bound of the bucket holding the p-th(0..100) percentile
+        static size_t bucket_index(uint64_t us);
+        static uint64_t bucket_upper(size_t index);//largest value counted in bucket index
+    };
+
+    typedef std::function<int64_t()> GaugeFunc;
+
+    class Registry
+    {
+        struct Entry
+        {
+            std::string Name;
+            std::string Help;
+            std::unique_ptr<Counter> C;
+            std::unique_ptr<Histogram> H;
+            GaugeFunc G;
+            int GaugeId;
+        };
+        std::vector<std::unique_ptr<Entry>> Entries;//in order of registration
+        std::mutex Lock;
+        int NextGaugeId;
+        Entry *find(const std::string &name);
+        Registry() : NextGaugeId(1) {}
+      public:
+        static Registry &global();
+        //returns the existing metric if name is already registered, references stay valid till exit.
+        //a name registered with another type is a programming error and aborts
+        Counter &counter(const std::string &name, const std::string &help);
+        Histogram &histogram(const std::string &name, const std::string &help);
+        //fn is called on export, returns an id for removeGauge(fn must not be called after its owner is gone).
+        //a gauge name has to be unique, registering it again before removeGauge() aborts
+        int addGauge(const std::string &name, const std::string &help, GaugeFunc fn);
+        void removeGauge(int id);
+        void exportPrometheus(std::string &out);//histograms in seconds, as prometheus suggests
+        void exportJson(std::string &out);//histograms in microseconds with percentiles
+    };
+} // namespace Metrics
@@ -0,0 +1,138 @@
+//answers every connection on the metrics socket with a snapshot of Registry::global() and closes it.
+#include "MetricsServer.h"
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+namespace Metrics
+{
+MetricsServer::MetricsServer(const char *sockpath) : SocketPath(sockpath), ListenFd(-1)
+{
+    ServerThread.subscribe_thread_callback(this);
+    ServerThread.set_thread_properties(THREAD_TYPE_NOBLOCK, (void *)this);
+    ServerThread.start_thread();
+}
+MetricsServer::~MetricsServer()
+{
+    ServerThread.stop_thread();
+    if (ListenFd != -1)
+        close(ListenFd);
+    unlink(SocketPath.c_str());
+}
+int MetricsServer::thread_callback_function(void* pUserData,ADThreadProducer* pObj)
+{
+    return RunServer();
+}
+int MetricsServer::RunServer()
+{
+    struct sockaddr_un local;
+    if (SocketPath.length() >= sizeof(local.sun_path))
+    {
+        printf("metrics socket path too long\n");
+        return 1;
+    }
+    ListenFd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (ListenFd == -1)
+    {
+        printf("Error on metrics socket() call\n");
+        return 1;
+    }
+    memset(&local, 0, sizeof(local));
+    local.sun_family = AF_UNIX;
+    strcpy(local.sun_path, SocketPath.c_str());
+    unlink(local.sun_path);
+    if (bind(ListenFd, (struct sockaddr *)&local, sizeof(local)) != 0 || listen(ListenFd, 8) != 0)
+    {
+        printf("Error on binding metrics socket %s\n", SocketPath.c_str());
+        close(ListenFd);
+        ListenFd = -1;
+        return 1;
+    }
+    for (;;)
+    {
+        int fd = accept4(ListenFd, NULL, NULL, SOCK_CLOEXEC);
+        if (fd == -1)
+        {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            printf("Error on metrics accept() call\n");
+            return 1;
+        }
+        ServeClient(fd);
+        close(fd);
+    }
+    return 0;
+}
+//waits for events on fd till the absolute deadline, returns false once it has passed
+static bool poll_until(int fd, short events, uint64_t deadline)
+{
+    for (;;)
+    {
+        uint64_t now = Metrics::now_us() / 1000;
+        if (now >= deadline)
+            return false;
+        struct pollfd pfd = {fd, events, 0};
+        int ret = poll(&pfd, 1, (int)(deadline - now));
+        if (ret < 0 && errno == EINTR)
+            continue;
+        return ret == 1;
+    }
+}
+//every client is served within one deadline, one which trickles its request or does not read the
+//response must not stall the server
+void MetricsServer::ServeClient(int fd)
+{
+    //the request is optional, a client which sends nothing gets prometheus text after the timeout
+    char request[METRICS_MAX_REQUEST + 1];
+    size_t len = 0;
+    uint64_t deadline = Metrics::now_us() / 1000 + METRICS_REQUEST_TIMEOUT_MS;
+    while (len < METRICS_MAX_REQUEST && memchr(request, '\n', len) == NULL && poll_until(fd, POLLIN, deadline))
+    {
+        ssize_t n = recv(fd, request + len, METRICS_MAX_REQUEST - len, MSG_DONTWAIT);
+        if (n < 0 && (errno == EINTR || errno == EAGAIN))
+            continue;
+        if (n <= 0)
+            break;
+        len += n;
+    }
+    request[len] = '\0';
+    bool http = (strncmp(request, "GET ", 4) == 0);
+    bool json = http ? (strstr(request, ".json ") != NULL || strstr(request, "format=json") != NULL)
+                     : (strncmp(request, "json", 4) == 0);
+    std::string body;
+    if (json)
+        Registry::global().exportJson(body);
+    else
+        Registry::global().exportPrometheus(body);
+    std::string response;
+    if (http)
+    {
+        char header[256];
+        snprintf(header, sizeof(header), "HTTP/1.0 200 OK\r\nContent-Type: %s\r\nContent-Length: %zu\r\nConnection: close\r\n\r\n",
+                 json ? "application/json" : "text/plain; version=0.0.4", body.length());
+        response = header;
+    }
+    response += body;
+    size_t sent = 0;
+    deadline = Metrics::now_us() / 1000 + METRICS_SEND_TIMEOUT_MS;
+    while (sent < response.length())
+    {
+        ssize_t n = send(fd, response.data() + sent, response.length() - sent, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && errno == EAGAIN)
+        {
+            if (!poll_until(fd, POLLOUT, deadline))
+                break;
+            continue;
+        }
+        if (n <= 0)
+            break;
+        sent += n;
+    }
+}
+} // namespace Metrics
@@ -0,0 +1,29 @@
+#pragma once
+//exports the metrics registry on a unix domain socket(next to the ipc socket). a client connects and
+//optionally sends a request: "json" for json, anything else(or nothing within METRICS_REQUEST_TIMEOUT_MS)
+//for prometheus text. an http GET is answered with an http response, e.g
+//curl --unix-socket /tmp/aws-iot-demo-agent-ipc-node-metrics http://localhost/metrics(or /metrics.json)
+#include "ADThread.h"
+#include "MetricsRegistry.h"
+#include <string>
+#define METRICS_SOCKET_SUFFIX "-metrics"
+#define METRICS_REQUEST_TIMEOUT_MS 200 //for the whole request, not per read
+#define METRICS_SEND_TIMEOUT_MS 1000 //for the whole response
+#define METRICS_MAX_REQUEST 1024
+
+namespace Metrics
+{
+    class MetricsServer : public ADThreadConsumer
+    {
+        std::string SocketPath;
+        int ListenFd;
+        ADThread ServerThread;//serves one client at a time, blocking
+        virtual int monoshot_callback_function(void* pUserData,ADThreadProducer* pObj){return 0;};//we are not using this one
+        virtual int thread_callback_function(void* pUserData,ADThreadProducer* pObj);
+        int RunServer();
+        void ServeClient(int fd);
+      public:
+        MetricsServer(const char *sockpath);
+        ~MetricsServer();
+    };
+} // namespace Metrics
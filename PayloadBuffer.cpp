@@ -0,0 +1,47 @@
+#include "PayloadBuffer.h"
+#include <stdlib.h>
+#include <string.h>
+
+PayloadBuffer::PayloadBuffer(char *data, size_t len, size_t cap, void (*freeFunc)(void *))
+    : Data(data), Length(len), Capacity(cap), FreeFunc(freeFunc)
+{
+}
+PayloadBuffer::~PayloadBuffer()
+{
+    if (Data != nullptr && FreeFunc != nullptr)
+        FreeFunc(Data);
+}
+std::shared_ptr<PayloadBuffer> PayloadBuffer::Create(size_t capacity)
+{
+    char *data = (char *)malloc(capacity ? capacity : 1);
+    if (data == nullptr)
+        return nullptr;
+    return std::shared_ptr<PayloadBuffer>(new PayloadBuffer(data, 0, capacity, free));
+}
+std::shared_ptr<PayloadBuffer> PayloadBuffer::CopyFrom(const void *data, size_t len)
+{
+    std::shared_ptr<PayloadBuffer> buf = Create(len);
+    if (buf == nullptr)
+        return nullptr;
+    if (len > 0)
+        memcpy(buf->Data, data, len);
+    buf->Length = len;
+    return buf;
+}
+std::shared_ptr<PayloadBuffer> PayloadBuffer::Adopt(char *data, size_t len, void (*freeFunc)(void *))
+{
+    return std::shared_ptr<PayloadBuffer>(new PayloadBuffer(data, len, len, freeFunc));
+}
+int PayloadBuffer::reserve(size_t capacity)
+{
+    if (capacity <= Capacity)
+        return 0;
+    if (FreeFunc != free)
+        return -1;//adopted memory is not ours to realloc
+    char *data = (char *)realloc(Data, capacity);
+    if (data == nullptr)
+        return -1;
+    Data = data;
+    Capacity = capacity;
+    return 0;
+}
@@ -0,0 +1,48 @@
+#pragma once
+//refcounted byte buffer for message payloads. a payload is written into a PayloadBuffer once
+//where it enters the agent and from there on only references(PayloadSpan) are passed around,
+//the last reference is dropped when the mqtt publish has completed.
+#include <memory>
+#include <stddef.h>
+
+class PayloadBuffer
+{
+    char *Data;
+    size_t Length;//bytes in use
+    size_t Capacity;//bytes allocated
+    void (*FreeFunc)(void *);//how Data has to be released
+    PayloadBuffer(char *data, size_t len, size_t cap, void (*freeFunc)(void *));
+    PayloadBuffer(const PayloadBuffer &) = delete;
+    PayloadBuffer &operator=(const PayloadBuffer &) = delete;
+
+  public:
+    ~PayloadBuffer();
+    //empty buffer with given capacity, returns nullptr if allocation fails
+    static std::shared_ptr<PayloadBuffer> Create(size_t capacity);
+    static std::shared_ptr<PayloadBuffer> CopyFrom(const void *data, size_t len);
+    //takes ownership of data, freeFunc(data) is called when last reference is gone
+    static std::shared_ptr<PayloadBuffer> Adopt(char *data, size_t len, void (*freeFunc)(void *));
+
+    char *data() { return Data; }
+    const char *data() const { return Data; }
+    size_t length() const { return Length; }
+    size_t capacity() const { return Capacity; }
+    void set_length(size_t len) { Length = (len <= Capacity) ? len : Capacity; }
+    int reserve(size_t capacity);//grows the buffer, returns -1 on failure
+};
+typedef std::shared_ptr<PayloadBuffer> PayloadRef;
+
+//a window into a shared PayloadBuffer, many spans may point into the same buffer
+struct PayloadSpan
+{
+    PayloadRef Buffer;
+    size_t Offset;
+    size_t Length;
+
+    PayloadSpan() : Offset(0), Length(0) {}
+    explicit PayloadSpan(PayloadRef buf) : Buffer(std::move(buf)), Offset(0), Length(Buffer ? Buffer->length() : 0) {}
+    PayloadSpan(PayloadRef buf, size_t offset, size_t len) : Buffer(std::move(buf)), Offset(offset), Length(len) {}
+    const char *data() const { return Buffer ? Buffer->data() + Offset : nullptr; }
+    size_t length() const { return Length; }
+    bool empty() const { return Length == 0; }
+};
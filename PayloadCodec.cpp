@@ -0,0 +1,350 @@
+#include "PayloadCodec.h"
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <limits>
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+COMPRESS_ALGO compress_algo_from_string(const char *name)
+{
+    if (strcmp(name, "deflate") == 0)
+        return COMPRESS_ALGO_DEFLATE;
+    if (strcmp(name, "zstd") == 0)
+        return COMPRESS_ALGO_ZSTD;
+    return COMPRESS_ALGO_NONE;
+}
+bool compress_algo_supported(COMPRESS_ALGO algo)
+{
+#ifdef HAVE_ZLIB
+    if (algo == COMPRESS_ALGO_DEFLATE)
+        return true;
+#endif
+#ifdef HAVE_ZSTD
+    if (algo == COMPRESS_ALGO_ZSTD)
+        return true;
+#endif
+    return false;
+}
+static uint64_t thread_cpu_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+struct PayloadCodec::Dictionary
+{
+    std::string Data;
+#ifdef HAVE_ZSTD
+    ZSTD_CDict *CDict;//created on first use, compression level is known by then
+    ZSTD_DDict *DDict;
+    Dictionary() : CDict(NULL), DDict(NULL) {}
+    ~Dictionary()
+    {
+        ZSTD_freeCDict(CDict);
+        ZSTD_freeDDict(DDict);
+    }
+#endif
+};
+
+PayloadCodec::PayloadCodec()
+    : Level(CODEC_DEFAULT_LEVEL), MinSize(CODEC_DEFAULT_MIN_SIZE), Dicts(CODEC_MAX_DICTS + 1), CompressCtx(NULL),
+      Compressed(0), Skipped(0), CompressIn(0), CompressOut(0), CompressCpuNs(0),
+      Decompressed(0), DecompressIn(0), DecompressOut(0), DecompressCpuNs(0), Errors(0)
+{
+}
+PayloadCodec::~PayloadCodec()
+{
+#ifdef HAVE_ZSTD
+    ZSTD_freeCCtx((ZSTD_CCtx *)CompressCtx);
+#endif
+}
+int PayloadCodec::loadDictionary(int id, const char *path)
+{
+    if (id < 1 || id > CODEC_MAX_DICTS)
+    {
+        printf("invalid dictionary id %d\n", id);
+        return -1;
+    }
+    FILE *fp = fopen(path, "rb");
+    if (fp == NULL)
+    {
+        printf("unable to open dictionary %s\n", path);
+        return -1;
+    }
+    std::unique_ptr<Dictionary> dict(new Dictionary());
+    char chunk[4096];
+    size_t n;
+    while ((n = fread(chunk, 1, sizeof(chunk), fp)) > 0)
+        dict->Data.append(chunk, n);
+    fclose(fp);
+    if (dict->Data.empty())
+    {
+        printf("dictionary %s is empty\n", path);
+        return -1;
+    }
+#ifdef HAVE_ZSTD
+    dict->DDict = ZSTD_createDDict(dict->Data.data(), dict->Data.size());
+    if (dict->DDict == NULL)
+        return -1;
+#endif
+    Dicts[id] = std::move(dict);
+    return 0;
+}
+PayloadCodec::Dictionary *PayloadCodec::get_dict(int id) const
+{
+    if (id < 1 || id > CODEC_MAX_DICTS)
+        return NULL;
+    return Dicts[id].get();
+}
+int PayloadCodec::addTopic(const std::string &filter, COMPRESS_ALGO algo, int dictId)
+{
+    if (!compress_algo_supported(algo))
+    {
+        printf("compression for %s is not supported by this build\n", filter.c_str());
+        return -1;
+    }
+    if (dictId != 0 && get_dict(dictId) == NULL)
+    {
+        printf("dictionary %d for %s is not loaded\n", dictId, filter.c_str());
+        return -1;
+    }
+    if (Topics.insert(filter, TopicCodecs.size()) != 0)
+    {
+        printf("invalid compression topic filter %s\n", filter.c_str());
+        return -1;
+    }
+    TopicCodec codec;
+    codec.Algo = algo;
+    codec.DictId = dictId;
+    TopicCodecs.push_back(codec);
+    return 0;
+}
+bool PayloadCodec::is_compressed(const char *data, size_t len)
+{
+    return len >= CODEC_HEADER_SIZE && (unsigned char)data[0] == CODEC_MARKER_0 && data[1] == CODEC_MARKER_1;
+}
+int PayloadCodec::compressForTopic(const std::string &topic, PayloadSpan &payload)
+{
+    size_t index = std::numeric_limits<size_t>::max();
+    Topics.match(topic.data(), topic.length(), [&index](size_t i) {
+        if (i < index)
+            index = i;
+    });
+    if (index == std::numeric_limits<size_t>::max())
+        return 0;//topic is not compressed
+    if (payload.length() < MinSize)
+    {
+        Skipped.fetch_add(1, std::memory_order_relaxed);
+        return 0;
+    }
+    const TopicCodec &codec = TopicCodecs[index];
+    Dictionary *dict = get_dict(codec.DictId);
+    uint64_t start = thread_cpu_ns();
+    PayloadRef buf;
+    {
+        std::lock_guard<std::mutex> lock(CompressLock);
+        if (codec.Algo == COMPRESS_ALGO_DEFLATE)
+            buf = compress_deflate(dict, payload.data(), payload.length());
+        else
+            buf = compress_zstd(dict, payload.data(), payload.length());
+    }
+    CompressCpuNs.fetch_add(thread_cpu_ns() - start, std::memory_order_relaxed);
+    if (buf == nullptr)
+    {
+        Errors.fetch_add(1, std::memory_order_relaxed);
+        return -1;//caller sends the payload as it is
+    }
+    if (buf->length() >= payload.length())
+    {
+        Skipped.fetch_add(1, std::memory_order_relaxed);
+        return 0;//not worth it
+    }
+    buf->data()[0] = (char)CODEC_MARKER_0;
+    buf->data()[1] = CODEC_MARKER_1;
+    buf->data()[2] = (char)codec.Algo;
+    buf->data()[3] = (char)codec.DictId;
+    Compressed.fetch_add(1, std::memory_order_relaxed);
+    CompressIn.fetch_add(payload.length(), std::memory_order_relaxed);
+    CompressOut.fetch_add(buf->length(), std::memory_order_relaxed);
+    payload = PayloadSpan(std::move(buf));
+    return 1;
+}
+int PayloadCodec::decompress(PayloadSpan &payload)
+{
+    const char *data = payload.data();
+    size_t len = payload.length();
+    if (!is_compressed(data, len))
+        return 0;
+    COMPRESS_ALGO algo = (COMPRESS_ALGO)(unsigned char)data[2];
+    int dictId = (unsigned char)data[3];
+    Dictionary *dict = get_dict(dictId);
+    PayloadRef buf;
+    uint64_t start = thread_cpu_ns();
+    if (dictId == 0 || dict != NULL)
+    {
+        if (algo == COMPRESS_ALGO_DEFLATE)
+            buf = decompress_deflate(dict, data + CODEC_HEADER_SIZE, len - CODEC_HEADER_SIZE);
+        else if (algo == COMPRESS_ALGO_ZSTD)
+            buf = decompress_zstd(dict, data + CODEC_HEADER_SIZE, len - CODEC_HEADER_SIZE);
+    }
+    DecompressCpuNs.fetch_add(thread_cpu_ns() - start, std::memory_order_relaxed);
+    if (buf == nullptr)
+    {
+        Errors.fetch_add(1, std::memory_order_relaxed);
+        return -1;//unknown algorithm or dictionary, or corrupt data
+    }
+    Decompressed.fetch_add(1, std::memory_order_relaxed);
+    DecompressIn.fetch_add(len, std::memory_order_relaxed);
+    DecompressOut.fetch_add(buf->length(), std::memory_order_relaxed);
+    payload = PayloadSpan(std::move(buf));
+    return 1;
+}
+PayloadRef PayloadCodec::compress_deflate(const Dictionary *dict, const char *src, size_t len)
+{
+#ifdef HAVE_ZLIB
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    if (deflateInit(&zs, Level > 9 ? 9 : Level) != Z_OK)
+        return nullptr;
+    if (dict != NULL && deflateSetDictionary(&zs, (const Bytef *)dict->Data.data(), dict->Data.size()) != Z_OK)
+    {
+        deflateEnd(&zs);
+        return nullptr;
+    }
+    uLong bound = deflateBound(&zs, len);//includes the dictionary id of the zlib header
+    PayloadRef buf = PayloadBuffer::Create(CODEC_HEADER_SIZE + bound);
+    if (buf == nullptr)
+    {
+        deflateEnd(&zs);
+        return nullptr;
+    }
+    zs.next_in = (Bytef *)src;
+    zs.avail_in = len;
+    zs.next_out = (Bytef *)buf->data() + CODEC_HEADER_SIZE;
+    zs.avail_out = bound;
+    int ret = deflate(&zs, Z_FINISH);
+    size_t out = zs.total_out;
+    deflateEnd(&zs);
+    if (ret != Z_STREAM_END)
+        return nullptr;
+    buf->set_length(CODEC_HEADER_SIZE + out);
+    return buf;
+#else
+    return nullptr;
+#endif
+}
+PayloadRef PayloadCodec::decompress_deflate(const Dictionary *dict, const char *src, size_t len)
+{
+#ifdef HAVE_ZLIB
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    if (inflateInit(&zs) != Z_OK)
+        return nullptr;
+    size_t cap = len * 4 + 256;//grows if needed
+    if (cap > CODEC_MAX_DECOMPRESSED)
+        cap = CODEC_MAX_DECOMPRESSED;
+    PayloadRef buf = PayloadBuffer::Create(cap);
+    zs.next_in = (Bytef *)src;
+    zs.avail_in = len;
+    int ret = Z_OK;
+    while (buf != nullptr)
+    {
+        zs.next_out = (Bytef *)buf->data() + zs.total_out;
+        zs.avail_out = cap - zs.total_out;
+        ret = inflate(&zs, Z_NO_FLUSH);
+        if (ret == Z_NEED_DICT)
+        {
+            if (dict == NULL || inflateSetDictionary(&zs, (const Bytef *)dict->Data.data(), dict->Data.size()) != Z_OK)
+                break;
+            continue;
+        }
+        if (ret != Z_OK && ret != Z_BUF_ERROR)
+            break;//done or corrupt
+        if (zs.avail_out > 0)
+            break;//input is truncated
+        if (cap >= CODEC_MAX_DECOMPRESSED || buf->reserve(cap * 2 > CODEC_MAX_DECOMPRESSED ? CODEC_MAX_DECOMPRESSED : cap * 2) != 0)
+            break;
+        cap = buf->capacity();
+    }
+    size_t out = zs.total_out;
+    inflateEnd(&zs);
+    if (ret != Z_STREAM_END || buf == nullptr)
+        return nullptr;
+    buf->set_length(out);
+    return buf;
+#else
+    return nullptr;
+#endif
+}
+PayloadRef PayloadCodec::compress_zstd(Dictionary *dict, const char *src, size_t len)
+{
+#ifdef HAVE_ZSTD
+    if (CompressCtx == NULL && (CompressCtx = ZSTD_createCCtx()) == NULL)
+        return nullptr;
+    if (dict != NULL && dict->CDict == NULL && (dict->CDict = ZSTD_createCDict(dict->Data.data(), dict->Data.size(), Level)) == NULL)
+        return nullptr;
+    size_t bound = ZSTD_compressBound(len);
+    PayloadRef buf = PayloadBuffer::Create(CODEC_HEADER_SIZE + bound);
+    if (buf == nullptr)
+        return nullptr;
+    char *dst = buf->data() + CODEC_HEADER_SIZE;
+    size_t out;
+    if (dict != NULL)
+        out = ZSTD_compress_usingCDict((ZSTD_CCtx *)CompressCtx, dst, bound, src, len, dict->CDict);
+    else
+        out = ZSTD_compressCCtx((ZSTD_CCtx *)CompressCtx, dst, bound, src, len, Level);
+    if (ZSTD_isError(out))
+        return nullptr;
+    buf->set_length(CODEC_HEADER_SIZE + out);
+    return buf;
+#else
+    return nullptr;
+#endif
+}
+PayloadRef PayloadCodec::decompress_zstd(const Dictionary *dict, const char *src, size_t len)
+{
+#ifdef HAVE_ZSTD
+    //frames are written with their content size, so the output is allocated once
+    unsigned long long size = ZSTD_getFrameContentSize(src, len);
+    if (size == ZSTD_CONTENTSIZE_ERROR || size == ZSTD_CONTENTSIZE_UNKNOWN || size > CODEC_MAX_DECOMPRESSED)
+        return nullptr;
+    PayloadRef buf = PayloadBuffer::Create(size);
+    ZSTD_DCtx *dctx = ZSTD_createDCtx();
+    if (buf == nullptr || dctx == NULL)
+    {
+        ZSTD_freeDCtx(dctx);
+        return nullptr;
+    }
+    size_t out;
+    if (dict != NULL)
+        out = ZSTD_decompress_usingDDict(dctx, buf->data(), size, src, len, dict->DDict);
+    else
+        out = ZSTD_decompressDCtx(dctx, buf->data(), size, src, len);
+    ZSTD_freeDCtx(dctx);
+    if (ZSTD_isError(out))
+        return nullptr;
+    buf->set_length(out);
+    return buf;
+#else
+    return nullptr;
+#endif
+}
+void PayloadCodec::getStats(CodecStats &stats) const
+{
+    stats.Compressed = Compressed.load(std::memory_order_relaxed);
+    stats.Skipped = Skipped.load(std::memory_order_relaxed);
+    stats.CompressIn = CompressIn.load(std::memory_order_relaxed);
+    stats.CompressOut = CompressOut.load(std::memory_order_relaxed);
+    stats.CompressCpuNs = CompressCpuNs.load(std::memory_order_relaxed);
+    stats.Decompressed = Decompressed.load(std::memory_order_relaxed);
+    stats.DecompressIn = DecompressIn.load(std::memory_order_relaxed);
+    stats.DecompressOut = DecompressOut.load(std::memory_order_relaxed);
+    stats.DecompressCpuNs = DecompressCpuNs.load(std::memory_order_relaxed);
+    stats.Errors = Errors.load(std::memory_order_relaxed);
+}
@@ -0,0 +1,97 @@
+#pragma once
+//optional payload compression for publish(per topic) and subscribe(by content marker).
+//a compressed payload starts with a 4 byte marker: 0xC0 'Z' <algo> <dictionary id, 0: none>
+//0xC0 never appears in utf-8 text, so json/text payloads are not mistaken for compressed ones.
+//dictionaries are raw files(e.g trained with "zstd --train"), both sides must load the same file
+//under the same id. deflate needs zlib, zstd needs libzstd at build time(HAVE_ZLIB/HAVE_ZSTD).
+#include "PayloadBuffer.h"
+#include "TopicTrie.h"
+#include <string>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <stdint.h>
+
+#define CODEC_HEADER_SIZE 4
+#define CODEC_MARKER_0 0xC0
+#define CODEC_MARKER_1 'Z'
+#define CODEC_MAX_DICTS 255
+#define CODEC_DEFAULT_MIN_SIZE 64 //smaller payloads are sent as they are
+#define CODEC_DEFAULT_LEVEL 3
+#define CODEC_MIN_LEVEL 1
+#define CODEC_MAX_LEVEL 22 //zstd maximum, deflate uses at most 9
+#define CODEC_MAX_DECOMPRESSED (16*1024*1024) //limit for decompressed incoming payloads
+
+typedef enum COMPRESS_ALGO_T
+{
+    COMPRESS_ALGO_DEFLATE = 1,//values are part of the marker, do not change
+    COMPRESS_ALGO_ZSTD = 2,
+    COMPRESS_ALGO_NONE
+}COMPRESS_ALGO;
+
+//"deflate" or "zstd", returns COMPRESS_ALGO_NONE for anything else
+COMPRESS_ALGO compress_algo_from_string(const char *name);
+bool compress_algo_supported(COMPRESS_ALGO algo);//false if library was not available at build time
+
+struct CodecStats
+{
+    uint64_t Compressed;//payloads sent compressed
+    uint64_t Skipped;//payloads sent as they are(too small or not compressible)
+    uint64_t CompressIn;//bytes before and after compression of the Compressed payloads
+    uint64_t CompressOut;
+    uint64_t CompressCpuNs;//thread cpu time spent in compression
+    uint64_t Decompressed;
+    uint64_t DecompressIn;
+    uint64_t DecompressOut;
+    uint64_t DecompressCpuNs;
+    uint64_t Errors;//failed compressions and corrupt or unknown incoming payloads
+};
+
+class PayloadCodec
+{
+    struct Dictionary;
+    struct TopicCodec
+    {
+        COMPRESS_ALGO Algo;
+        int DictId;
+    };
+    int Level;
+    size_t MinSize;
+    std::vector<std::unique_ptr<Dictionary>> Dicts;//index is the dictionary id
+    std::vector<TopicCodec> TopicCodecs;//in order of registration, first matching filter wins
+    TopicTrie<size_t> Topics;
+    void *CompressCtx;//zstd context, only used under CompressLock
+    std::mutex CompressLock;
+    std::atomic<uint64_t> Compressed, Skipped, CompressIn, CompressOut, CompressCpuNs;
+    std::atomic<uint64_t> Decompressed, DecompressIn, DecompressOut, DecompressCpuNs, Errors;
+    Dictionary *get_dict(int id) const;
+    //compressed data is placed behind CODEC_HEADER_SIZE bytes left free for the marker
+    PayloadRef compress_deflate(const Dictionary *dict, const char *src, size_t len);
+    PayloadRef compress_zstd(Dictionary *dict, const char *src, size_t len);
+    PayloadRef decompress_deflate(const Dictionary *dict, const char *src, size_t len);
+    PayloadRef decompress_zstd(const Dictionary *dict, const char *src, size_t len);
+  public:
+    PayloadCodec();
+    ~PayloadCodec();
+    //setup functions have to be called before the codec is used
+    //returns -1 outside CODEC_MIN_LEVEL..CODEC_MAX_LEVEL
+    int setLevel(int level)
+    {
+        if (level < CODEC_MIN_LEVEL || level > CODEC_MAX_LEVEL)
+            return -1;
+        Level = level;
+        return 0;
+    }
+    void setMinSize(size_t size) { MinSize = size; }
+    int loadDictionary(int id, const char *path);//id 1..255, returns -1 on error
+    int addTopic(const std::string &filter, COMPRESS_ALGO algo, int dictId);//returns -1 on error
+    bool enabled() const { return !TopicCodecs.empty(); }
+
+    //returns 1 if payload was replaced by the compressed one, 0 if left as it is, -1 on error
+    int compressForTopic(const std::string &topic, PayloadSpan &payload);
+    //returns 1 if payload was replaced by the decompressed one, 0 if it has no marker, -1 on error
+    int decompress(PayloadSpan &payload);
+    static bool is_compressed(const char *data, size_t len);
+    void getStats(CodecStats &stats) const;
+};
@@ -0,0 +1,119 @@
+#include "ProcessUtils.h"
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <spawn.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <array>
+#include <memory>
+#include <stdexcept>
+using namespace Aws::Crt;
+
+extern char **environ;
+#define RUN_COMMAND_READ_CHUNK 4096
+
+/*****************************************************************************/
+//from a security perspective this is not a good idea to allow invoking remote commands,
+//but as a demo application, we will allow this and we assume user of this binary knows how to use it
+String InvokeShellCommand(const char* command)
+{
+    std::array<char, 128> buffer;
+    String result;
+    std::unique_ptr<FILE, decltype(&pclose)> pipe(popen(command, "r"), pclose);
+    if (!pipe) {
+        throw std::runtime_error("popen() failed!");
+    }
+    while (fgets(buffer.data(), buffer.size(), pipe.get()) != nullptr) {
+        result += buffer.data();
+    }
+    return result;
+}
+//check if this is a valid file in the filesystem
+bool IsValidFile(const char* filepath)
+{
+        struct stat buffer;
+        if(stat(filepath,&buffer)!=0)
+                return false;
+        if(buffer.st_mode & S_IFREG)
+                return true;
+        return false;//it could be a directory
+}
+pid_t SpawnProcess(const char* path, int *stdinFd, int *stdoutFd)
+{
+    int in[2] = {-1, -1}, out[2] = {-1, -1};
+    if (stdinFd != NULL && pipe2(in, O_CLOEXEC) != 0)
+        return -1;
+    if (stdoutFd != NULL && pipe2(out, O_CLOEXEC) != 0)
+    {
+        if (in[0] != -1)
+        {
+            close(in[0]);
+            close(in[1]);
+        }
+        return -1;
+    }
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    if (in[0] != -1)
+        posix_spawn_file_actions_adddup2(&actions, in[0], STDIN_FILENO);
+    if (out[1] != -1)
+        posix_spawn_file_actions_adddup2(&actions, out[1], STDOUT_FILENO);
+    char *argv[] = {(char *)path, NULL};
+    pid_t pid;
+    int ret = posix_spawn(&pid, path, &actions, NULL, argv, environ);
+    if (ret == ENOEXEC)
+    {
+        //script without "#!" line, popen() used to run these through the shell as well
+        char *shArgv[] = {(char *)"/bin/sh", (char *)path, NULL};
+        ret = posix_spawn(&pid, "/bin/sh", &actions, NULL, shArgv, environ);
+    }
+    posix_spawn_file_actions_destroy(&actions);
+    //child has its own copies now
+    if (in[0] != -1)
+        close(in[0]);
+    if (out[1] != -1)
+        close(out[1]);
+    if (ret != 0)
+    {
+        printf("unable to start %s: %s\n", path, strerror(ret));
+        if (in[1] != -1)
+            close(in[1]);
+        if (out[0] != -1)
+            close(out[0]);
+        return -1;
+    }
+    if (stdinFd != NULL)
+        *stdinFd = in[1];
+    if (stdoutFd != NULL)
+        *stdoutFd = out[0];
+    return pid;
+}
+PayloadRef RunCommand(const char* path)
+{
+    int fd;
+    pid_t pid = SpawnProcess(path, NULL, &fd);
+    if (pid == -1)
+        return nullptr;
+    PayloadRef buf = PayloadBuffer::Create(RUN_COMMAND_READ_CHUNK);
+    while (buf != nullptr)
+    {
+        if (buf->capacity() - buf->length() < RUN_COMMAND_READ_CHUNK / 2 && buf->reserve(buf->capacity() * 2) != 0)
+        {
+            buf = nullptr;
+            break;
+        }
+        ssize_t n = read(fd, buf->data() + buf->length(), buf->capacity() - buf->length());
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        buf->set_length(buf->length() + n);
+    }
+    close(fd);
+    waitpid(pid, NULL, 0);
+    return buf;
+}
+/*****************************************************************************/
@@ -0,0 +1,13 @@
+#pragma once
+//helpers for running external scripts/binaries(payload generators and topic handlers)
+#include <aws/crt/Types.h>
+#include "PayloadBuffer.h"
+#include <sys/types.h>
+
+Aws::Crt::String InvokeShellCommand(const char* command);//runs command through /bin/sh and returns its stdout
+bool IsValidFile(const char* filepath);//true if filepath is a regular file
+//starts path directly(posix_spawn, no shell), a script without "#!" line is run by /bin/sh. if stdinFd/stdoutFd are not NULL, they receive our end of a
+//pipe connected to stdin/stdout of the child. returns pid of the child or -1.
+pid_t SpawnProcess(const char* path, int *stdinFd, int *stdoutFd);
+//runs path without shell and returns everything it printed on stdout, NULL if it could not be started
+PayloadRef RunCommand(const char* path);
@@ -0,0 +1,242 @@
+#include "PublishScheduler.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+static uint64_t monotonic_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+namespace TopicPublisher
+{
+PublishScheduler::PublishScheduler(Publisher *publisher)
+    : pPublisher(publisher), Wheel(WHEEL_SLOTS), CurrentTick(0), Start(0), Started(false), ActiveJobs(0), TaskCount(0)
+{
+}
+PublishScheduler::~PublishScheduler()
+{
+    stop_readers();
+}
+int PublishScheduler::addJob(const std::string &topic, uint32_t intervalMs, int64_t count,
+                             std::unique_ptr<PublishSource> source)
+{
+    if (topic.empty() || intervalMs == 0 || count == 0 || source == nullptr)
+        return -1;
+    std::unique_ptr<PublishJob> job(new PublishJob());
+    job->Topic = topic;
+    job->IntervalMs = intervalMs;
+    job->Remaining = count;
+    job->Source = std::move(source);
+    job->Deadline = 0;//first publish right after start
+    job->Fired = 0;
+    job->Missed = 0;
+    job->Busy = false;
+    job->Quit = false;
+    Jobs.push_back(std::move(job));
+    return 0;
+}
+int PublishScheduler::addTask(uint32_t intervalMs, std::function<void()> task)
+{
+    if (intervalMs == 0 || !task)
+        return -1;
+    std::unique_ptr<PublishJob> job(new PublishJob());
+    job->IntervalMs = intervalMs;
+    job->Remaining = -1;
+    job->Task = std::move(task);
+    job->Deadline = intervalMs;
+    job->Fired = 0;
+    job->Missed = 0;
+    job->Busy = false;
+    job->Quit = false;
+    Jobs.push_back(std::move(job));
+    return 0;
+}
+int PublishScheduler::loadJobFile(const char *path, SOURCE_MODE mode)
+{
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL)
+    {
+        printf("unable to open job file %s\n", path);
+        return -1;
+    }
+    char line[JOB_FILE_MAX_LINE];
+    int lineNo = 0, ret = 0;
+    while (fgets(line, sizeof(line), fp) != NULL)
+    {
+        lineNo++;
+        line[strcspn(line, "\r\n")] = '\0';
+        char topic[JOB_FILE_MAX_LINE];
+        unsigned long interval;
+        long long count;
+        int msgStart = 0;
+        const char *p = line + strspn(line, " \t");
+        if (*p == '\0' || *p == '#')
+            continue;
+        if (sscanf(p, "%s %lu %lld %n", topic, &interval, &count, &msgStart) != 3 || msgStart == 0 ||
+            interval > UINT32_MAX || addJob(topic, (uint32_t)interval, count, CreatePublishSource(p + msgStart, mode)) != 0)
+        {
+            printf("invalid job in %s line %d\n", path, lineNo);
+            ret = -1;
+        }
+    }
+    fclose(fp);
+    return ret;
+}
+void PublishScheduler::schedule(PublishJob *job)
+{
+    Wheel[job->Deadline & (WHEEL_SLOTS - 1)].push_back(job);
+}
+void PublishScheduler::fire(PublishJob *job, uint64_t now)
+{
+    PayloadSpan payload;
+    bool fired = true;
+    if (job->Task)
+        job->Task();
+    else if (!job->Source->mayBlock())
+    {
+        if (job->Source->readRecord(payload) == 0)
+            pPublisher->publishTopic(job->Topic, std::move(payload));
+    }
+    else
+    {
+        //handed to the reader thread, unless the script of the previous period is still running
+        std::lock_guard<std::mutex> lock(job->Lock);
+        fired = !job->Busy;
+        job->Busy = true;
+        job->Wake.notify_one();
+    }
+    if (!fired)
+        job->Missed++;
+    else
+        job->Fired++;
+    if (fired && job->Remaining > 0 && --job->Remaining == 0)
+    {
+        ActiveJobs--;
+        return;
+    }
+    //next deadline stays on the original grid, late periods are skipped instead of bunched up
+    job->Deadline += job->IntervalMs;
+    if (job->Deadline <= now)
+    {
+        uint64_t late = (now - job->Deadline) / job->IntervalMs + 1;
+        job->Missed += late;
+        job->Deadline += late * job->IntervalMs;
+    }
+    schedule(job);
+}
+void PublishScheduler::read_loop(PublishJob *job)
+{
+    std::unique_lock<std::mutex> lock(job->Lock);
+    for (;;)
+    {
+        job->Wake.wait(lock, [job]() { return job->Busy || job->Quit; });
+        if (job->Quit)
+            return;
+        lock.unlock();
+        PayloadSpan payload;
+        if (job->Source->readRecord(payload) == 0)
+            pPublisher->publishTopic(job->Topic, std::move(payload));
+        lock.lock();
+        job->Busy = false;
+    }
+}
+//a script which is still running is waited for
+void PublishScheduler::stop_readers()
+{
+    for (auto &job : Jobs)
+    {
+        if (!job->Reader.joinable())
+            continue;
+        {
+            std::lock_guard<std::mutex> lock(job->Lock);
+            job->Quit = true;
+            job->Wake.notify_one();
+        }
+        job->Reader.join();
+    }
+}
+void PublishScheduler::process_tick(uint64_t tick, uint64_t now)
+{
+    std::vector<PublishJob *> &slot = Wheel[tick & (WHEEL_SLOTS - 1)];
+    std::vector<PublishJob *> due;
+    for (size_t i = 0; i < slot.size();)
+    {
+        if (slot[i]->Deadline <= tick)
+        {
+            due.push_back(slot[i]);
+            slot[i] = slot.back();
+            slot.pop_back();
+        }
+        else
+            i++;//belongs to a later turn of the wheel
+    }
+    for (PublishJob *job : due)
+        fire(job, now);
+}
+//earliest deadline within one turn of the wheel, or the tick after that turn
+uint64_t PublishScheduler::next_deadline()
+{
+    for (uint64_t tick = CurrentTick; tick < CurrentTick + WHEEL_SLOTS; tick++)
+    {
+        for (PublishJob *job : Wheel[tick & (WHEEL_SLOTS - 1)])
+        {
+            if (job->Deadline <= tick)
+                return tick;
+        }
+    }
+    return CurrentTick + WHEEL_SLOTS;
+}
+void PublishScheduler::start()
+{
+    Start = monotonic_ms();
+    CurrentTick = 0;
+    ActiveJobs = 0;
+    TaskCount = 0;
+    for (auto &job : Jobs)
+    {
+        schedule(job.get());
+        if (job->Task)
+            TaskCount++;
+        else
+            ActiveJobs++;
+        if (job->Source != nullptr && job->Source->mayBlock() && !job->Reader.joinable())
+            job->Reader = std::thread(&PublishScheduler::read_loop, this, job.get());
+    }
+    Started = true;
+}
+void PublishScheduler::loop(bool tasks)
+{
+    while (ActiveJobs > 0 || (tasks && TaskCount > 0))
+    {
+        uint64_t now = monotonic_ms() - Start;
+        while (CurrentTick <= now && (ActiveJobs > 0 || tasks))
+            process_tick(CurrentTick++, now);
+        if (ActiveJobs == 0 && !tasks)
+            break;
+        uint64_t wake = Start + next_deadline();
+        struct timespec ts;
+        ts.tv_sec = wake / 1000;
+        ts.tv_nsec = (wake % 1000) * 1000000;
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+            ;
+    }
+}
+int PublishScheduler::run()
+{
+    start();
+    loop(false);
+    return 0;
+}
+int PublishScheduler::runTasks()
+{
+    if (!Started)
+        start();
+    loop(true);
+    return 0;
+}
+} // namespace TopicPublisher
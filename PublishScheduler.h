@@ -0,0 +1,73 @@
+#pragma once
+//runs any number of periodic publish jobs(topic, interval in ms, payload source) from one thread.
+//jobs are kept in a hashed timer wheel with 1ms ticks driven by CLOCK_MONOTONIC. every job fires on
+//absolute deadlines(start + n*interval), so time spent in scripts or publishing does not add drift.
+//script sources are read on a thread per job, a slow script only delays its own job: a period which
+//arrives while the previous read is still running is skipped and counted as missed.
+#include "Publisher.h"
+#include "PublishSource.h"
+#include <string>
+#include <vector>
+#include <memory>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <stdint.h>
+
+#define WHEEL_SLOTS 512 //must be a power of two, one slot per ms
+#define JOB_FILE_MAX_LINE 4096
+
+namespace TopicPublisher
+{
+    struct PublishJob
+    {
+        std::string Topic;
+        uint32_t IntervalMs;
+        int64_t Remaining;//publishes left, -1 for forever
+        std::unique_ptr<PublishSource> Source;
+        std::function<void()> Task;//runs instead of a publish, if set
+        uint64_t Deadline;//next tick(ms since scheduler start) to fire
+        uint64_t Fired;
+        uint64_t Missed;//periods skipped because job was late or its script was still running
+        //reader thread of a script source, a tick is handed over with Busy
+        std::thread Reader;
+        std::mutex Lock;
+        std::condition_variable Wake;
+        bool Busy;
+        bool Quit;
+    };
+
+    class PublishScheduler
+    {
+        Publisher *pPublisher;
+        std::vector<std::unique_ptr<PublishJob>> Jobs;
+        std::vector<std::vector<PublishJob *>> Wheel;
+        uint64_t CurrentTick;//next tick to process
+        uint64_t Start;//monotonic ms of tick 0
+        bool Started;
+        size_t ActiveJobs;//publish jobs with a count left, periodic tasks are not counted
+        size_t TaskCount;
+        void schedule(PublishJob *job);
+        void start();
+        void loop(bool tasks);//returns once ActiveJobs is 0, or never with tasks(if there are any)
+        void fire(PublishJob *job, uint64_t now);
+        void read_loop(PublishJob *job);
+        void stop_readers();
+        void process_tick(uint64_t tick, uint64_t now);
+        uint64_t next_deadline();
+      public:
+        PublishScheduler(Publisher *publisher);
+        ~PublishScheduler();
+        //count = -1 publishes forever, returns -1 on invalid arguments
+        int addJob(const std::string &topic, uint32_t intervalMs, int64_t count, std::unique_ptr<PublishSource> source);
+        //runs task on the scheduler thread every intervalMs(e.g for logging statistics), while run() or
+        //runTasks() is running. tasks do not keep run() going
+        int addTask(uint32_t intervalMs, std::function<void()> task);
+        //one job per line: <topic> <interval_ms> <count> <message or script path>, '#' starts a comment
+        int loadJobFile(const char *path, SOURCE_MODE mode);
+        size_t jobCount() const { return Jobs.size(); }
+        int run();//returns when every job has published its count(never, if one runs forever)
+        int runTasks();//keeps the tasks going after run(), never returns if there are any
+    };
+} // namespace TopicPublisher
@@ -0,0 +1,135 @@
+#include "PublishSource.h"
+#include "ProcessUtils.h"
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/wait.h>
+
+SOURCE_MODE source_mode_from_string(const char *name)
+{
+    if (strcmp(name, "oneshot") == 0)
+        return SOURCE_MODE_ONESHOT;
+    if (strcmp(name, "resident") == 0)
+        return SOURCE_MODE_RESIDENT;
+    return SOURCE_MODE_NONE;
+}
+
+namespace TopicPublisher
+{
+StaticSource::StaticSource(const std::string &message)
+{
+    Message = PayloadBuffer::CopyFrom(message.data(), message.length());
+}
+int StaticSource::readRecord(PayloadSpan &record)
+{
+    if (Message == nullptr)
+        return -1;
+    record = PayloadSpan(Message);
+    return 0;
+}
+
+int OneshotSource::readRecord(PayloadSpan &record)
+{
+    //e.g /usr/sbin/read-temperature.sh shall print json string
+    PayloadRef out = RunCommand(Command.c_str());
+    if (out == nullptr)
+        return -1;
+    record = PayloadSpan(std::move(out));
+    return 0;
+}
+
+ResidentSource::ResidentSource(const std::string &command)
+    : Command(command), Pid(-1), InFd(-1), OutFd(-1), Lines(IPC_FRAMING_NDJSON)
+{
+    start();//if it fails, it is tried again on next read
+}
+ResidentSource::~ResidentSource()
+{
+    stop();
+}
+int ResidentSource::start()
+{
+    Pid = SpawnProcess(Command.c_str(), &InFd, &OutFd);
+    if (Pid == -1)
+    {
+        InFd = OutFd = -1;
+        return -1;
+    }
+    Lines = DomainSock::FrameDecoder(IPC_FRAMING_NDJSON);
+    return 0;
+}
+void ResidentSource::stop()
+{
+    if (InFd != -1)
+        close(InFd);
+    if (OutFd != -1)
+        close(OutFd);
+    if (Pid != -1)
+    {
+        kill(Pid, SIGTERM);
+        waitpid(Pid, NULL, 0);
+    }
+    Pid = InFd = OutFd = -1;
+}
+int ResidentSource::readRecord(PayloadSpan &record)
+{
+    if (Pid == -1 && start() != 0)
+        return -1;
+    //a record may already be buffered if the script printed more than one line per tick
+    if (Lines.next_frame(record) == 1)
+        return 0;
+    if (write(InFd, "\n", 1) != 1)
+    {
+        stop();//script has exited, restart on next tick
+        return -1;
+    }
+    for (;;)
+    {
+        struct pollfd pfd = {OutFd, POLLIN, 0};
+        int ret = poll(&pfd, 1, RESIDENT_SOURCE_TIMEOUT_MS);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret <= 0)
+        {
+            //a late answer would be read on the next tick and every later publish would be one period
+            //old, the script is restarted on the next tick instead
+            printf("no record from %s, restarting it\n", Command.c_str());
+            stop();
+            return -1;
+        }
+        size_t space;
+        char *ptr = Lines.write_ptr(space);
+        if (ptr == NULL)
+            return -1;
+        ssize_t n = read(OutFd, ptr, space);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+        {
+            stop();
+            return -1;
+        }
+        Lines.commit(n);
+        int frame = Lines.next_frame(record);
+        if (frame == 1)
+            return 0;
+        if (frame < 0)
+        {
+            stop();//line too long, something is wrong with the script
+            return -1;
+        }
+    }
+}
+
+std::unique_ptr<PublishSource> CreatePublishSource(const std::string &message, SOURCE_MODE mode)
+{
+    if (!IsValidFile(message.c_str()))
+        return std::unique_ptr<PublishSource>(new StaticSource(message));
+    if (mode == SOURCE_MODE_RESIDENT)
+        return std::unique_ptr<PublishSource>(new ResidentSource(message));
+    return std::unique_ptr<PublishSource>(new OneshotSource(message));
+}
+} // namespace TopicPublisher
@@ -0,0 +1,72 @@
+#pragma once
+//where the periodic publish payload comes from(--message)
+//static   : the message string itself
+//oneshot  : message is a path to a script/binary which is started for every publish(posix_spawn, no shell,
+//           /bin/sh only for scripts without "#!" line), everything it prints to stdout is the payload
+//resident : the script is started once and stays running, on every publish the agent writes "\n"
+//           to its stdin and takes the next line it prints to stdout as payload. e.g:
+//           while read tick; do echo "{\"temp\": $(cat /sys/class/thermal/thermal_zone0/temp)}"; done
+#include "PayloadBuffer.h"
+#include "IpcFraming.h"
+#include <string>
+#include <memory>
+#include <sys/types.h>
+
+#define RESIDENT_SOURCE_TIMEOUT_MS 5000 //max wait for a record from a resident script, then it is restarted
+
+typedef enum SOURCE_MODE_T
+{
+    SOURCE_MODE_STATIC,
+    SOURCE_MODE_ONESHOT,
+    SOURCE_MODE_RESIDENT,
+    SOURCE_MODE_NONE
+}SOURCE_MODE;
+
+//"oneshot" or "resident", returns SOURCE_MODE_NONE for anything else
+SOURCE_MODE source_mode_from_string(const char *name);
+
+namespace TopicPublisher
+{
+    class PublishSource
+    {
+      public:
+        virtual ~PublishSource(){};
+        virtual int readRecord(PayloadSpan &record)=0;//returns 0 if record was filled
+        virtual bool mayBlock() const {return true;}//runs a script, read on a thread of its own by the scheduler
+    };
+
+    class StaticSource : public PublishSource
+    {
+        PayloadRef Message;//shared by all publishes, never modified
+      public:
+        StaticSource(const std::string &message);
+        virtual int readRecord(PayloadSpan &record);
+        virtual bool mayBlock() const {return false;}
+    };
+
+    class OneshotSource : public PublishSource
+    {
+        std::string Command;
+      public:
+        OneshotSource(const std::string &command) : Command(command) {}
+        virtual int readRecord(PayloadSpan &record);
+    };
+
+    class ResidentSource : public PublishSource
+    {
+        std::string Command;
+        pid_t Pid;
+        int InFd;//tick requests go here
+        int OutFd;//records come from here
+        DomainSock::FrameDecoder Lines;//splits stdout of the script into records
+        int start();
+        void stop();
+      public:
+        ResidentSource(const std::string &command);
+        ~ResidentSource();
+        virtual int readRecord(PayloadSpan &record);
+    };
+
+    //message is taken as a path if it is a valid file, else it is a static string
+    std::unique_ptr<PublishSource> CreatePublishSource(const std::string &message, SOURCE_MODE mode);
+} // namespace TopicPublisher
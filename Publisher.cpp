@@ -7,14 +7,57 @@
 #include <aws/crt/io/TlsOptions.h>
 #include <aws/iot/MqttClient.h>
 #include <iostream>
+#include <string.h>
+#include <time.h>
+#include <algorithm>
 #include "Publisher.h"
 using namespace Aws::Crt;
 
+static uint64_t monotonic_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+//FNV-1a, unlike std::hash the same in every build
+static uint64_t topic_hash(const std::string &topic)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    for (unsigned char c : topic)
+    {
+        hash ^= c;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+//jump consistent hash(Lamping, Veach), only 1/n of the topics move to another connection when one is added
+static size_t jump_hash(uint64_t key,size_t buckets)
+{
+    int64_t b = -1, j = 0;
+    while (j < (int64_t)buckets)
+    {
+        b = j;
+        key = key * 2862933555777941757ULL + 1;
+        j = (int64_t)((b + 1) * ((double)(1LL << 31) / (double)((key >> 33) + 1)));
+    }
+    return (size_t)b;
+}
+
 namespace TopicPublisher
 {
-Publisher::Publisher(std::shared_ptr<Aws::Crt::Mqtt::MqttConnection> handle)
+Publisher::Publisher(std::shared_ptr<Aws::Crt::Mqtt::MqttConnection> handle,size_t queueSize,RING_POLICY queuePolicy)
+    :PublishList(queueSize,queuePolicy),Codec(NULL),Spool(NULL),Online(true),AckSink(NULL),Stopping(false),Flushed(false),
+     InFlightWindow(PUBLISH_INFLIGHT_DEFAULT_WINDOW),
+     EnqueueLatency(Metrics::Registry::global().histogram("publish_enqueue_latency_seconds","Time a publish request waited in the queue")),
+     AckLatency(Metrics::Registry::global().histogram("publish_ack_latency_seconds","Time from publish till PUBACK"))
 {
-        connection=handle;
+        addConnection(handle);
+        PublishBatch.reserve(PUBLISH_BATCH_MAX);
+        QueueDepthGauge = Metrics::Registry::global().addGauge("publish_queue_depth","Publish requests waiting in the queue",[this]() {
+            RingStats stats;
+            PublishList.get_stats(stats);
+            return (int64_t)stats.Depth;
+        });
         //set thread properties
         PublisherThread.subscribe_thread_callback(this);
         PublisherThread.set_thread_properties(THREAD_TYPE_MONOSHOT,(void *)this);
@@ -22,34 +65,479 @@ Publisher::Publisher(std::shared_ptr<Aws::Crt::Mqtt::MqttConnection> handle)
 }
 Publisher::~Publisher()
 {
+    //records collected for aggregation are published(or spooled) instead of being lost
+    {
+        std::unique_lock<std::mutex> lock(StopLock);
+        Stopping.store(true);
+        PublisherThread.wakeup_thread();
+        if (!StopDone.wait_for(lock,std::chrono::milliseconds(PUBLISH_STOP_FLUSH_MS),[this]() { return Flushed; }))
+            std::cout<<"publisher did not flush in time, collected aggregates are dropped"<<std::endl;
+    }
+    Metrics::Registry::global().removeGauge(QueueDepthGauge);
     PublisherThread.stop_thread();
 }
 
+int Publisher::addConnection(std::shared_ptr<Aws::Crt::Mqtt::MqttConnection> handle)
+{
+    if (Lanes.size() >= PUBLISH_MAX_CONNECTIONS)
+    {
+        std::cout<<"too many publish connections, max "<<PUBLISH_MAX_CONNECTIONS<<std::endl;
+        return -1;
+    }
+    std::unique_ptr<PublishLane> lane(new PublishLane());
+    lane->Connection = handle;
+    Lanes.push_back(std::move(lane));
+    return (int)Lanes.size() - 1;
+}
+int Publisher::setAggregation(const AggregatePolicy &policy,const std::vector<std::string> &topicFilters)
+{
+    Aggregation=policy;
+    for (const std::string &filter : topicFilters)
+    {
+        if (AggregateTopics.insert(filter,true) != 0)
+        {
+            std::cout<<"invalid aggregation topic filter: "<<filter<<std::endl;
+            return -1;
+        }
+    }
+    return 0;
+}
 int Publisher::monoshot_callback_function(void* pUserData,ADThreadProducer* pObj)
 {
     //std::cout<<"Publisher::monoshot_callback_function"<<std::endl;
-    while (!PublishList.empty()) //this thread goes to sleep if list is empty
+    //take out everything queued so far in batches, this thread goes to sleep if list is empty
+    //or if the backlog of a connection is full(woken up again by the completion callback)
+    do
     {
-        PublishEntry entry = PublishList.front();
-        //TODO: publish the data on a given topic
-        //std::cout<<"topic:"<<entry.Topic<<" data:"<<entry.Data<<std::endl;
-
-        String tp(entry.Topic.c_str());
-        String pl(entry.Data.c_str());
-        ByteBuf payload = ByteBufFromArray((const uint8_t *)pl.data(), pl.length());
-        auto onPublishComplete = [tp](Mqtt::MqttConnection &, uint16_t, int)
+        drain_backlogs();
+        uint64_t now = monotonic_ms();
+        size_t room = dispatch_room();
+        while (room > 0 && PublishList.pop_batch(PublishBatch,std::min(room,(size_t)PUBLISH_BATCH_MAX)) > 0)
         {
-            ; //fprintf(stdout, "Publish Complete on topic %s\n",tp.c_str());
-        };
-        connection->Publish(tp.c_str(), AWS_MQTT_QOS_AT_LEAST_ONCE, false, payload, onPublishComplete);
-        PublishList.pop_front();//after processing delete the entry
+            uint64_t nowUs = Metrics::now_us();//after pop_batch, so no entry is younger
+            for (PublishEntry &entry : PublishBatch)
+            {
+                //std::cout<<"topic:"<<entry.Topic<<" len:"<<entry.Payload.length()<<std::endl;
+                EnqueueLatency.record(nowUs - entry.EnqueuedUs);
+                TopicPolicy policy = resolve_policy(entry.Topic,entry.Qos,entry.Retain);
+                if (is_aggregated(entry.Topic))
+                    aggregate_entry(entry,policy,now);
+                else
+                {
+                    std::vector<uint64_t> tags;//no allocation for untagged entries
+                    if (entry.AckTag)
+                        tags.push_back(entry.AckTag);
+                    publish_entry(entry.Topic,std::move(entry.Payload),policy,std::move(tags));
+                }
+            }
+            PublishBatch.clear();//entries were moved out of the ring, release them in one go
+            room = dispatch_room();
+        }
+    } while (replay_spool() > 0);//records stored while offline go out before newer ones
+    if (Stopping.load())
+    {
+        flush_all();
+        std::lock_guard<std::mutex> lock(StopLock);
+        Flushed = true;
+        StopDone.notify_all();
+        return 0;
+    }
+    //wake up again for the next aggregation window or spool sync
+    unsigned int timeout = 0;
+    if (Aggregation.MaxRecords > 0)
+        timeout = flush_expired(monotonic_ms());
+    if (Spool != NULL)
+    {
+        unsigned int syncTimeout = Spool->sync(monotonic_ms());
+        if (syncTimeout > 0 && (timeout == 0 || syncTimeout < timeout))
+            timeout = syncTimeout;
+    }
+    PublisherThread.set_wait_timeout(timeout);
+    return 0;
+}
+int Publisher::setTopicPolicy(const std::string &filter,const TopicPolicy &policy)
+{
+    if (policy.Qos < 0 || policy.Qos > 1 || TopicPolicies.insert(filter,policy) != 0)
+    {
+        std::cout<<"invalid topic policy for: "<<filter<<std::endl;
+        return -1;
     }
     return 0;
 }
-int Publisher::publishTopic(std::string topic, std::string data)
+TopicPolicy Publisher::resolve_policy(const std::string &topic,int qos,int retain) const
+{
+    TopicPolicy policy(0,false);
+    bool matched = false;
+    TopicPolicies.match(topic.data(), topic.length(), [&](const TopicPolicy &p) {
+        policy.Qos = std::max(policy.Qos, p.Qos);
+        policy.Retain |= p.Retain;
+        matched = true;
+    });
+    if (!matched)
+        policy = DefaultPolicy;
+    //set per message(e.g by a domain-socket client)
+    if (qos != PUBLISH_QOS_DEFAULT)
+        policy.Qos = qos;
+    if (retain != PUBLISH_QOS_DEFAULT)
+        policy.Retain = (retain != 0);
+    return policy;
+}
+void Publisher::publish_entry(const std::string &topic,PayloadSpan payload,TopicPolicy policy,std::vector<uint64_t> tags)
+{
+    //aggregated arrays are compressed as a whole, if compression fails payload is sent as it is
+    if (Codec != NULL)
+        Codec->compressForTopic(topic,payload);
+    if (Spool == NULL)
+    {
+        send_payload(topic,std::move(payload),policy,false,0,std::move(tags));
+        return;
+    }
+    //with a spool everything is written to disk first, it is sent right away only if the
+    //connection is up and nothing older is waiting for replay
+    bool live = Online.load() && Spool->caughtUp();
+    uint64_t seq;
+    uint16_t flags = (policy.Qos == 0 ? SPOOL_FLAG_QOS0 : 0) | (policy.Retain ? SPOOL_FLAG_RETAIN : 0);
+    if (Spool->append(topic,payload.data(),payload.length(),flags,seq) != 0)
+    {
+        if (live)
+            send_payload(topic,std::move(payload),policy,false,0,std::move(tags));//too large for the spool, send untracked
+        else
+            ack_tags(tags,PUBLISH_ACK_DROPPED,0);
+        return;
+    }
+    if (!live)
+    {
+        ack_tags(tags,PUBLISH_ACK_SPOOLED,0);
+        return;//sent by replay_spool() once the connection is back
+    }
+    Spool->markSent(seq);
+    send_payload(topic,std::move(payload),policy,true,seq,std::move(tags));
+}
+void Publisher::ack_tags(const std::vector<uint64_t> &tags,PUBLISH_ACK_STATUS status,int errorCode)
+{
+    PublishAckSink *sink = AckSink.load();
+    if (sink == NULL)
+        return;
+    for (uint64_t tag : tags)
+        sink->publish_acked(tag,status,errorCode);
+}
+void Publisher::send_payload(const std::string &topic,PayloadSpan payload,TopicPolicy policy,bool spooled,uint64_t seq,std::vector<uint64_t> tags)
+{
+    PublishLane &lane = lane_for(topic);
+    PendingPublish pending{topic,std::move(payload),policy,spooled,seq,std::move(tags)};
+    {
+        //only PublisherThread sends, a window which is not full cannot fill up after the lock is released
+        std::lock_guard<std::mutex> lock(lane.Lock);
+        if (!lane.Backlog.empty() || window_full(lane))
+        {
+            if (!lane.WindowWait)
+                lane.Stats.WindowFull++;
+            lane.WindowWait = true;
+            lane.Backlog.push_back(std::move(pending));//sent by drain_backlogs() in order
+            return;
+        }
+    }
+    send_on(lane,pending);
+}
+void Publisher::send_on(PublishLane &lane,PendingPublish &pending)
+{
+    const std::vector<uint64_t> &tags = pending.Tags;
+    if (!lane.Connection)
+    {
+        ack_tags(tags,PUBLISH_ACK_DROPPED,0);
+        return;//no mqtt client(microbenchmarks), payload is dropped
+    }
+    //ByteBuf points directly into the received buffer, the completion callback holds a
+    //reference so that the bytes stay valid till the client is done with them.
+    size_t length = pending.Payload.length();
+    ByteBuf buf = ByteBufFromArray((const uint8_t *)pending.Payload.data(), length);
+    PayloadRef held = std::move(pending.Payload.Buffer);
+    SpoolLog *spool = pending.Spooled ? Spool : NULL;
+    uint64_t seq = pending.Seq;
+    PublishLane *plane = &lane;
+    //a failed publish of a spooled record is replayed, so its tags are reported as spooled
+    PUBLISH_ACK_STATUS failStatus = pending.Spooled ? PUBLISH_ACK_SPOOLED : PUBLISH_ACK_FAILED;
+    auto onPublishComplete = [this,plane,held,spool,seq,tags,failStatus](Mqtt::MqttConnection &, uint16_t packetId, int errorCode)
+    {
+        (void)held; //fprintf(stdout, "Publish Complete, %zu bytes released\n",held->length());
+        publish_complete(*plane,packetId,errorCode);
+        if (!tags.empty())
+            ack_tags(tags,errorCode ? failStatus : PUBLISH_ACK_DELIVERED,errorCode);
+        if (spool == NULL)
+            return;
+        if (errorCode == 0)
+            spool->ack(seq);//checkpoint moves on, written with the next sync
+        else
+        {
+            spool->nack(seq);
+            PublisherThread.wakeup_thread_coalesced();
+        }
+    };
+    //the lock is held till the packet id is in the table, the completion runs on the event-loop thread
+    //and waits for it(Publish only schedules the request, it never completes it synchronously)
+    std::unique_lock<std::mutex> lock(lane.Lock);
+    //qos0 publishes complete as soon as they are written to the socket
+    Mqtt::QOS qos = pending.Policy.Qos ? AWS_MQTT_QOS_AT_LEAST_ONCE : AWS_MQTT_QOS_AT_MOST_ONCE;
+    uint16_t packetId = lane.Connection->Publish(pending.Topic.c_str(), qos, pending.Policy.Retain, buf, onPublishComplete);
+    if (packetId == 0)
+    {
+        //refused by the client(e.g invalid topic), completion callback is not called. sending it again would
+        //fail the same way, so a spooled record is acked and skipped instead of rewinding the spool to it
+        int errorCode = lane.Connection->LastError();
+        lane.Stats.Failed++;
+        lane.Stats.Errors[errorCode]++;
+        lock.unlock();
+        if (spool != NULL)
+            spool->ack(seq);
+        ack_tags(tags,PUBLISH_ACK_FAILED,errorCode);
+        return;
+    }
+    lane.InFlight[packetId] = std::make_pair(Metrics::now_us(),pending.Policy.Qos == 1);
+    lane.Stats.Sent++;
+    lane.Stats.BytesSent += length;
+    lane.Stats.HighWater = std::max(lane.Stats.HighWater, lane.InFlight.size());
+}
+Publisher::PublishLane &Publisher::lane_for(const std::string &topic)
+{
+    if (Lanes.size() == 1)
+        return *Lanes[0];
+    return *Lanes[jump_hash(topic_hash(topic),Lanes.size())];
+}
+bool Publisher::window_full(const PublishLane &lane) const
+{
+    return InFlightWindow != 0 && lane.InFlight.size() >= InFlightWindow;
+}
+void Publisher::drain_backlogs()
+{
+    for (auto &it : Lanes)
+    {
+        PublishLane &lane = *it;
+        for (;;)
+        {
+            PendingPublish pending;
+            {
+                std::lock_guard<std::mutex> lock(lane.Lock);
+                if (lane.Backlog.empty())
+                    break;
+                if (window_full(lane))
+                {
+                    lane.WindowWait = true;
+                    break;
+                }
+                pending = std::move(lane.Backlog.front());
+                lane.Backlog.pop_front();
+            }
+            send_on(lane,pending);
+        }
+    }
+}
+//every entry taken may go to the same connection, so the room is what the fullest connection can take
+size_t Publisher::dispatch_room()
+{
+    size_t room = PUBLISH_BATCH_MAX;
+    for (auto &it : Lanes)
+    {
+        PublishLane &lane = *it;
+        std::lock_guard<std::mutex> lock(lane.Lock);
+        size_t free = PUBLISH_BATCH_MAX;
+        if (InFlightWindow != 0)
+            free = InFlightWindow - std::min(lane.InFlight.size(), InFlightWindow);
+        free += PUBLISH_BACKLOG_MAX;
+        free = free > lane.Backlog.size() ? free - lane.Backlog.size() : 0;
+        if (free == 0)
+        {
+            if (!lane.WindowWait)
+                lane.Stats.WindowFull++;
+            lane.WindowWait = true;
+        }
+        room = std::min(room, free);
+    }
+    return room;
+}
+void Publisher::publish_complete(PublishLane &lane,uint16_t packetId,int errorCode)
+{
+    std::lock_guard<std::mutex> lock(lane.Lock);
+    auto it = lane.InFlight.find(packetId);
+    if (it != lane.InFlight.end())
+    {
+        uint64_t latencyUs = Metrics::now_us() - it->second.first;
+        uint64_t latency = latencyUs / 1000;
+        bool puback = it->second.second;
+        lane.InFlight.erase(it);
+        if (errorCode == 0)
+        {
+            if (puback)
+                AckLatency.record(latencyUs);
+            lane.Stats.Acked++;
+            lane.Stats.AckLatencySumMs += latency;
+            lane.Stats.AckLatencyMaxMs = std::max(lane.Stats.AckLatencyMaxMs, latency);
+        }
+    }
+    if (errorCode != 0)
+    {
+        lane.Stats.Failed++;
+        lane.Stats.Errors[errorCode]++;
+    }
+    if (lane.WindowWait)
+    {
+        lane.WindowWait = false;
+        PublisherThread.wakeup_thread_coalesced();//a slot is free again, drain the backlog and the queue
+    }
+}
+void Publisher::getInFlightStats(size_t connectionIndex,InFlightStats &stats)
+{
+    stats = InFlightStats();
+    if (connectionIndex >= Lanes.size())
+        return;
+    PublishLane &lane = *Lanes[connectionIndex];
+    std::lock_guard<std::mutex> lock(lane.Lock);
+    stats = lane.Stats;
+    stats.Window = InFlightWindow;
+    stats.InFlight = lane.InFlight.size();
+    stats.Queued = lane.Backlog.size();
+}
+void Publisher::getInFlightStats(InFlightStats &stats)
+{
+    stats = InFlightStats();
+    for (size_t i = 0; i < Lanes.size(); i++)
+    {
+        InFlightStats lane;
+        getInFlightStats(i,lane);
+        stats.Window += lane.Window;
+        stats.InFlight += lane.InFlight;
+        stats.HighWater += lane.HighWater;
+        stats.Queued += lane.Queued;
+        stats.Sent += lane.Sent;
+        stats.BytesSent += lane.BytesSent;
+        stats.Acked += lane.Acked;
+        stats.Failed += lane.Failed;
+        stats.WindowFull += lane.WindowFull;
+        stats.AckLatencySumMs += lane.AckLatencySumMs;
+        stats.AckLatencyMaxMs = std::max(stats.AckLatencyMaxMs, lane.AckLatencyMaxMs);
+        for (const auto &error : lane.Errors)
+            stats.Errors[error.first] += error.second;
+    }
+}
+int Publisher::replay_spool()
+{
+    if (Spool == NULL || !Online.load())
+        return 0;
+    int count = 0;
+    std::string topic;
+    PayloadSpan payload;
+    uint64_t seq;
+    uint16_t flags;
+    int limit = (int)std::min(dispatch_room(),(size_t)SPOOL_REPLAY_BATCH);
+    while (count < limit && Spool->next(topic,payload,flags,seq) == 1)
+    {
+        send_payload(topic,std::move(payload),TopicPolicy((flags & SPOOL_FLAG_QOS0) ? 0 : 1,(flags & SPOOL_FLAG_RETAIN) != 0),true,seq,std::vector<uint64_t>());
+        count++;
+    }
+    return count;
+}
+//the spool is one ordered log for all connections, it is only sent while every connection is up
+void Publisher::setOnline(bool online,size_t connectionIndex)
+{
+    bool all = true;
+    {
+        std::lock_guard<std::mutex> lock(OnlineLock);
+        if (connectionIndex < Lanes.size())
+            Lanes[connectionIndex]->Online = online;
+        for (auto &lane : Lanes)
+            all = all && lane->Online;
+        Online.store(all);
+    }
+    if (all)
+        PublisherThread.wakeup_thread_coalesced();//replay what was stored meanwhile
+}
+bool Publisher::is_aggregated(const std::string &topic) const
+{
+    bool match = false;
+    if (Aggregation.MaxRecords > 0)
+        AggregateTopics.match(topic.data(), topic.length(), [&match](bool) { match = true; });
+    return match;
+}
+void Publisher::aggregate_entry(PublishEntry &entry,TopicPolicy policy,uint64_t now)
+{
+    Aggregate &agg = Aggregates[entry.Topic];
+    //Bytes counts a separator per record, +1 for the second array bracket
+    if (!agg.Records.empty() && agg.Bytes + entry.Payload.length() + 2 > Aggregation.MaxBytes)
+        flush_aggregate(entry.Topic,agg);
+    if (agg.Records.empty())
+        agg.Deadline = now + Aggregation.WindowMs;
+    agg.Policy.Qos = std::max(agg.Policy.Qos, policy.Qos);
+    agg.Policy.Retain |= policy.Retain;
+    agg.Bytes += entry.Payload.length() + 1;
+    agg.Records.push_back(std::move(entry.Payload));
+    if (entry.AckTag)
+        agg.Tags.push_back(entry.AckTag);
+    if (agg.Records.size() >= Aggregation.MaxRecords)
+        flush_aggregate(entry.Topic,agg);
+}
+void Publisher::flush_aggregate(const std::string &topic,Aggregate &agg)
+{
+    PayloadRef buf = PayloadBuffer::Create(agg.Bytes + 2);
+    if (buf == nullptr)
+        return;//records are kept and tried again on next flush
+    char *p = buf->data();
+    *p++ = '[';
+    for (size_t i = 0; i < agg.Records.size(); i++)
+    {
+        if (i > 0)
+            *p++ = ',';
+        memcpy(p, agg.Records[i].data(), agg.Records[i].length());
+        p += agg.Records[i].length();
+    }
+    *p++ = ']';
+    buf->set_length(p - buf->data());
+    agg.Records.clear();//releases the received buffers
+    agg.Bytes = 0;
+    TopicPolicy policy = agg.Policy;
+    agg.Policy = TopicPolicy(0,false);
+    std::vector<uint64_t> tags;
+    tags.swap(agg.Tags);
+    publish_entry(topic,PayloadSpan(std::move(buf)),policy,std::move(tags));
+}
+unsigned int Publisher::flush_expired(uint64_t now)
+{
+    uint64_t next = 0;
+    for (auto &it : Aggregates)
+    {
+        Aggregate &agg = it.second;
+        if (agg.Records.empty())
+            continue;
+        if (agg.Deadline <= now)
+            flush_aggregate(it.first,agg);
+        else if (next == 0 || agg.Deadline < next)
+            next = agg.Deadline;
+    }
+    return next ? (unsigned int)(next - now) : 0;
+}
+void Publisher::flush_all()
+{
+    for (auto &it : Aggregates)
+    {
+        if (!it.second.Records.empty())
+            flush_aggregate(it.first,it.second);
+    }
+}
+int Publisher::publishTopic(std::string topic, std::string data, int qos, int retain)
+{
+    PayloadRef buf = PayloadBuffer::CopyFrom(data.data(),data.length());
+    if(buf == nullptr)
+        return -1;
+    return publishTopic(std::move(topic),PayloadSpan(std::move(buf)),qos,retain);
+}
+int Publisher::publishTopic(std::string topic, PayloadSpan payload, int qos, int retain, uint64_t ackTag)
 {
-    PublishList.push_back(PublishEntry(topic,data));
-    PublisherThread.wakeup_thread();
+    //safe to call from any thread, the ring is lock-free for multiple producers
+    int ret = PublishList.push(PublishEntry(std::move(topic),std::move(payload),qos,retain,ackTag),[this](PublishEntry &victim) {
+        if (victim.AckTag)
+            ack_tags(std::vector<uint64_t>(1,victim.AckTag),PUBLISH_ACK_DROPPED,0);
+    });
+    if(ret<0)
+        return -1;//queue full and policy is reject
+    PublisherThread.wakeup_thread_coalesced();//one wakeup per burst, consumer drains all
     return 0;
 }
 
@@ -1,29 +1,208 @@
 #pragma once
 #include "ADThread.h"
+#include "BoundedRing.h"
+#include "PayloadBuffer.h"
+#include "TopicTrie.h"
+#include "PayloadCodec.h"
+#include "SpoolLog.h"
+#include "MetricsRegistry.h"
 #include <string>
+#include <vector>
+#include <unordered_map>
+#include <map>
 #include <deque>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
 #include <aws/iot/MqttClient.h>
 #define SOCK_MAX_PATH 4096
+#define PUBLISH_QOS_DEFAULT (-1) //qos/retain of a message which is taken from the topic policy
+
+//qos and retain flag of published messages, configured per topic filter
+struct TopicPolicy
+{
+        int Qos;//0 or 1
+        bool Retain;
+        TopicPolicy():Qos(1),Retain(false){}
+        TopicPolicy(int qos,bool retain):Qos(qos),Retain(retain){}
+};
 struct PublishEntry
 {
         std::string Topic;
-        std::string Data;
+        PayloadSpan Payload;//shared with the receiver, released after publish completes
+        int8_t Qos;//PUBLISH_QOS_DEFAULT, 0 or 1
+        int8_t Retain;//PUBLISH_QOS_DEFAULT, 0 or 1
+        uint64_t EnqueuedUs;//monotonic time the entry was queued
+        uint64_t AckTag;//reported to the PublishAckSink once the publish is done, 0: none
+public:
+        PublishEntry():Qos(PUBLISH_QOS_DEFAULT),Retain(PUBLISH_QOS_DEFAULT),EnqueuedUs(0),AckTag(0){}//needed for preallocated ring slots
+        PublishEntry(std::string topic,PayloadSpan payload,int qos,int retain,uint64_t ackTag)
+            :Topic(std::move(topic)),Payload(std::move(payload)),Qos(qos),Retain(retain),EnqueuedUs(Metrics::now_us()),AckTag(ackTag){}
+};
+
+//final state of a tagged publish
+typedef enum PUBLISH_ACK_STATUS_T
+{
+    PUBLISH_ACK_DELIVERED,//QoS1: PUBACK received, QoS0: written to the connection
+    PUBLISH_ACK_SPOOLED,  //stored in the spool, sent(again) once the connection is back
+    PUBLISH_ACK_FAILED,   //mqtt client reported an error
+    PUBLISH_ACK_DROPPED   //neither sent nor stored(e.g spool full while offline)
+}PUBLISH_ACK_STATUS;
+class PublishAckSink
+{
 public:
-        PublishEntry(std::string topic,std::string data) :Topic(topic),Data(data){}
+        //called from the publisher thread or the mqtt event-loop thread, has to return quickly
+        virtual void publish_acked(uint64_t tag,PUBLISH_ACK_STATUS status,int errorCode)=0;
+        virtual ~PublishAckSink(){}
+};
+#define PUBLISH_QUEUE_DEFAULT_SIZE 1024
+#define PUBLISH_BATCH_MAX 256 //max entries taken out of the ring in one go
+#define PUBLISH_AGGREGATE_DEFAULT_RECORDS 50
+#define PUBLISH_AGGREGATE_DEFAULT_WINDOW_MS 200
+#define PUBLISH_AGGREGATE_MAX_BYTES (128*1024) //aws-iot-core payload limit
+#define PUBLISH_INFLIGHT_DEFAULT_WINDOW 100 //aws-iot-core limit of unacknowledged QoS1 publishes per connection
+#define PUBLISH_MAX_CONNECTIONS 16
+#define PUBLISH_STOP_FLUSH_MS 1000 //max time the destructor waits for collected aggregates to be published
+#define PUBLISH_BACKLOG_MAX 64 //per connection, publishes taken from the queue while the window of their connection is full
+
+//records published on an aggregated topic are collected and sent as one json array "[rec1,rec2,..]"
+//as soon as MaxRecords are collected, MaxBytes would be exceeded or WindowMs after the first record.
+struct AggregatePolicy
+{
+        size_t MaxRecords;//0: aggregation disabled
+        unsigned int WindowMs;
+        size_t MaxBytes;
+        AggregatePolicy():MaxRecords(0),WindowMs(PUBLISH_AGGREGATE_DEFAULT_WINDOW_MS),MaxBytes(PUBLISH_AGGREGATE_MAX_BYTES){}
+};
+
+//QoS1 publishes handed to the mqtt client and not yet completed(PUBACK, timeout or error),
+//per connection or the sum of all connections
+struct InFlightStats
+{
+        size_t Window;//max publishes in flight, 0: unlimited
+        size_t InFlight;
+        size_t HighWater;
+        size_t Queued;//waiting for a free slot of the window
+        uint64_t Sent;
+        uint64_t BytesSent;
+        uint64_t Acked;
+        uint64_t Failed;//completed with an error or refused by the client
+        uint64_t WindowFull;//number of times the publisher waited for a free slot
+        uint64_t AckLatencySumMs;
+        uint64_t AckLatencyMaxMs;
+        std::map<int,uint64_t> Errors;//error code -> count
+        InFlightStats():Window(0),InFlight(0),HighWater(0),Queued(0),Sent(0),BytesSent(0),Acked(0),Failed(0),WindowFull(0),AckLatencySumMs(0),AckLatencyMaxMs(0){}
 };
 
 namespace TopicPublisher
 {
     class Publisher : public ADThreadConsumer
     {
-        std::shared_ptr<Aws::Crt::Mqtt::MqttConnection> connection;
-        std::deque<PublishEntry> PublishList;
-        ADThread PublisherThread;//thread for linux-domain-socket-server
+        //a publish handed to a connection, or waiting in its backlog for a free slot of the window
+        struct PendingPublish
+        {
+            std::string Topic;
+            PayloadSpan Payload;
+            TopicPolicy Policy;
+            bool Spooled;
+            uint64_t Seq;//spool sequence number
+            std::vector<uint64_t> Tags;
+        };
+        //one mqtt connection, every topic is sent on the same connection(consistent hash of the topic),
+        //so the order per topic is kept
+        struct PublishLane
+        {
+            std::shared_ptr<Aws::Crt::Mqtt::MqttConnection> Connection;
+            std::mutex Lock;//the completion callbacks run on the event-loop thread
+            //packet id -> send time(monotonic us) and qos1, filled by PublisherThread, emptied by the completion callbacks
+            std::unordered_map<uint16_t,std::pair<uint64_t,bool>> InFlight;
+            std::deque<PendingPublish> Backlog;//taken from the queue while the window was full, sent by PublisherThread
+            bool WindowWait;//PublisherThread waits for a completion to free a slot
+            bool Online;
+            InFlightStats Stats;
+            PublishLane():WindowWait(false),Online(true){}
+        };
+        std::vector<std::unique_ptr<PublishLane>> Lanes;
+        BoundedRing<PublishEntry> PublishList;//filled by main loop and domain-socket thread, drained by PublisherThread
+        std::vector<PublishEntry> PublishBatch;//reused by PublisherThread for draining the ring
+        ADThread PublisherThread;//thread for publishing queued entries
+        struct Aggregate
+        {
+            std::vector<PayloadSpan> Records;
+            size_t Bytes;
+            uint64_t Deadline;//monotonic ms, flush time of the collected records
+            TopicPolicy Policy;//highest qos and any retain of the collected records
+            std::vector<uint64_t> Tags;//ack tags of the collected records
+            Aggregate():Bytes(0),Deadline(0),Policy(0,false){}
+        };
+        AggregatePolicy Aggregation;
+        TopicTrie<bool> AggregateTopics;
+        std::unordered_map<std::string,Aggregate> Aggregates;//per topic, only used by PublisherThread
+        TopicPolicy DefaultPolicy;
+        TopicTrie<TopicPolicy> TopicPolicies;
+        PayloadCodec *Codec;//compresses payloads of configured topics, may be NULL
+        SpoolLog *Spool;//store-and-forward log, may be NULL
+        std::atomic<bool> Online;//all connections are up, only used with a spool
+        std::mutex OnlineLock;
+        std::atomic<PublishAckSink*> AckSink;
+        //shutdown: the destructor lets PublisherThread flush the aggregates before it is stopped
+        std::atomic<bool> Stopping;
+        bool Flushed;
+        std::mutex StopLock;
+        std::condition_variable StopDone;
+        size_t InFlightWindow;//per connection
+        Metrics::Histogram &EnqueueLatency;//queued till taken by PublisherThread
+        Metrics::Histogram &AckLatency;
+        int QueueDepthGauge;
+        size_t dispatch_room();//number of queued publishes which may be taken now
+        PublishLane &lane_for(const std::string &topic);
+        bool window_full(const PublishLane &lane) const;//lane.Lock has to be held
+        void drain_backlogs();
+        void publish_complete(PublishLane &lane,uint16_t packetId,int errorCode);
+        TopicPolicy resolve_policy(const std::string &topic,int qos,int retain) const;
+        void publish_entry(const std::string &topic,PayloadSpan payload,TopicPolicy policy,std::vector<uint64_t> tags);
+        //sent on the connection of the topic, or queued in its backlog while the window is full
+        void send_payload(const std::string &topic,PayloadSpan payload,TopicPolicy policy,bool spooled,uint64_t seq,std::vector<uint64_t> tags);
+        void send_on(PublishLane &lane,PendingPublish &pending);
+        void ack_tags(const std::vector<uint64_t> &tags,PUBLISH_ACK_STATUS status,int errorCode);
+        int replay_spool();//returns number of records sent from the spool
+        bool is_aggregated(const std::string &topic) const;
+        void aggregate_entry(PublishEntry &entry,TopicPolicy policy,uint64_t now);
+        void flush_aggregate(const std::string &topic,Aggregate &agg);
+        unsigned int flush_expired(uint64_t now);//returns ms till the next deadline, 0 if nothing is pending
+        void flush_all();
         virtual int monoshot_callback_function(void* pUserData,ADThreadProducer* pObj);//{return 0;};//we are not using this one
         virtual int thread_callback_function(void* pUserData,ADThreadProducer* pObj){return 0;};//we are not using this one..
       public:
-        Publisher(std::shared_ptr<Aws::Crt::Mqtt::MqttConnection> handle);
+        //handle may be NULL, published payloads are dropped then(used by microbenchmarks)
+        Publisher(std::shared_ptr<Aws::Crt::Mqtt::MqttConnection> handle,
+                  size_t queueSize=PUBLISH_QUEUE_DEFAULT_SIZE,RING_POLICY queuePolicy=RING_POLICY_BLOCK);
         ~Publisher();
-        int publishTopic(std::string topic, std::string data);
+        //another connection to publish on, topics are spread over all connections by a hash of the topic.
+        //returns its index(for setOnline), -1 beyond PUBLISH_MAX_CONNECTIONS. has to be called before anything is published
+        int addConnection(std::shared_ptr<Aws::Crt::Mqtt::MqttConnection> handle);
+        size_t connectionCount() const {return Lanes.size();}
+        //has to be called before anything is published, returns -1 for an invalid topic filter
+        int setAggregation(const AggregatePolicy &policy,const std::vector<std::string> &topicFilters);
+        //qos/retain of topics matching filter, if several filters match the highest qos and any retain apply.
+        //has to be called before anything is published, returns -1 for an invalid topic filter
+        int setTopicPolicy(const std::string &filter,const TopicPolicy &policy);
+        void setDefaultPolicy(const TopicPolicy &policy){DefaultPolicy=policy;}//for topics without a policy
+        void setCodec(PayloadCodec *codec){Codec=codec;}//has to be called before anything is published
+        void setSpool(SpoolLog *spool){Spool=spool;}//has to be called before anything is published
+        void setOnline(bool online,size_t connectionIndex=0);//called on connection interrupt/resume
+        void setAckSink(PublishAckSink *sink){AckSink.store(sink);}//receives the result of tagged publishes, may be NULL
+        //max QoS1 publishes in flight per connection(0: unlimited), while the window of a connection is full
+        //its publishes wait in a backlog, once that is full too the queue is not drained and fills up till
+        //queuePolicy applies. has to be called before anything is published
+        void setInFlightWindow(size_t window){InFlightWindow=window;}
+        void getInFlightStats(InFlightStats &stats);//sum of all connections
+        void getInFlightStats(size_t connectionIndex,InFlightStats &stats);
+        //qos/retain PUBLISH_QOS_DEFAULT: taken from the topic policy
+        int publishTopic(std::string topic, std::string data, int qos=PUBLISH_QOS_DEFAULT, int retain=PUBLISH_QOS_DEFAULT);//copies data once into a PayloadBuffer
+        //returns -1 if queue is full and policy is reject(ackTag is not reported then)
+        int publishTopic(std::string topic, PayloadSpan payload, int qos=PUBLISH_QOS_DEFAULT, int retain=PUBLISH_QOS_DEFAULT, uint64_t ackTag=0);
+        void getQueueStats(RingStats &stats) const {PublishList.get_stats(stats);}
     };
 } // namespace TopicPublisher
\ No newline at end of file
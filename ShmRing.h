@@ -0,0 +1,221 @@
+#pragma once
+//shared-memory transport for high-rate local producers, an alternative to the domain socket without
+//syscalls per message. every producer owns one ring file in the shm directory of the agent(--shm_dir,
+//e.g /dev/shm/aws-iot-pubsub-agent), the agent maps all rings it finds there and drains them into the
+//publisher. one writer(the producer) and one reader(the agent) per ring, a producer with several
+//threads has to serialize publish() or open one ring per thread.
+//doorbell: the agent keeps a futex word in <shm_dir>/doorbell, a producer only issues FUTEX_WAKE if the
+//agent is sleeping, so a busy agent costs the producer no syscall at all.
+//
+//this header is all a producer needs(no agent sources, no aws sdk), e.g:
+//  ShmIpc::ShmRingProducer ring;
+//  if (ring.open("/dev/shm/aws-iot-pubsub-agent", "sensor-fusion") == 0)
+//      ring.publish("sensors/imu", "{\"x\":1}", 7);//returns -1 if the ring is full, nothing blocks
+//  ring.close();//agent publishes what is left and forgets the ring
+#include <atomic>
+#include <new>
+#include <string>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#define SHM_RING_MAGIC 0x474e5253 //"SRNG"
+#define SHM_DOORBELL_MAGIC 0x4c4c4244 //"DBLL"
+#define SHM_RING_VERSION 1
+#define SHM_RING_DEFAULT_SIZE (1024*1024) //data bytes per ring
+#define SHM_RING_MIN_SIZE (64*1024)
+#define SHM_RING_MAX_SIZE (64*1024*1024)
+#define SHM_RING_PREFIX "ring-"
+#define SHM_RING_SUFFIX ".ring"
+#define SHM_DOORBELL_NAME "doorbell" //kept across agent restarts, so producers stay connected to it
+#define SHM_SCAN_INTERVAL_MS 1000 //agent looks for new and abandoned rings
+#define SHM_RECORD_ALIGN 16 //at least sizeof(ShmRecordHeader), a filler record always fits
+#define SHM_RECORD_PAD 0xffff //topic length of the filler record at the end of the ring
+#define SHM_QOS_DEFAULT (-1) //qos/retain of the topic policy of the agent
+
+namespace ShmIpc
+{
+    //first page of a ring file, followed by Capacity bytes of records
+    struct ShmRingHeader
+    {
+        uint32_t Magic;
+        uint32_t Version;
+        uint64_t Capacity;//power of 2
+        int32_t ProducerPid;//agent removes rings of producers which died
+        std::atomic<uint32_t> Closed;//set by producer, ring is removed by the agent once drained
+        alignas(64) std::atomic<uint64_t> Head;//bytes written, only changed by the producer
+        std::atomic<uint64_t> Full;//publish() calls refused because the ring was full
+        alignas(64) std::atomic<uint64_t> Tail;//bytes consumed, only changed by the agent
+    };
+    #define SHM_RING_HEADER_SIZE 4096
+
+    //records are SHM_RECORD_ALIGN aligned and never wrap, the rest of the ring is skipped with a
+    //filler record(TopicLen SHM_RECORD_PAD) if a record does not fit before the end
+    struct ShmRecordHeader
+    {
+        uint32_t Size;//whole record including header and padding
+        uint32_t DataLen;
+        uint16_t TopicLen;
+        int8_t Qos;//SHM_QOS_DEFAULT, 0 or 1
+        int8_t Retain;//SHM_QOS_DEFAULT, 0 or 1
+        uint32_t Reserved;
+    };
+
+    struct ShmDoorbell
+    {
+        uint32_t Magic;
+        std::atomic<uint32_t> Seq;//futex word, incremented by every wakeup
+        std::atomic<uint32_t> Sleeping;//agent waits on Seq
+    };
+    #define SHM_DOORBELL_SIZE 4096
+
+    static inline long shm_futex(std::atomic<uint32_t> *addr, int op, uint32_t val, const struct timespec *timeout)
+    {
+        //not FUTEX_PRIVATE_FLAG, the word is shared between processes
+        return syscall(SYS_futex, (uint32_t *)addr, op, val, timeout, NULL, 0);
+    }
+
+    class ShmRingProducer
+    {
+        ShmRingHeader *Ring;
+        char *Data;
+        ShmDoorbell *Doorbell;//NULL if the agent never ran, the agent then polls the ring every SHM_SCAN_INTERVAL_MS
+        uint64_t Mask;
+        ShmRingProducer(const ShmRingProducer &) = delete;
+        ShmRingProducer &operator=(const ShmRingProducer &) = delete;
+
+        void ring_doorbell()
+        {
+            //pairs with the agent setting Sleeping and rechecking all rings before it waits
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (Doorbell != NULL && Doorbell->Sleeping.load(std::memory_order_relaxed))
+            {
+                Doorbell->Seq.fetch_add(1, std::memory_order_release);
+                shm_futex(&Doorbell->Seq, FUTEX_WAKE, 1, NULL);
+            }
+        }
+
+      public:
+        ShmRingProducer() : Ring(NULL), Data(NULL), Doorbell(NULL), Mask(0) {}
+        ~ShmRingProducer() { close(); }
+        //creates <dir>/ring-<name>.ring, size is rounded up to a power of 2. returns -1 and sets errno on failure
+        int open(const char *dir, const char *name, size_t size = SHM_RING_DEFAULT_SIZE)
+        {
+            close();
+            uint64_t capacity = SHM_RING_MIN_SIZE;
+            while (capacity < size && capacity < SHM_RING_MAX_SIZE)
+                capacity <<= 1;
+            std::string path = std::string(dir) + "/" SHM_RING_PREFIX + name + SHM_RING_SUFFIX;
+            std::string tmpPath = std::string(dir) + "/.tmp-" + name + "-" + std::to_string(getpid());
+            int fd = ::open(tmpPath.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0660);
+            if (fd == -1)
+                return -1;
+            size_t mapSize = SHM_RING_HEADER_SIZE + capacity;
+            void *map = MAP_FAILED;
+            if (ftruncate(fd, mapSize) == 0)
+                map = mmap(NULL, mapSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            int err = errno;
+            ::close(fd);
+            if (map == MAP_FAILED)
+            {
+                unlink(tmpPath.c_str());
+                errno = err;
+                return -1;
+            }
+            Ring = new (map) ShmRingHeader();
+            Ring->Capacity = capacity;
+            Ring->ProducerPid = getpid();
+            Ring->Closed.store(0, std::memory_order_relaxed);
+            Ring->Head.store(0, std::memory_order_relaxed);
+            Ring->Full.store(0, std::memory_order_relaxed);
+            Ring->Tail.store(0, std::memory_order_relaxed);
+            Ring->Version = SHM_RING_VERSION;
+            std::atomic_thread_fence(std::memory_order_release);
+            Ring->Magic = SHM_RING_MAGIC;
+            Data = (char *)map + SHM_RING_HEADER_SIZE;
+            Mask = capacity - 1;
+            //the agent only looks at complete rings
+            if (rename(tmpPath.c_str(), path.c_str()) != 0)
+            {
+                err = errno;
+                munmap(map, mapSize);
+                unlink(tmpPath.c_str());
+                Ring = NULL;
+                errno = err;
+                return -1;
+            }
+            fd = ::open((std::string(dir) + "/" SHM_DOORBELL_NAME).c_str(), O_RDWR | O_CLOEXEC);
+            if (fd != -1)
+            {
+                map = mmap(NULL, SHM_DOORBELL_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+                ::close(fd);
+                if (map != MAP_FAILED && ((ShmDoorbell *)map)->Magic == SHM_DOORBELL_MAGIC)
+                    Doorbell = (ShmDoorbell *)map;
+                else if (map != MAP_FAILED)
+                    munmap(map, SHM_DOORBELL_SIZE);
+            }
+            return 0;
+        }
+        //ring is left to the agent, which publishes the rest and removes it
+        void close()
+        {
+            if (Ring == NULL)
+                return;
+            Ring->Closed.store(1, std::memory_order_release);
+            ring_doorbell();
+            munmap(Ring, SHM_RING_HEADER_SIZE + Ring->Capacity);
+            if (Doorbell != NULL)
+                munmap(Doorbell, SHM_DOORBELL_SIZE);
+            Ring = NULL;
+            Doorbell = NULL;
+        }
+        //copies topic and data into the ring, returns -1 if it is full(or message too large), never blocks
+        int publish(const char *topic, const void *data, size_t len, int qos = SHM_QOS_DEFAULT, int retain = SHM_QOS_DEFAULT)
+        {
+            if (Ring == NULL)
+                return -1;
+            size_t topicLen = strlen(topic);
+            if (topicLen == 0 || topicLen >= SHM_RECORD_PAD)
+                return -1;
+            uint64_t size = (sizeof(ShmRecordHeader) + topicLen + len + SHM_RECORD_ALIGN - 1) & ~(uint64_t)(SHM_RECORD_ALIGN - 1);
+            if (size > Ring->Capacity / 2)
+                return -1;
+            uint64_t head = Ring->Head.load(std::memory_order_relaxed);
+            uint64_t tail = Ring->Tail.load(std::memory_order_acquire);
+            uint64_t offset = head & Mask;
+            uint64_t skip = (offset + size > Ring->Capacity) ? Ring->Capacity - offset : 0;
+            if (head + skip + size - tail > Ring->Capacity)
+            {
+                Ring->Full.fetch_add(1, std::memory_order_relaxed);
+                return -1;
+            }
+            if (skip)
+            {
+                ShmRecordHeader *pad = (ShmRecordHeader *)(Data + offset);
+                pad->Size = (uint32_t)skip;
+                pad->DataLen = 0;
+                pad->TopicLen = SHM_RECORD_PAD;
+                offset = 0;
+            }
+            ShmRecordHeader *rec = (ShmRecordHeader *)(Data + offset);
+            rec->Size = (uint32_t)size;
+            rec->DataLen = (uint32_t)len;
+            rec->TopicLen = (uint16_t)topicLen;
+            rec->Qos = (int8_t)qos;
+            rec->Retain = (int8_t)retain;
+            memcpy(rec + 1, topic, topicLen);
+            memcpy((char *)(rec + 1) + topicLen, data, len);
+            Ring->Head.store(head + skip + size, std::memory_order_release);
+            ring_doorbell();
+            return 0;
+        }
+        uint64_t fullCount() const { return Ring ? Ring->Full.load(std::memory_order_relaxed) : 0; }
+    };
+} // namespace ShmIpc
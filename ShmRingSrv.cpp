@@ -0,0 +1,306 @@
+//drains the shared-memory rings of local producers into the publisher. the records of one batch are
+//copied into a single PayloadBuffer(one allocation per batch, the publisher gets spans into it), the
+//ring space is released to the producer right after the copy.
+//rings are found by scanning the directory every SHM_SCAN_INTERVAL_MS, a ring is removed once it is
+//drained and its producer closed it or died.
+#include "ShmRingSrv.h"
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+namespace ShmIpc
+{
+ShmRingSrv::ShmRingSrv(const char *dir,TopicPublisher::Publisher *ptr)
+    :pPublisher(ptr),Dir(dir),Doorbell(NULL),Stopping(false),RingCount(0),
+     MessagesReceived(Metrics::Registry::global().counter("shm_messages_received_total","Messages received on shared-memory rings")),
+     InvalidRecords(Metrics::Registry::global().counter("shm_invalid_records_total","Shared-memory records which were not valid publish requests")),
+     QueueFull(Metrics::Registry::global().counter("shm_queue_full_total","Times a shared-memory record was left in its ring because the publish queue refused it")),
+     Refused(false)
+{
+    RingGauge = Metrics::Registry::global().addGauge("shm_rings", "Shared-memory rings of connected producers",
+                                                     [this]() { return (int64_t)RingCount.load(std::memory_order_relaxed); });
+    Batch.reserve(SHM_DRAIN_BATCH);
+}
+ShmRingSrv::~ShmRingSrv()
+{
+    Stopping.store(true);
+    if (Doorbell != NULL)
+    {
+        Doorbell->Seq.fetch_add(1);
+        shm_futex(&Doorbell->Seq, FUTEX_WAKE, 1, NULL);
+    }
+    ServerThread.stop_thread();
+    while (!Rings.empty())
+        UnmapRing(Rings.size() - 1, false);
+    if (Doorbell != NULL)
+        munmap(Doorbell, SHM_DOORBELL_SIZE);
+    Metrics::Registry::global().removeGauge(RingGauge);
+}
+int ShmRingSrv::Start()
+{
+    if (mkdir(Dir.c_str(), 0770) != 0 && errno != EEXIST)
+    {
+        printf("unable to create shm directory %s: %s\n", Dir.c_str(), strerror(errno));
+        return -1;
+    }
+    //an existing doorbell is reused, producers of a previous run keep the mapping of it
+    std::string path = Dir + "/" SHM_DOORBELL_NAME;
+    int fd = open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0660);
+    if (fd == -1)
+    {
+        printf("unable to open %s: %s\n", path.c_str(), strerror(errno));
+        return -1;
+    }
+    struct stat st;
+    void *map = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && (st.st_size >= SHM_DOORBELL_SIZE || ftruncate(fd, SHM_DOORBELL_SIZE) == 0))
+        map = mmap(NULL, SHM_DOORBELL_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+    {
+        printf("unable to map %s: %s\n", path.c_str(), strerror(errno));
+        return -1;
+    }
+    Doorbell = (ShmDoorbell *)map;
+    if (Doorbell->Magic != SHM_DOORBELL_MAGIC)
+    {
+        Doorbell = new (map) ShmDoorbell();
+        Doorbell->Seq.store(0);
+        Doorbell->Magic = SHM_DOORBELL_MAGIC;
+    }
+    Doorbell->Sleeping.store(0);
+    ServerThread.subscribe_thread_callback(this);
+    ServerThread.set_thread_properties(THREAD_TYPE_NOBLOCK,(void *)this);
+    ServerThread.start_thread();
+    return 0;
+}
+int ShmRingSrv::thread_callback_function(void* pUserData,ADThreadProducer* pObj)
+{
+    return RunServer();
+}
+int ShmRingSrv::RunServer()
+{
+    uint64_t nextScan = 0;
+    while (!Stopping.load(std::memory_order_relaxed))
+    {
+        int drained = 0;
+        Refused = false;
+        for (size_t i = 0; i < Rings.size(); i++)
+        {
+            int n = DrainRing(*Rings[i]);
+            if (n < 0)
+            {
+                printf("shm ring %s is corrupt, removing it\n", Rings[i]->Path.c_str());
+                InvalidRecords.add();
+                UnmapRing(i--, true);
+                continue;
+            }
+            drained += n;
+        }
+        uint64_t now = Metrics::now_us() / 1000;
+        if (now >= nextScan)
+        {
+            ScanRings();
+            nextScan = now + SHM_SCAN_INTERVAL_MS;
+            continue;
+        }
+        if (drained > 0)
+            continue;
+        if (Refused)
+        {
+            usleep(SHM_QUEUE_FULL_WAIT_US);//publish queue is full, it drains without us
+            continue;
+        }
+        //a producer which does not see Sleeping has published before the recheck below
+        Doorbell->Sleeping.store(1, std::memory_order_seq_cst);
+        uint32_t seq = Doorbell->Seq.load(std::memory_order_seq_cst);
+        if (RingsEmpty() && !Stopping.load())
+        {
+            uint64_t waitMs = nextScan - now;
+            struct timespec timeout = {(time_t)(waitMs / 1000), (long)(waitMs % 1000) * 1000000};
+            shm_futex(&Doorbell->Seq, FUTEX_WAIT, seq, &timeout);
+        }
+        Doorbell->Sleeping.store(0, std::memory_order_relaxed);
+        pthread_testcancel();//futex is no cancellation point
+    }
+    return 0;
+}
+bool ShmRingSrv::RingsEmpty() const
+{
+    for (const auto &ring : Rings)
+    {
+        if (ring->Ring->Head.load(std::memory_order_acquire) != ring->Ring->Tail.load(std::memory_order_relaxed))
+            return false;
+    }
+    return true;
+}
+int ShmRingSrv::DrainRing(MappedRing &ring)
+{
+    uint64_t tail = ring.Ring->Tail.load(std::memory_order_relaxed);
+    uint64_t head = ring.Ring->Head.load(std::memory_order_acquire);
+    if (head == tail)
+        return 0;
+    if (head - tail > ring.Mask + 1)
+        return -1;
+    //first pass validates the headers and keeps a copy, so a producer writing into records which are
+    //already published cannot change the sizes used for copying
+    Batch.clear();
+    size_t dataBytes = 0;
+    uint64_t pos = tail;
+    while (pos != head && Batch.size() < SHM_DRAIN_BATCH)
+    {
+        uint64_t offset = pos & ring.Mask;
+        ShmRecordHeader rec;
+        memcpy(&rec, ring.Data + offset, sizeof(rec));
+        if (rec.Size < sizeof(ShmRecordHeader) || rec.Size % SHM_RECORD_ALIGN != 0 ||
+            offset + rec.Size > ring.Mask + 1 || rec.Size > head - pos)
+            return -1;
+        if (rec.TopicLen != SHM_RECORD_PAD)
+        {
+            if (sizeof(ShmRecordHeader) + (uint64_t)rec.TopicLen + rec.DataLen > rec.Size)
+                return -1;
+            Batch.push_back(std::make_pair(pos, rec));
+            dataBytes += rec.DataLen;
+        }
+        pos += rec.Size;
+    }
+    PayloadRef buf = PayloadBuffer::Create(dataBytes ? dataBytes : 1);
+    if (buf == nullptr)
+        return 0;//out of memory, retried on the next round
+    size_t used = 0;
+    std::vector<std::pair<std::string,PayloadSpan>> messages;
+    messages.reserve(Batch.size());
+    for (const auto &entry : Batch)
+    {
+        const ShmRecordHeader &rec = entry.second;
+        const char *topic = ring.Data + (entry.first & ring.Mask) + sizeof(ShmRecordHeader);
+        memcpy(buf->data() + used, topic + rec.TopicLen, rec.DataLen);
+        messages.push_back(std::make_pair(std::string(topic, rec.TopicLen), PayloadSpan(buf, used, rec.DataLen)));
+        used += rec.DataLen;
+    }
+    buf->set_length(used);
+    //a record the publish queue refuses(reject policy) stays in the ring with everything after it, the
+    //ring fills up and the producer sees publish() fail instead of the message being lost here
+    int count = 0;
+    size_t taken = 0;
+    for (; taken < messages.size(); taken++)
+    {
+        const ShmRecordHeader &rec = Batch[taken].second;
+        if (rec.Qos < SHM_QOS_DEFAULT || rec.Qos > 1 || rec.Retain < SHM_QOS_DEFAULT || rec.Retain > 1 ||
+            !topic_name_valid(messages[taken].first.data(), messages[taken].first.length()))
+        {
+            InvalidRecords.add();
+            continue;
+        }
+        if (pPublisher->publishTopic(std::move(messages[taken].first), std::move(messages[taken].second), rec.Qos, rec.Retain) != 0)
+        {
+            pos = Batch[taken].first;
+            Refused = true;
+            QueueFull.add();
+            break;
+        }
+        count++;
+    }
+    ring.Ring->Tail.store(pos, std::memory_order_release);//space is free for the producer again
+    MessagesReceived.add(count);
+    return (int)taken;
+}
+void ShmRingSrv::ScanRings()
+{
+    //closed rings and rings of dead producers are removed once they are drained
+    for (size_t i = 0; i < Rings.size(); i++)
+    {
+        MappedRing &ring = *Rings[i];
+        if (ring.Ring->Head.load(std::memory_order_acquire) != ring.Ring->Tail.load(std::memory_order_relaxed))
+            continue;
+        if (ring.Ring->Closed.load(std::memory_order_acquire) ||
+            (kill(ring.Ring->ProducerPid, 0) != 0 && errno == ESRCH))
+            UnmapRing(i--, true);
+    }
+    DIR *dir = opendir(Dir.c_str());
+    if (dir == NULL)
+        return;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL)
+    {
+        size_t len = strlen(entry->d_name);
+        size_t prefixLen = strlen(SHM_RING_PREFIX), suffixLen = strlen(SHM_RING_SUFFIX);
+        if (len <= prefixLen + suffixLen || strncmp(entry->d_name, SHM_RING_PREFIX, prefixLen) != 0 ||
+            strcmp(entry->d_name + len - suffixLen, SHM_RING_SUFFIX) != 0)
+            continue;
+        std::string path = Dir + "/" + entry->d_name;
+        struct stat st;
+        if (stat(path.c_str(), &st) != 0)
+            continue;
+        bool mapped = false;
+        for (const auto &ring : Rings)
+            mapped = mapped || (ring->Dev == st.st_dev && ring->Ino == st.st_ino);
+        if (!mapped)
+            MapRing(path);
+    }
+    closedir(dir);
+}
+int ShmRingSrv::MapRing(const std::string &path)
+{
+    if (Rings.size() >= SHM_MAX_RINGS)
+    {
+        printf("too many shm rings, ignoring %s\n", path.c_str());
+        return -1;
+    }
+    int fd = open(path.c_str(), O_RDWR | O_CLOEXEC);
+    if (fd == -1)
+        return -1;
+    struct stat st;
+    ShmRingHeader header;
+    if (fstat(fd, &st) != 0 || st.st_size < SHM_RING_HEADER_SIZE + SHM_RING_MIN_SIZE ||
+        pread(fd, &header, sizeof(header), 0) != sizeof(header) || header.Magic != SHM_RING_MAGIC ||
+        header.Version != SHM_RING_VERSION || header.Capacity < SHM_RING_MIN_SIZE || header.Capacity > SHM_RING_MAX_SIZE ||
+        (header.Capacity & (header.Capacity - 1)) != 0 || (uint64_t)st.st_size != SHM_RING_HEADER_SIZE + header.Capacity)
+    {
+        close(fd);
+        printf("invalid shm ring %s, ignoring it\n", path.c_str());
+        return -1;
+    }
+    size_t mapSize = st.st_size;
+    void *map = mmap(NULL, mapSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+    {
+        printf("unable to map shm ring %s: %s\n", path.c_str(), strerror(errno));
+        return -1;
+    }
+    std::unique_ptr<MappedRing> ring(new MappedRing());
+    ring->Ring = (ShmRingHeader *)map;
+    ring->Data = (const char *)map + SHM_RING_HEADER_SIZE;
+    ring->Mask = header.Capacity - 1;//the mapped copy could be changed by the producer, the checked one is used
+    ring->MapSize = mapSize;
+    ring->Dev = st.st_dev;
+    ring->Ino = st.st_ino;
+    ring->Path = path;
+    Rings.push_back(std::move(ring));
+    RingCount.store(Rings.size(), std::memory_order_relaxed);
+    printf("shm ring %s connected(%llu bytes)\n", path.c_str(), (unsigned long long)header.Capacity);
+    return 0;
+}
+void ShmRingSrv::UnmapRing(size_t index,bool remove)
+{
+    MappedRing &ring = *Rings[index];
+    if (remove)
+    {
+        //only if the name still refers to this ring, the producer may have opened a new one meanwhile
+        struct stat st;
+        if (stat(ring.Path.c_str(), &st) == 0 && st.st_dev == ring.Dev && st.st_ino == ring.Ino)
+            unlink(ring.Path.c_str());
+    }
+    munmap(ring.Ring, ring.MapSize);
+    Rings.erase(Rings.begin() + index);
+    RingCount.store(Rings.size(), std::memory_order_relaxed);
+}
+} // namespace ShmIpc
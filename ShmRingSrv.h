@@ -0,0 +1,60 @@
+#pragma once
+//agent side of the shared-memory transport(see ShmRing.h): maps the rings of all producers in the
+//shm directory and drains them in batches into the publisher. one thread serves all rings, it sleeps
+//on the doorbell futex while every ring is empty.
+#include "ADThread.h"
+#include "Publisher.h"
+#include "ShmRing.h"
+#include "MetricsRegistry.h"
+#include <string>
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <sys/types.h>
+#define SHM_DRAIN_BATCH 256 //max records taken from one ring before the next ring gets its turn
+#define SHM_MAX_RINGS 64
+#define SHM_QUEUE_FULL_WAIT_US 1000 //pause while the publish queue refuses records
+
+namespace ShmIpc
+{
+    struct MappedRing
+    {
+        ShmRingHeader *Ring;
+        const char *Data;
+        uint64_t Mask;
+        size_t MapSize;
+        dev_t Dev;
+        ino_t Ino;//a producer may replace a ring with a new one of the same name
+        std::string Path;
+    };
+
+    class ShmRingSrv : public ADThreadConsumer
+    {
+        TopicPublisher::Publisher *pPublisher;
+        std::string Dir;
+        ShmDoorbell *Doorbell;
+        std::vector<std::unique_ptr<MappedRing>> Rings;//only used by ServerThread
+        std::atomic<bool> Stopping;
+        std::atomic<size_t> RingCount;
+        ADThread ServerThread;
+        Metrics::Counter &MessagesReceived;
+        Metrics::Counter &InvalidRecords;
+        Metrics::Counter &QueueFull;
+        bool Refused;//publish queue refused a record in this round
+        int RingGauge;
+        std::vector<std::pair<uint64_t,ShmRecordHeader>> Batch;//ring position and copy of the header of drained records
+        virtual int monoshot_callback_function(void* pUserData,ADThreadProducer* pObj){return 0;};//we are not using this one
+        virtual int thread_callback_function(void* pUserData,ADThreadProducer* pObj);
+        int RunServer();
+        void ScanRings();//maps new rings, removes closed and abandoned ones
+        int MapRing(const std::string &path);
+        void UnmapRing(size_t index,bool remove);
+        int DrainRing(MappedRing &ring);//returns number of records taken off the ring, -1 if the ring is corrupt
+        bool RingsEmpty() const;
+      public:
+        ShmRingSrv(const char *dir,TopicPublisher::Publisher *ptr);
+        ~ShmRingSrv();
+        //creates the directory and the doorbell, returns -1 on failure(transport stays disabled)
+        int Start();
+    };
+} // namespace ShmIpc
@@ -0,0 +1,462 @@
+#include "SpoolLog.h"
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <algorithm>
+
+//segment file: header + records, a record header with TopicLen 0(zero filled space) ends the segment
+#define SPOOL_MAGIC 0x50534941 //"AISP"
+#define SEGMENT_HEADER_SIZE 16 //magic(4) version(4) first seq(8)
+#define RECORD_HEADER_SIZE 12 //payload length(4) topic length(2) flags(2) crc32(4)
+
+namespace
+{
+uint32_t crc32_update(uint32_t crc, const void *data, size_t len)
+{
+    static uint32_t table[256];
+    static bool init = false;
+    if (!init)
+    {
+        for (uint32_t i = 0; i < 256; i++)
+        {
+            uint32_t c = i;
+            for (int k = 0; k < 8; k++)
+                c = (c & 1) ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+            table[i] = c;
+        }
+        init = true;//only publisher thread writes records, recovery runs before it starts
+    }
+    const unsigned char *p = (const unsigned char *)data;
+    crc = ~crc;
+    while (len--)
+        crc = table[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+    return ~crc;
+}
+uint32_t record_crc(const char *header, const char *body, size_t bodyLen)
+{
+    return crc32_update(crc32_update(0, header, 8), body, bodyLen);
+}
+} // namespace
+
+namespace TopicPublisher
+{
+SpoolLog::SpoolLog()
+    : SegmentSize(SPOOL_DEFAULT_SEGMENT_SIZE), MaxSegments(0), SyncIntervalMs(SPOOL_DEFAULT_SYNC_MS), CheckpointFd(-1),
+      NextSeq(0), SavedCheckpoint(0), RewindPending(false), Unsynced(0), SyncDeadline(0)
+{
+    memset(&Stats, 0, sizeof(Stats));
+    LastAppended = ReadPos = Checkpoint = Position{0, 0, SEGMENT_HEADER_SIZE};
+}
+SpoolLog::~SpoolLog()
+{
+    if (!Segments.empty())
+        sync(0, true);
+    for (Segment &seg : Segments)
+        munmap(seg.Map, seg.Size);
+    if (CheckpointFd != -1)
+        close(CheckpointFd);
+}
+int SpoolLog::open(const char *dir, size_t maxSize, size_t segmentSize, unsigned int syncIntervalMs)
+{
+    Dir = dir;
+    SegmentSize = std::max(segmentSize, (size_t)SPOOL_MIN_SEGMENT_SIZE);
+    MaxSegments = std::max(maxSize / SegmentSize, (size_t)2);
+    SyncIntervalMs = syncIntervalMs;
+    if (mkdir(dir, 0700) != 0 && errno != EEXIST)
+    {
+        printf("unable to create spool directory %s\n", dir);
+        return -1;
+    }
+    CheckpointFd = ::open((Dir + "/checkpoint").c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (CheckpointFd == -1)
+    {
+        printf("unable to open spool checkpoint in %s\n", dir);
+        return -1;
+    }
+    return recover();
+}
+int SpoolLog::open_segment(Segment &seg, bool create)
+{
+    int fd = ::open(seg.Path.c_str(), O_RDWR | O_CLOEXEC | (create ? O_CREAT | O_TRUNC : 0), 0600);
+    if (fd == -1)
+        return -1;
+    if (create)
+    {
+        //blocks are allocated upfront, so a full disk is reported here and not as SIGBUS on write
+        if (posix_fallocate(fd, 0, SegmentSize) != 0)
+        {
+            close(fd);
+            unlink(seg.Path.c_str());
+            return -1;
+        }
+        seg.Size = SegmentSize;
+    }
+    else
+    {
+        struct stat st;
+        if (fstat(fd, &st) != 0 || (size_t)st.st_size < SEGMENT_HEADER_SIZE)
+        {
+            close(fd);
+            return -1;
+        }
+        seg.Size = st.st_size;//segment size may have been different in the previous run
+    }
+    void *map = mmap(NULL, seg.Size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);//mapping stays valid
+    if (map == MAP_FAILED)
+        return -1;
+    seg.Map = (char *)map;
+    if (create)
+    {
+        uint32_t head[2] = {SPOOL_MAGIC, 1};
+        memcpy(seg.Map, head, sizeof(head));
+        memcpy(seg.Map + 8, &seg.FirstSeq, 8);
+        seg.Written = SEGMENT_HEADER_SIZE;
+        seg.Synced = 0;
+        return 0;
+    }
+    uint32_t magic;
+    uint64_t firstSeq;
+    memcpy(&magic, seg.Map, 4);
+    memcpy(&firstSeq, seg.Map + 8, 8);
+    if (magic != SPOOL_MAGIC || firstSeq != seg.FirstSeq)
+    {
+        munmap(seg.Map, seg.Size);
+        return -1;
+    }
+    return 0;
+}
+size_t SpoolLog::parse_record(const Segment &seg, size_t offset) const
+{
+    if (offset + RECORD_HEADER_SIZE > seg.Size)
+        return 0;
+    const char *hdr = seg.Map + offset;
+    uint32_t len, crc;
+    uint16_t topicLen;
+    memcpy(&len, hdr, 4);
+    memcpy(&topicLen, hdr + 4, 2);
+    memcpy(&crc, hdr + 8, 4);
+    size_t size = RECORD_HEADER_SIZE + topicLen + (size_t)len;
+    if (topicLen == 0 || size > seg.Size - offset)
+        return 0;
+    if (record_crc(hdr, hdr + RECORD_HEADER_SIZE, topicLen + (size_t)len) != crc)
+        return 0;//torn write of the previous run
+    return size;
+}
+size_t SpoolLog::find_segment(uint64_t firstSeq) const
+{
+    for (size_t i = 0; i < Segments.size(); i++)
+    {
+        if (Segments[i].FirstSeq == firstSeq)
+            return i;
+    }
+    return Segments.size();
+}
+//reads the record at pos(skipping to the next segment at the end of a segment), pos is moved behind it
+int SpoolLog::read_record(Position &pos, Position &record, std::string *topic, PayloadSpan *payload, uint16_t *flags)
+{
+    size_t idx = find_segment(pos.SegmentSeq);
+    while (idx < Segments.size())
+    {
+        const Segment &seg = Segments[idx];
+        size_t size = (pos.Offset < seg.Written) ? parse_record(seg, pos.Offset) : 0;
+        if (size > 0)
+        {
+            record = pos;
+            const char *hdr = seg.Map + pos.Offset;
+            uint16_t topicLen;
+            memcpy(&topicLen, hdr + 4, 2);
+            if (topic != NULL)
+                topic->assign(hdr + RECORD_HEADER_SIZE, topicLen);
+            if (flags != NULL)
+                memcpy(flags, hdr + 6, 2);
+            if (payload != NULL)
+            {
+                //copied, segment may be dropped while the client still sends it
+                PayloadRef buf = PayloadBuffer::CopyFrom(hdr + RECORD_HEADER_SIZE + topicLen, size - RECORD_HEADER_SIZE - topicLen);
+                if (buf == nullptr)
+                    return -1;
+                *payload = PayloadSpan(std::move(buf));
+            }
+            pos.Offset += size;
+            pos.Seq++;
+            return 1;
+        }
+        if (++idx >= Segments.size())
+            break;//end of the log
+        pos = Position{Segments[idx].FirstSeq, Segments[idx].FirstSeq, SEGMENT_HEADER_SIZE};
+    }
+    return 0;
+}
+int SpoolLog::recover()
+{
+    uint64_t saved[2] = {0, 0};
+    uint64_t checkpoint = 0;
+    if (pread(CheckpointFd, saved, sizeof(saved), 0) == sizeof(saved) && saved[0] == ~saved[1])
+        checkpoint = saved[0];
+
+    std::vector<uint64_t> found;
+    DIR *dp = opendir(Dir.c_str());
+    if (dp == NULL)
+        return -1;
+    struct dirent *ent;
+    while ((ent = readdir(dp)) != NULL)
+    {
+        unsigned long long seq;
+        char tail[8];
+        if (sscanf(ent->d_name, "seg-%16llx.%7s", &seq, tail) == 2 && strcmp(tail, "log") == 0)
+            found.push_back(seq);
+    }
+    closedir(dp);
+    std::sort(found.begin(), found.end());
+
+    for (size_t i = 0; i < found.size(); i++)
+    {
+        char name[64];
+        snprintf(name, sizeof(name), "/seg-%016llx.log", (unsigned long long)found[i]);
+        Segment seg;
+        seg.FirstSeq = found[i];
+        seg.Path = Dir + name;
+        bool acked = (i + 1 < found.size() && found[i + 1] <= checkpoint);
+        if (acked || open_segment(seg, false) != 0)
+        {
+            unlink(seg.Path.c_str());//fully acknowledged or unusable
+            continue;
+        }
+        //find the end of the segment, everything behind a broken record is lost
+        size_t offset = SEGMENT_HEADER_SIZE, size;
+        uint64_t seq = seg.FirstSeq;
+        while ((size = parse_record(seg, offset)) > 0)
+        {
+            offset += size;
+            seq++;
+        }
+        seg.Written = seg.Synced = offset;
+        Segments.push_back(seg);
+        NextSeq = seq;
+    }
+    if (Segments.empty() || Segments.back().Written + RECORD_HEADER_SIZE > Segments.back().Size)
+    {
+        NextSeq = std::max(NextSeq, checkpoint);
+        if (add_segment() != 0)
+            return -1;
+    }
+    else
+    {
+        //a torn record could be taken for a valid one once it is partly overwritten
+        Segment &last = Segments.back();
+        size_t start = last.Written & ~((size_t)sysconf(_SC_PAGESIZE) - 1);
+        memset(last.Map + last.Written, 0, last.Size - last.Written);
+        msync(last.Map + start, last.Size - start, MS_SYNC);
+    }
+    //checkpoint of a log which was dropped or lost, start at the oldest record that is left
+    checkpoint = std::min(std::max(checkpoint, Segments.front().FirstSeq), NextSeq);
+    Position pos{Segments.front().FirstSeq, Segments.front().FirstSeq, SEGMENT_HEADER_SIZE};
+    Position record;
+    while (pos.Seq < checkpoint && read_record(pos, record, NULL, NULL, NULL) == 1)
+        ;
+    Checkpoint = ReadPos = pos;
+    SavedCheckpoint = pos.Seq;
+    Stats.Segments = Segments.size();
+    if (NextSeq > pos.Seq)
+        printf("spool: %llu records of the previous run will be sent\n", (unsigned long long)(NextSeq - pos.Seq));
+    return 0;
+}
+int SpoolLog::add_segment()
+{
+    if (!Segments.empty() && Segments.size() >= MaxSegments)
+        drop_oldest();
+    char name[64];
+    snprintf(name, sizeof(name), "/seg-%016llx.log", (unsigned long long)NextSeq);
+    Segment seg;
+    seg.FirstSeq = NextSeq;
+    seg.Path = Dir + name;
+    if (open_segment(seg, true) != 0)
+    {
+        printf("unable to create spool segment %s\n", seg.Path.c_str());
+        return -1;
+    }
+    Segments.push_back(seg);
+    Stats.Segments = Segments.size();
+    return 0;
+}
+void SpoolLog::drop_oldest()
+{
+    Segment seg = Segments.front();
+    Segments.pop_front();
+    uint64_t end = Segments.front().FirstSeq;
+    if (end > Checkpoint.Seq)
+        Stats.Dropped += end - std::max(seg.FirstSeq, Checkpoint.Seq);//not acknowledged yet
+    munmap(seg.Map, seg.Size);
+    unlink(seg.Path.c_str());
+    Position first{end, end, SEGMENT_HEADER_SIZE};
+    if (Checkpoint.SegmentSeq == seg.FirstSeq)
+        Checkpoint = first;
+    if (ReadPos.SegmentSeq == seg.FirstSeq)
+        ReadPos = first;
+    while (!Sent.empty() && Sent.front().Pos.SegmentSeq == seg.FirstSeq)
+        Sent.pop_front();
+    Stats.Segments = Segments.size();
+}
+int SpoolLog::append(const std::string &topic, const char *data, size_t len, uint16_t flags, uint64_t &seq)
+{
+    std::lock_guard<std::mutex> lock(Lock);
+    size_t size = RECORD_HEADER_SIZE + topic.length() + len;
+    if (topic.empty() || topic.length() > 0xFFFF || size > SegmentSize - SEGMENT_HEADER_SIZE)
+    {
+        Stats.Dropped++;
+        return -1;
+    }
+    if (Segments.back().Written + size > Segments.back().Size && add_segment() != 0)
+    {
+        Stats.Dropped++;
+        return -1;
+    }
+    Segment &seg = Segments.back();
+    char *hdr = seg.Map + seg.Written;
+    uint32_t len32 = len;
+    uint16_t topicLen = topic.length();
+    memcpy(hdr, &len32, 4);
+    memcpy(hdr + 4, &topicLen, 2);
+    memcpy(hdr + 6, &flags, 2);
+    memcpy(hdr + RECORD_HEADER_SIZE, topic.data(), topicLen);
+    memcpy(hdr + RECORD_HEADER_SIZE + topicLen, data, len);
+    uint32_t crc = record_crc(hdr, hdr + RECORD_HEADER_SIZE, topicLen + len);
+    memcpy(hdr + 8, &crc, 4);
+    LastAppended = Position{NextSeq, seg.FirstSeq, seg.Written};
+    seg.Written += size;
+    seq = NextSeq++;
+    Unsynced++;
+    Stats.Appended++;
+    return 0;
+}
+bool SpoolLog::caughtUp()
+{
+    std::lock_guard<std::mutex> lock(Lock);
+    return !RewindPending && ReadPos.Seq == NextSeq;
+}
+void SpoolLog::markSent(uint64_t seq)
+{
+    std::lock_guard<std::mutex> lock(Lock);
+    if (seq != LastAppended.Seq)
+        return;
+    Sent.push_back(InFlight{LastAppended, false});
+    ReadPos = Position{NextSeq, Segments.back().FirstSeq, Segments.back().Written};
+}
+int SpoolLog::next(std::string &topic, PayloadSpan &payload, uint16_t &flags, uint64_t &seq)
+{
+    std::lock_guard<std::mutex> lock(Lock);
+    if (RewindPending)
+    {
+        //records after the checkpoint may or may not have arrived, send all of them again
+        ReadPos = Checkpoint;
+        Sent.clear();
+        RewindPending = false;
+        Stats.Rewinds++;
+    }
+    Position record;
+    int ret = read_record(ReadPos, record, &topic, &payload, &flags);
+    if (ret != 1)
+        return ret;
+    Sent.push_back(InFlight{record, false});
+    seq = record.Seq;
+    Stats.Replayed++;
+    return 1;
+}
+void SpoolLog::release_acked()
+{
+    while (!Sent.empty() && Sent.front().Acked)
+        Sent.pop_front();
+    Checkpoint = Sent.empty() ? ReadPos : Sent.front().Pos;
+}
+void SpoolLog::ack(uint64_t seq)
+{
+    std::lock_guard<std::mutex> lock(Lock);
+    auto it = std::lower_bound(Sent.begin(), Sent.end(), seq,
+                               [](const InFlight &f, uint64_t s) { return f.Pos.Seq < s; });
+    if (it == Sent.end() || it->Pos.Seq != seq || it->Acked)
+        return;//sent before a rewind or segment was dropped
+    it->Acked = true;
+    Stats.Acked++;
+    if (it == Sent.begin())
+        release_acked();
+}
+void SpoolLog::nack(uint64_t seq)
+{
+    std::lock_guard<std::mutex> lock(Lock);
+    if (!Sent.empty() && seq >= Sent.front().Pos.Seq)
+        RewindPending = true;
+}
+//the lock is not held while syncing, ack()/nack() run on the mqtt event-loop thread and must not
+//wait for the disk. segments are only added or dropped by the publisher thread, which is the caller
+unsigned int SpoolLog::sync(uint64_t nowMs, bool force)
+{
+    struct Range
+    {
+        char *Start;
+        size_t Len;
+        size_t Written;
+    };
+    std::vector<Range> ranges;
+    unsigned int unsynced;
+    uint64_t checkpoint;
+    {
+        std::lock_guard<std::mutex> lock(Lock);
+        bool dirty = Unsynced > 0 || Checkpoint.Seq != SavedCheckpoint;
+        if (!dirty)
+            return 0;
+        if (SyncDeadline == 0)
+            SyncDeadline = nowMs + SyncIntervalMs;
+        if (!force && Unsynced < SPOOL_SYNC_BATCH && nowMs < SyncDeadline)
+            return (unsigned int)(SyncDeadline - nowMs);
+        size_t page = sysconf(_SC_PAGESIZE);
+        for (Segment &seg : Segments)
+        {
+            size_t start = seg.Synced & ~(page - 1);
+            if (seg.Written > seg.Synced)
+                ranges.push_back(Range{seg.Map + start, seg.Written - start, seg.Written});
+            else
+                ranges.push_back(Range{NULL, 0, seg.Written});
+        }
+        unsynced = Unsynced;
+        checkpoint = Checkpoint.Seq;
+    }
+    for (const Range &range : ranges)
+    {
+        if (range.Len > 0)
+            msync(range.Start, range.Len, MS_SYNC);
+    }
+    bool saved = checkpoint != SavedCheckpoint && write_checkpoint(checkpoint) == 0;
+
+    std::lock_guard<std::mutex> lock(Lock);
+    for (size_t i = 0; i < ranges.size(); i++)
+        Segments[i].Synced = ranges[i].Written;
+    Unsynced -= unsynced;
+    if (saved)
+        SavedCheckpoint = checkpoint;
+    //segments behind the checkpoint are not needed anymore
+    while (Segments.size() > 1 && Segments[1].FirstSeq <= SavedCheckpoint)
+        drop_oldest();
+    SyncDeadline = 0;
+    Stats.Syncs++;
+    return 0;
+}
+int SpoolLog::write_checkpoint(uint64_t seq)
+{
+    uint64_t saved[2] = {seq, ~seq};//both halves have to match, a torn write is ignored
+    if (pwrite(CheckpointFd, saved, sizeof(saved), 0) != sizeof(saved))
+        return -1;
+    return fdatasync(CheckpointFd);
+}
+void SpoolLog::getStats(SpoolStats &stats)
+{
+    std::lock_guard<std::mutex> lock(Lock);
+    stats = Stats;
+    stats.Pending = NextSeq - Checkpoint.Seq;
+}
+} // namespace TopicPublisher
@@ -0,0 +1,105 @@
+#pragma once
+//disk-backed store-and-forward queue of the publisher. every publish is appended to a log of fixed
+//size memory-mapped segment files(<dir>/seg-<first seq>.log) and checkpointed(<dir>/checkpoint) once
+//the broker acknowledged it. records which were never sent(connection down) are replayed in order
+//when the connection is back, after a restart everything behind the checkpoint is replayed.
+//msync/fdatasync is batched: after SPOOL_SYNC_BATCH records or SyncIntervalMs, whichever comes first.
+//when the log is full, the oldest segment is dropped(even if not acknowledged yet).
+#include "PayloadBuffer.h"
+#include <string>
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <stdint.h>
+
+#define SPOOL_DEFAULT_SEGMENT_SIZE (1024*1024)
+#define SPOOL_MIN_SEGMENT_SIZE (256*1024) //has to hold the largest mqtt payload
+#define SPOOL_DEFAULT_MAX_SIZE (16*1024*1024)
+#define SPOOL_DEFAULT_SYNC_MS 100
+#define SPOOL_SYNC_BATCH 256
+#define SPOOL_REPLAY_BATCH 256 //max records replayed per publisher wakeup
+#define SPOOL_FLAG_QOS0 0x1 //record flags, none set: qos1 without retain
+#define SPOOL_FLAG_RETAIN 0x2
+
+namespace TopicPublisher
+{
+    struct SpoolStats
+    {
+        uint64_t Appended;
+        uint64_t Replayed;//records sent from disk(after reconnect or restart)
+        uint64_t Acked;
+        uint64_t Dropped;//records lost because log was full or record too large
+        uint64_t Rewinds;//replays from checkpoint after a failed publish
+        uint64_t Syncs;
+        uint64_t Pending;//records not acknowledged yet
+        uint64_t Segments;
+    };
+
+    class SpoolLog
+    {
+        struct Segment
+        {
+            uint64_t FirstSeq;
+            char *Map;
+            size_t Size;
+            size_t Written;//bytes in use, including the segment header
+            size_t Synced;//bytes up to which msync was done
+            std::string Path;
+        };
+        struct Position
+        {
+            uint64_t Seq;
+            uint64_t SegmentSeq;//FirstSeq of the segment holding the record
+            size_t Offset;
+        };
+        struct InFlight
+        {
+            Position Pos;
+            bool Acked;
+        };
+        std::string Dir;
+        size_t SegmentSize;
+        size_t MaxSegments;
+        unsigned int SyncIntervalMs;
+        int CheckpointFd;
+        std::deque<Segment> Segments;//oldest first, last one is written
+        uint64_t NextSeq;//seq of the next appended record
+        Position LastAppended;
+        Position ReadPos;//next record to replay
+        Position Checkpoint;//first record not acknowledged yet
+        uint64_t SavedCheckpoint;//seq written to the checkpoint file
+        std::deque<InFlight> Sent;//sent and not yet checkpointed, in seq order
+        bool RewindPending;
+        unsigned int Unsynced;
+        uint64_t SyncDeadline;
+        std::mutex Lock;//ack()/nack() come from the mqtt event-loop thread
+        SpoolStats Stats;
+
+        int open_segment(Segment &seg, bool create);
+        int add_segment();
+        void drop_oldest();
+        int recover();
+        void release_acked();
+        size_t find_segment(uint64_t firstSeq) const;//index in Segments, Segments.size() if not found
+        size_t parse_record(const Segment &seg, size_t offset) const;//returns record size, 0 at the end
+        int read_record(Position &pos, Position &record, std::string *topic, PayloadSpan *payload, uint16_t *flags);
+        int write_checkpoint(uint64_t seq);
+      public:
+        SpoolLog();
+        ~SpoolLog();
+        //creates dir if needed and recovers the log of a previous run, returns -1 on error
+        int open(const char *dir, size_t maxSize = SPOOL_DEFAULT_MAX_SIZE, size_t segmentSize = SPOOL_DEFAULT_SEGMENT_SIZE,
+                 unsigned int syncIntervalMs = SPOOL_DEFAULT_SYNC_MS);
+        //all functions except ack/nack are only called by the publisher thread
+        int append(const std::string &topic, const char *data, size_t len, uint16_t flags, uint64_t &seq);//returns -1 if not stored
+        bool caughtUp();//true if every record has been sent
+        void markSent(uint64_t seq);//appended record was sent right away
+        //next record to replay, returns 1 if one was read, 0 if caught up
+        int next(std::string &topic, PayloadSpan &payload, uint16_t &flags, uint64_t &seq);
+        void ack(uint64_t seq);//record was acknowledged by the broker
+        void nack(uint64_t seq);//publish failed, everything after the checkpoint is sent again
+        //msync and checkpoint if due, returns ms till the next sync is due(0: nothing pending)
+        unsigned int sync(uint64_t nowMs, bool force = false);
+        void getStats(SpoolStats &stats);
+    };
+} // namespace TopicPublisher
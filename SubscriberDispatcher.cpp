@@ -0,0 +1,71 @@
+//this class decouples the subscribe callbacks(which run on the aws-crt event-loop thread and must not
+//block keepalives, pubacks and publishes) from the user supplied handlers.
+#include "SubscriberDispatcher.h"
+
+namespace TopicSubscriber
+{
+SubscriberDispatcher::SubscriberDispatcher(DispatchHandler handler,int workers,size_t queueSize,RING_POLICY queuePolicy)
+    :Queue(queueSize,queuePolicy),NextWorker(0),Handler(std::move(handler)),
+     Handled(Metrics::Registry::global().counter("subscribe_messages_handled_total","Received messages passed to the handlers")),
+     Dropped(Metrics::Registry::global().counter("subscribe_dropped_total","Received messages discarded by the drop-oldest handler queue policy")),
+     Failed(Metrics::Registry::global().counter("subscribe_rejected_total","Received messages which could not be queued for the handlers")),
+     DispatchLatency(Metrics::Registry::global().histogram("subscribe_dispatch_latency_seconds","Time a received message waited for a dispatcher worker"))
+{
+        QueueDepthGauge = Metrics::Registry::global().addGauge("subscribe_queue_depth","Received messages waiting for a dispatcher worker",[this]() {
+            return (int64_t)Queue.size();
+        });
+        if(workers < 1)
+            workers = 1;
+        if(workers > DISPATCH_MAX_WORKERS)
+            workers = DISPATCH_MAX_WORKERS;
+        //all worker threads share the queue and report to this object
+        for(int i=0;i<workers;i++)
+        {
+            Workers.emplace_back(new ADThread());
+            Workers.back()->subscribe_thread_callback(this);
+            Workers.back()->set_thread_properties(THREAD_TYPE_MONOSHOT,(void *)this);
+            Workers.back()->start_thread();
+        }
+}
+SubscriberDispatcher::~SubscriberDispatcher()
+{
+    Metrics::Registry::global().removeGauge(QueueDepthGauge);
+    for(auto &worker : Workers)
+        worker->stop_thread();
+}
+int SubscriberDispatcher::monoshot_callback_function(void* pUserData,ADThreadProducer* pObj)
+{
+    //one entry at a time, so that other woken workers can share a burst
+    IncomingEntry entry;
+    while (Queue.pop(entry))
+    {
+        DispatchLatency.recordSince(entry.ReceivedUs);
+        Handler(entry.Topic, entry.Payload);
+        Handled.add();
+        entry.Payload = PayloadSpan();//release buffer before sleeping
+    }
+    return 0;
+}
+int SubscriberDispatcher::dispatch(const char *topic,const uint8_t *data,size_t len)
+{
+    //the crt buffer is only valid during the callback, this is the only copy of the payload
+    PayloadRef buf = PayloadBuffer::CopyFrom(data,len);
+    int ret = (buf == nullptr) ? -1 : Queue.push(IncomingEntry(topic,PayloadSpan(std::move(buf))));
+    if(ret < 0)
+    {
+        Failed.add();
+        return -1;
+    }
+    if(ret == 1)
+        Dropped.add();
+    Workers[NextWorker.fetch_add(1) % Workers.size()]->wakeup_thread_coalesced();
+    return 0;
+}
+void SubscriberDispatcher::getStats(DispatchStats &stats) const
+{
+    Queue.get_stats(stats.Queue);
+    stats.Handled = Handled.value();
+    stats.Dropped = Dropped.value();
+    stats.Failed = Failed.value();
+}
+} // namespace TopicSubscriber
@@ -0,0 +1,62 @@
+#pragma once
+//takes incoming mqtt messages off the aws-crt event-loop thread: the subscribe callback only copies
+//the payload into a refcounted buffer and queues it, a pool of worker threads runs the handlers.
+#include "ADThread.h"
+#include "BoundedRing.h"
+#include "PayloadBuffer.h"
+#include "MetricsRegistry.h"
+#include <string>
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <functional>
+#include <stdint.h>
+
+#define DISPATCH_QUEUE_DEFAULT_SIZE 256
+#define DISPATCH_MAX_WORKERS 16
+
+struct IncomingEntry
+{
+        std::string Topic;
+        PayloadSpan Payload;
+        uint64_t ReceivedUs;//monotonic time the message was queued
+public:
+        IncomingEntry():ReceivedUs(0){}//needed for preallocated ring slots
+        IncomingEntry(std::string topic,PayloadSpan payload)
+            :Topic(std::move(topic)),Payload(std::move(payload)),ReceivedUs(Metrics::now_us()){}
+};
+
+struct DispatchStats
+{
+    RingStats Queue;
+    uint64_t Handled;//messages passed to the handler
+    uint64_t Dropped;//queued messages discarded by the drop-oldest policy
+    uint64_t Failed;//messages which could not be queued(reject policy or out of memory)
+};
+
+namespace TopicSubscriber
+{
+    typedef std::function<void(const std::string &topic, const PayloadSpan &payload)> DispatchHandler;
+
+    class SubscriberDispatcher : public ADThreadConsumer
+    {
+        BoundedRing<IncomingEntry> Queue;
+        std::vector<std::unique_ptr<ADThread>> Workers;
+        std::atomic<unsigned int> NextWorker;
+        DispatchHandler Handler;
+        Metrics::Counter &Handled;
+        Metrics::Counter &Dropped;
+        Metrics::Counter &Failed;
+        Metrics::Histogram &DispatchLatency;//queued till a worker picks the message up
+        int QueueDepthGauge;
+        virtual int monoshot_callback_function(void* pUserData,ADThreadProducer* pObj);
+        virtual int thread_callback_function(void* pUserData,ADThreadProducer* pObj){return 0;};//we are not using this one..
+      public:
+        SubscriberDispatcher(DispatchHandler handler,int workers=1,
+                             size_t queueSize=DISPATCH_QUEUE_DEFAULT_SIZE,RING_POLICY queuePolicy=RING_POLICY_DROP_OLDEST);
+        ~SubscriberDispatcher();
+        //called from the mqtt callback, data is copied once and handled later on a worker thread
+        int dispatch(const char *topic,const uint8_t *data,size_t len);
+        void getStats(DispatchStats &stats) const;
+    };
+} // namespace TopicSubscriber
@@ -0,0 +1,162 @@
+#include "SubscriberHandler.h"
+#include "ProcessUtils.h"
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+
+HANDLER_MODE handler_mode_from_string(const char *name)
+{
+    if (strcmp(name, "oneshot") == 0)
+        return HANDLER_MODE_ONESHOT;
+    if (strcmp(name, "stream") == 0)
+        return HANDLER_MODE_STREAM;
+    return HANDLER_MODE_NONE;
+}
+static int write_all(int fd, const char *data, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t n = write(fd, data, len);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+namespace TopicSubscriber
+{
+SubscriberHandler::SubscriberHandler(const std::string &command, HANDLER_MODE mode, IPC_FRAMING framing, int workers)
+    : Command(command), Mode(mode), Framing(framing), NextWorker(0)
+{
+    if (Mode != HANDLER_MODE_STREAM)
+        return;
+    if (workers < 1)
+        workers = 1;
+    if (workers > HANDLER_MAX_WORKERS)
+        workers = HANDLER_MAX_WORKERS;
+    for (int i = 0; i < workers; i++)
+    {
+        Workers.emplace_back(new Worker());
+        spawn_worker(*Workers.back());//if it fails, it is tried again on first message
+    }
+}
+SubscriberHandler::~SubscriberHandler()
+{
+    for (auto &worker : Workers)
+        stop_worker(*worker, false);
+}
+//handler is executed directly(no shell) with a pipe as its stdin
+int SubscriberHandler::spawn_worker(Worker &worker)
+{
+    int fd;
+    pid_t pid = SpawnProcess(Command.c_str(), &fd, NULL);
+    if (pid == -1)
+        return -1;
+    worker.Pid = pid;
+    worker.Fd = fd;
+    return 0;
+}
+void SubscriberHandler::stop_worker(Worker &worker, bool force)
+{
+    if (worker.Fd != -1)
+        close(worker.Fd);//worker sees EOF on stdin and is expected to exit
+    if (worker.Pid != -1)
+    {
+        if (force)
+            kill(worker.Pid, SIGTERM);
+        waitpid(worker.Pid, NULL, 0);
+    }
+    worker.Fd = -1;
+    worker.Pid = -1;
+}
+int SubscriberHandler::write_frame(Worker &worker, const char *data, size_t len)
+{
+    unsigned char header[4] = {(unsigned char)(len >> 24), (unsigned char)(len >> 16), (unsigned char)(len >> 8),
+                               (unsigned char)len};
+    char newline = '\n';
+    struct iovec iov[3];
+    int iovcnt = 0;
+    if (Framing == IPC_FRAMING_LENGTH_PREFIX)
+    {
+        iov[iovcnt].iov_base = header;
+        iov[iovcnt++].iov_len = sizeof(header);
+    }
+    iov[iovcnt].iov_base = (void *)data;
+    iov[iovcnt++].iov_len = len;
+    if (Framing != IPC_FRAMING_LENGTH_PREFIX)
+    {
+        iov[iovcnt].iov_base = &newline;
+        iov[iovcnt++].iov_len = 1;
+    }
+    struct iovec *cur = iov;
+    while (iovcnt > 0)
+    {
+        ssize_t n = writev(worker.Fd, cur, iovcnt);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return -1;//EPIPE: worker is gone(SIGPIPE has to be ignored by the process)
+        }
+        while (iovcnt > 0 && (size_t)n >= cur->iov_len)
+        {
+            n -= cur->iov_len;
+            cur++;
+            iovcnt--;
+        }
+        if (iovcnt > 0)
+        {
+            cur->iov_base = (char *)cur->iov_base + n;
+            cur->iov_len -= n;
+        }
+    }
+    return 0;
+}
+int SubscriberHandler::run_oneshot(const char *data, size_t len)
+{
+    //pass the incoming payload to handler via file, a file per message so that handlers running on
+    //several dispatcher workers do not overwrite each others payload
+    char path[] = SUBSCRIBER_DATA_TEMPLATE;
+    int fd = mkstemp(path);
+    if (fd == -1)
+    {
+        printf("Error on mkstemp() call \n");
+        return -1;
+    }
+    int ret = (write_all(fd, data, len) == 0 && write_all(fd, "\n", 1) == 0) ? 0 : -1;
+    close(fd);
+    if (ret == 0)
+    {
+        std::string invokeCommand = Command + " " + path;
+        //e.g "/usr/sbin/blink-led.sh /tmp/subscriber-data-Ab12Cd"
+        InvokeShellCommand(invokeCommand.c_str());
+    }
+    unlink(path);
+    return ret;
+}
+int SubscriberHandler::handleMessage(const char *data, size_t len)
+{
+    if (Mode != HANDLER_MODE_STREAM)
+        return run_oneshot(data, len);
+
+    Worker &worker = *Workers[NextWorker.fetch_add(1) % Workers.size()];
+    std::lock_guard<std::mutex> lock(worker.Lock);
+    if (worker.Fd != -1 && write_frame(worker, data, len) == 0)
+        return 0;
+    //worker died(or was never started), restart it and try once more
+    stop_worker(worker, true);
+    if (spawn_worker(worker) != 0)
+        return -1;
+    return write_frame(worker, data, len);
+}
+} // namespace TopicSubscriber
@@ -0,0 +1,57 @@
+#pragma once
+//runs the user supplied handler for messages arriving on a subscribed topic.
+//oneshot : payload is written to a file of its own(SUBSCRIBER_DATA_TEMPLATE) and handler is invoked with
+//          the file path for every message(fork+exec of a shell per message, kept for existing handler
+//          scripts). the file is removed once the handler returned
+//stream  : handler is spawned once(a pool of workers) and keeps running, every message is written
+//          to stdin of one of the workers, framed as ndjson('\n' terminated) or 4 byte big-endian
+//          length + payload. a worker which exits is spawned again on the next message.
+//payloads are passed as raw bytes of any size, use length framing if payloads may contain '\n'.
+#include "IpcFraming.h"
+#include <string>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <sys/types.h>
+
+#define SUBSCRIBER_DATA_TEMPLATE "/tmp/subscriber-data-XXXXXX" //mkstemp(), one file per message
+#define HANDLER_MAX_WORKERS 16
+
+typedef enum HANDLER_MODE_T
+{
+    HANDLER_MODE_ONESHOT,
+    HANDLER_MODE_STREAM,
+    HANDLER_MODE_NONE
+}HANDLER_MODE;
+
+//"oneshot" or "stream", returns HANDLER_MODE_NONE for anything else
+HANDLER_MODE handler_mode_from_string(const char *name);
+
+namespace TopicSubscriber
+{
+    class SubscriberHandler
+    {
+        struct Worker
+        {
+            pid_t Pid;
+            int Fd;//write end of the pipe connected to stdin of the worker
+            std::mutex Lock;//one message at a time per worker
+            Worker() : Pid(-1), Fd(-1) {}
+        };
+        std::string Command;
+        HANDLER_MODE Mode;
+        IPC_FRAMING Framing;
+        std::vector<std::unique_ptr<Worker>> Workers;
+        std::atomic<unsigned int> NextWorker;
+        int spawn_worker(Worker &worker);
+        void stop_worker(Worker &worker, bool force);
+        int write_frame(Worker &worker, const char *data, size_t len);
+        int run_oneshot(const char *data, size_t len);
+      public:
+        SubscriberHandler(const std::string &command, HANDLER_MODE mode = HANDLER_MODE_ONESHOT,
+                          IPC_FRAMING framing = IPC_FRAMING_NDJSON, int workers = 1);
+        ~SubscriberHandler();
+        int handleMessage(const char *data, size_t len);//returns -1 if message could not be delivered
+    };
+} // namespace TopicSubscriber
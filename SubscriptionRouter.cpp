@@ -0,0 +1,107 @@
+#include "SubscriptionRouter.h"
+#include "ProcessUtils.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+
+namespace TopicSubscriber
+{
+SubscriptionRouter::SubscriptionRouter()
+    : HandlerRuntime(Metrics::Registry::global().histogram("handler_runtime_seconds", "Time a subscription handler took for one message"))
+{
+}
+int SubscriptionRouter::addSubscription(const std::string &filter, const std::string &handler, const HandlerOptions &options)
+{
+    //a filter without handler is subscribed too, the broker would refuse an invalid one
+    if (!topic_filter_valid(filter.data(), filter.length()))
+    {
+        printf("invalid topic filter %s\n", filter.c_str());
+        return -1;
+    }
+    SubscriberHandler *target = NULL;
+    if (!handler.empty())
+    {
+        if (!IsValidFile(handler.c_str()))
+        {
+            printf("handler %s for %s not found\n", handler.c_str(), filter.c_str());
+            return -1;
+        }
+        Handlers.emplace_back(new SubscriberHandler(handler, options.Mode, options.Framing, options.Workers));
+        target = Handlers.back().get();
+    }
+    if (target != NULL && Routes.insert(filter, target) != 0)
+    {
+        printf("invalid topic filter %s\n", filter.c_str());
+        Handlers.pop_back();
+        return -1;
+    }
+    auto it = std::find(Filters.begin(), Filters.end(), filter);
+    if (it == Filters.end())
+    {
+        Filters.push_back(filter);
+        FilterQos.push_back(options.Qos);
+    }
+    else
+        FilterQos[it - Filters.begin()] = std::max(FilterQos[it - Filters.begin()], options.Qos);
+    return 0;
+}
+int SubscriptionRouter::loadFile(const char *path, const HandlerOptions &defaults)
+{
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL)
+    {
+        printf("unable to open subscriptions file %s\n", path);
+        return -1;
+    }
+    char line[SUBSCRIPTION_FILE_MAX_LINE];
+    int lineNo = 0, ret = 0;
+    while (fgets(line, sizeof(line), fp) != NULL)
+    {
+        lineNo++;
+        char *save = NULL;
+        char *filter = strtok_r(line, " \t\r\n", &save);
+        if (filter == NULL || filter[0] == '#')
+            continue;//comment(a plain "#" filter can be given with --subtopic)
+        std::string handler;
+        HandlerOptions options = defaults;
+        bool valid = true;
+        for (char *tok = strtok_r(NULL, " \t\r\n", &save); tok != NULL; tok = strtok_r(NULL, " \t\r\n", &save))
+        {
+            if (strncmp(tok, "mode=", 5) == 0)
+                valid &= (options.Mode = handler_mode_from_string(tok + 5)) != HANDLER_MODE_NONE;
+            else if (strncmp(tok, "workers=", 8) == 0)
+                valid &= (options.Workers = atoi(tok + 8)) > 0;
+            else if (strcmp(tok, "qos=0") == 0 || strcmp(tok, "qos=1") == 0)
+                options.Qos = tok[4] - '0';
+            else if (strncmp(tok, "framing=", 8) == 0)
+            {
+                options.Framing = ipc_framing_from_string(tok + 8);
+                valid &= (options.Framing == IPC_FRAMING_NDJSON || options.Framing == IPC_FRAMING_LENGTH_PREFIX);
+            }
+            else if (handler.empty() && strchr(tok, '=') == NULL)
+                handler = tok;
+            else
+                valid = false;
+        }
+        if (!valid || addSubscription(filter, handler, options) != 0)
+        {
+            printf("invalid subscription in %s line %d\n", path, lineNo);
+            ret = -1;
+        }
+    }
+    fclose(fp);
+    return ret;
+}
+int SubscriptionRouter::route(const std::string &topic, const PayloadSpan &payload)
+{
+    int count = 0;
+    Routes.match(topic.data(), topic.size(), [&](SubscriberHandler *handler) {
+        uint64_t start = Metrics::now_us();
+        handler->handleMessage(payload.data(), payload.length());
+        HandlerRuntime.recordSince(start);
+        count++;
+    });
+    return count;
+}
+} // namespace TopicSubscriber
@@ -0,0 +1,43 @@
+#pragma once
+//routes incoming messages to the handlers of all matching subscriptions(mqtt wildcards supported)
+//subscriptions file, one per line: <topic filter> [<handler path>] [mode=oneshot|stream] [workers=N] [framing=ndjson|length] [qos=0|1]
+//'#' starts a comment, a subscription without handler is subscribed but messages are only counted.
+#include "SubscriberHandler.h"
+#include "PayloadBuffer.h"
+#include "TopicTrie.h"
+#include "MetricsRegistry.h"
+#include <string>
+#include <vector>
+#include <memory>
+
+#define SUBSCRIPTION_FILE_MAX_LINE 4096
+
+namespace TopicSubscriber
+{
+    struct HandlerOptions
+    {
+        HANDLER_MODE Mode;
+        IPC_FRAMING Framing;
+        int Workers;
+        int Qos;//subscription qos
+        HandlerOptions() : Mode(HANDLER_MODE_ONESHOT), Framing(IPC_FRAMING_NDJSON), Workers(1), Qos(1) {}
+    };
+
+    class SubscriptionRouter
+    {
+        TopicTrie<SubscriberHandler *> Routes;
+        std::vector<std::unique_ptr<SubscriberHandler>> Handlers;
+        std::vector<std::string> Filters;//unique filters, in order of registration
+        std::vector<int> FilterQos;//qos of Filters[i], highest one if a filter was added more than once
+        Metrics::Histogram &HandlerRuntime;
+      public:
+        SubscriptionRouter();
+        //handler may be empty, returns -1 for an invalid filter
+        int addSubscription(const std::string &filter, const std::string &handler, const HandlerOptions &options);
+        int loadFile(const char *path, const HandlerOptions &defaults);
+        //runs every matching handler, returns number of handlers which got the message
+        int route(const std::string &topic, const PayloadSpan &payload);
+        const std::vector<std::string> &filters() const { return Filters; }
+        int filterQos(size_t index) const { return FilterQos[index]; }
+    };
+} // namespace TopicSubscriber
@@ -0,0 +1,157 @@
+#pragma once
+//trie of mqtt topic filters, one node per topic level. '+' matches exactly one level, '#' (only as
+//last level) matches the parent level and everything below it. matching a topic visits
+//O(topic depth) nodes, no matter how many filters are stored, and does not allocate memory.
+//topics starting with '$' are not matched by wildcards at the first level(mqtt 3.1.1, 4.7.2).
+#include <string>
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include <string.h>
+
+template <typename T>
+class TopicTrie
+{
+    struct Node
+    {
+        std::vector<std::pair<std::string, std::unique_ptr<Node>>> Children;//sorted by level name
+        std::unique_ptr<Node> Plus;
+        std::vector<T> Values;//filters ending at this node
+        std::vector<T> HashValues;//filters ending with '#' below this node
+    };
+    Node Root;
+    size_t Count;
+
+    static bool level_less(const std::pair<std::string, std::unique_ptr<Node>> &child, const std::pair<const char *, size_t> &level)
+    {
+        int cmp = memcmp(child.first.data(), level.first, std::min(child.first.size(), level.second));
+        return cmp < 0 || (cmp == 0 && child.first.size() < level.second);
+    }
+    static Node *find_child(const Node &node, const char *level, size_t len)
+    {
+        std::pair<const char *, size_t> key(level, len);
+        auto it = std::lower_bound(node.Children.begin(), node.Children.end(), key, level_less);
+        if (it != node.Children.end() && it->first.size() == len && memcmp(it->first.data(), level, len) == 0)
+            return it->second.get();
+        return NULL;
+    }
+    template <typename F>
+    static void match_node(const Node &node, const char *level, const char *end, bool first, F &visit)
+    {
+        bool wildcardOk = !(first && level < end && *level == '$');
+        if (wildcardOk)
+            for (const T &v : node.HashValues)
+                visit(v);
+        const char *slash = (const char *)memchr(level, '/', end - level);
+        const char *levelEnd = slash ? slash : end;
+        Node *child = find_child(node, level, levelEnd - level);
+        if (child != NULL)
+        {
+            if (slash)
+                match_node(*child, slash + 1, end, false, visit);
+            else
+                visit_leaf(*child, visit);
+        }
+        if (node.Plus && wildcardOk)
+        {
+            if (slash)
+                match_node(*node.Plus, slash + 1, end, false, visit);
+            else
+                visit_leaf(*node.Plus, visit);
+        }
+    }
+    //topic ends at this node, "a/#" matches "a" as well
+    template <typename F>
+    static void visit_leaf(const Node &node, F &visit)
+    {
+        for (const T &v : node.Values)
+            visit(v);
+        for (const T &v : node.HashValues)
+            visit(v);
+    }
+
+  public:
+    TopicTrie() : Count(0) {}
+    //returns -1 if filter is not a valid mqtt topic filter
+    int insert(const std::string &filter, const T &value)
+    {
+        if (filter.empty())
+            return -1;
+        Node *node = &Root;
+        size_t pos = 0;
+        for (;;)
+        {
+            size_t slash = filter.find('/', pos);
+            std::string level = filter.substr(pos, slash == std::string::npos ? std::string::npos : slash - pos);
+            bool last = (slash == std::string::npos);
+            if (level == "#")
+            {
+                if (!last)
+                    return -1;//'#' must be the last level
+                node->HashValues.push_back(value);
+                break;
+            }
+            if (level.find_first_of("+#") != std::string::npos && level != "+")
+                return -1;//wildcards must occupy a whole level
+            if (level == "+")
+            {
+                if (!node->Plus)
+                    node->Plus.reset(new Node());
+                node = node->Plus.get();
+            }
+            else
+            {
+                Node *child = find_child(*node, level.data(), level.size());
+                if (child == NULL)
+                {
+                    std::pair<const char *, size_t> key(level.data(), level.size());
+                    auto it = std::lower_bound(node->Children.begin(), node->Children.end(), key, level_less);
+                    it = node->Children.insert(it, std::make_pair(level, std::unique_ptr<Node>(new Node())));
+                    child = it->second.get();
+                }
+                node = child;
+            }
+            if (last)
+            {
+                node->Values.push_back(value);
+                break;
+            }
+            pos = slash + 1;
+        }
+        Count++;
+        return 0;
+    }
+    //calls visit(value) for every filter matching topic, returns nothing
+    template <typename F>
+    void match(const char *topic, size_t len, F visit) const
+    {
+        match_node(Root, topic, topic + len, true, visit);
+    }
+    size_t size() const { return Count; }
+};
+
+//a topic a message can be published on: not empty, no wildcards('+', '#') and no NUL(mqtt 3.1.1, 4.7.3)
+inline bool topic_name_valid(const char *topic, size_t len)
+{
+    return len > 0 && memchr(topic, '+', len) == NULL && memchr(topic, '#', len) == NULL && memchr(topic, 0, len) == NULL;
+}
+//a topic filter which can be subscribed: not empty, no NUL, '+' and '#' occupy a whole level and '#'
+//is the last level(mqtt 3.1.1, 4.7.1)
+inline bool topic_filter_valid(const char *filter, size_t len)
+{
+    if (len == 0 || memchr(filter, 0, len) != NULL)
+        return false;
+    const char *level = filter, *end = filter + len;
+    for (;;)
+    {
+        const char *slash = (const char *)memchr(level, '/', end - level);
+        size_t levelLen = (slash ? slash : end) - level;
+        if (memchr(level, '#', levelLen) != NULL && (levelLen != 1 || slash != NULL))
+            return false;
+        if (memchr(level, '+', levelLen) != NULL && levelLen != 1)
+            return false;
+        if (slash == NULL)
+            return true;
+        level = slash + 1;
+    }
+}
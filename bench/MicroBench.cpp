@@ -0,0 +1,149 @@
+//microbenchmarks of the hot paths, no broker needed(the Publisher runs without mqtt client and drops
+//what it would publish). build: cmake finds google benchmark, run: ./aws-iot-pubsub-agent-microbench
+#include "LinuxDomainSocketSrv.h"
+#include "Publisher.h"
+#include "ProcessUtils.h"
+#include "SubscriberDispatcher.h"
+#include "SubscriptionRouter.h"
+#include "TopicTrie.h"
+#include <benchmark/benchmark.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <atomic>
+#include <thread>
+
+static PayloadSpan MakeRequest(size_t dataSize)
+{
+    std::string msg = "{\"topic\": \"sensors/device-1/temp\", \"data\": {\"values\": \"";
+    msg.append(dataSize, 'x');
+    msg += "\", \"unit\": \"C\"}}";
+    return PayloadSpan(PayloadBuffer::CopyFrom(msg.data(), msg.length()));
+}
+
+//domain-socket request -> topic + data span
+static void BM_ParseJsonData(benchmark::State &state)
+{
+    PayloadSpan msg = MakeRequest(state.range(0));
+    std::string topic;
+    PayloadSpan data;
+    int qos, retain;
+    for (auto _ : state)
+    {
+        int ret = DomainSock::LinuxDomainSocketSrv::ParseJsonData(msg, topic, data, qos, retain);
+        benchmark::DoNotOptimize(ret);
+    }
+    state.SetBytesProcessed(state.iterations() * msg.length());
+}
+BENCHMARK(BM_ParseJsonData)->Arg(16)->Arg(1024)->Arg(64 * 1024);
+
+//publishTopic from 1..N producers, drained by the publisher thread(block policy, so the measured
+//rate includes waiting for the consumer once the queue is full)
+static TopicPublisher::Publisher *BenchPublisher;
+static void BM_PublishEnqueue(benchmark::State &state)
+{
+    if (state.thread_index() == 0)
+        BenchPublisher = new TopicPublisher::Publisher(nullptr, PUBLISH_QUEUE_DEFAULT_SIZE, RING_POLICY_BLOCK);
+    PayloadSpan payload(PayloadBuffer::CopyFrom("{\"temp\":21.5}", 13));
+    std::string topic = "sensors/device-" + std::to_string(state.thread_index()) + "/temp";
+    for (auto _ : state)
+        BenchPublisher->publishTopic(topic, payload);
+    if (state.thread_index() == 0)
+    {
+        //wait till everything was taken out of the queue, so the dequeue side is part of the measurement
+        RingStats stats;
+        do
+        {
+            std::this_thread::yield();
+            BenchPublisher->getQueueStats(stats);
+        } while (stats.Depth > 0);
+        delete BenchPublisher;
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_PublishEnqueue)->ThreadRange(1, 8)->UseRealTime();
+
+//output of a script read through popen(InvokeShellCommand) and posix_spawn(RunCommand)
+static std::string OutputScript(size_t bytes)
+{
+    char path[64];
+    snprintf(path, sizeof(path), "/tmp/microbench-output-%zu.sh", bytes);
+    FILE *fp = fopen(path, "w");
+    if (fp != NULL)
+    {
+        fprintf(fp, "#!/bin/sh\nhead -c %zu /dev/zero | tr '\\0' 'a'\n", bytes);
+        fclose(fp);
+        chmod(path, 0755);
+    }
+    return path;
+}
+static void BM_InvokeShellCommand(benchmark::State &state)
+{
+    std::string script = OutputScript(state.range(0));
+    for (auto _ : state)
+    {
+        Aws::Crt::String out = InvokeShellCommand(script.c_str());
+        benchmark::DoNotOptimize(out.data());
+    }
+    state.SetBytesProcessed(state.iterations() * state.range(0));
+    unlink(script.c_str());
+}
+BENCHMARK(BM_InvokeShellCommand)->Arg(128)->Arg(64 * 1024)->Unit(benchmark::kMicrosecond);
+static void BM_RunCommand(benchmark::State &state)
+{
+    std::string script = OutputScript(state.range(0));
+    for (auto _ : state)
+    {
+        PayloadRef out = RunCommand(script.c_str());
+        benchmark::DoNotOptimize(out);
+    }
+    state.SetBytesProcessed(state.iterations() * state.range(0));
+    unlink(script.c_str());
+}
+BENCHMARK(BM_RunCommand)->Arg(128)->Arg(64 * 1024)->Unit(benchmark::kMicrosecond);
+
+//what the mqtt onMessage callback does: copy into the dispatcher queue, a worker routes it through
+//the subscription router. the subscription has no handler, so no process is involved
+static void BM_SubscriberOnMessage(benchmark::State &state)
+{
+    TopicSubscriber::SubscriptionRouter router;
+    router.addSubscription("sensors/#", "", TopicSubscriber::HandlerOptions());
+    std::atomic<uint64_t> routed(0);
+    TopicSubscriber::SubscriberDispatcher dispatcher(
+        [&](const std::string &topic, const PayloadSpan &payload) {
+            router.route(topic, payload);
+            routed.fetch_add(1, std::memory_order_relaxed);
+        },
+        1, DISPATCH_QUEUE_DEFAULT_SIZE, RING_POLICY_BLOCK);
+    const char payload[] = "{\"cmd\":\"reboot\",\"delay\":5}";
+    uint64_t sent = 0;
+    for (auto _ : state)
+    {
+        dispatcher.dispatch("sensors/device-7/cmd", (const uint8_t *)payload, sizeof(payload) - 1);
+        sent++;
+    }
+    while (routed.load(std::memory_order_relaxed) < sent)
+        std::this_thread::yield();
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_SubscriberOnMessage)->UseRealTime();
+
+//subscription lookup alone
+static void BM_TopicTrieMatch(benchmark::State &state)
+{
+    TopicTrie<int> trie;
+    for (int i = 0; i < state.range(0); i++)
+        trie.insert("sensors/device-" + std::to_string(i) + "/+", i);
+    trie.insert("sensors/#", -1);
+    const std::string topic = "sensors/device-42/temp";
+    for (auto _ : state)
+    {
+        int matches = 0;
+        trie.match(topic.data(), topic.length(), [&matches](int) { matches++; });
+        benchmark::DoNotOptimize(matches);
+    }
+}
+BENCHMARK(BM_TopicTrieMatch)->Arg(10)->Arg(10000);
+
+BENCHMARK_MAIN();
@@ -0,0 +1,166 @@
+#!/usr/bin/env python3
+"""Minimal MQTT 3.1.1 broker stand-in for benchmarking the agent without aws-iot-core.
+
+Speaks just enough of the protocol for the agent: CONNECT, PUBLISH(QoS0/1), SUBSCRIBE,
+UNSUBSCRIBE, PINGREQ and DISCONNECT over TLS with client certificates. Messages are not
+routed to subscribers, every PUBLISH is only acknowledged and counted. A payload which is a
+json object with a "ts" member(CLOCK_MONOTONIC nanoseconds, as set by run_benchmark.py) is
+used to measure the end-to-end latency.
+"""
+import argparse
+import asyncio
+import json
+import ssl
+import threading
+import time
+
+
+class BrokerStats:
+    def __init__(self):
+        self.lock = threading.Lock()
+        self.connects = 0
+        self.publishes = 0
+        self.payload_bytes = 0
+        self.latencies_ns = []
+        self.first_rx_ns = 0
+        self.last_rx_ns = 0
+
+    def record(self, payload):
+        now = time.monotonic_ns()
+        ts = None
+        if payload[:1] == b'{':
+            try:
+                ts = json.loads(payload).get("ts")
+            except ValueError:
+                pass
+        with self.lock:
+            self.publishes += 1
+            self.payload_bytes += len(payload)
+            if self.first_rx_ns == 0:
+                self.first_rx_ns = now
+            self.last_rx_ns = now
+            if isinstance(ts, int):
+                self.latencies_ns.append(now - ts)
+
+    def snapshot(self):
+        with self.lock:
+            return self.publishes, list(self.latencies_ns), self.first_rx_ns, self.last_rx_ns
+
+
+async def read_packet(reader):
+    header = await reader.readexactly(1)
+    length, shift = 0, 0
+    while True:
+        b = (await reader.readexactly(1))[0]
+        length |= (b & 0x7F) << shift
+        if not b & 0x80:
+            break
+        shift += 7
+        if shift > 21:
+            raise ValueError("malformed remaining length")
+    body = await reader.readexactly(length) if length else b''
+    return header[0], body
+
+
+async def serve_client(reader, writer, stats):
+    try:
+        ptype, body = await read_packet(reader)
+        if ptype >> 4 != 1:
+            return
+        with stats.lock:
+            stats.connects += 1
+        writer.write(b'\x20\x02\x00\x00')  # CONNACK, session not present, accepted
+        while True:
+            ptype, body = await read_packet(reader)
+            kind = ptype >> 4
+            if kind == 3:  # PUBLISH
+                qos = (ptype >> 1) & 3
+                topic_len = int.from_bytes(body[0:2], 'big')
+                pos = 2 + topic_len
+                if qos > 0:
+                    packet_id = body[pos:pos + 2]
+                    pos += 2
+                    writer.write((b'\x40\x02' if qos == 1 else b'\x50\x02') + packet_id)
+                stats.record(body[pos:])
+            elif kind == 6:  # PUBREL(qos2 is not used by the agent, completed anyway)
+                writer.write(b'\x70\x02' + body[0:2])
+            elif kind == 8:  # SUBSCRIBE
+                packet_id, pos, granted = body[0:2], 2, bytearray()
+                while pos < len(body):
+                    topic_len = int.from_bytes(body[pos:pos + 2], 'big')
+                    pos += 2 + topic_len
+                    granted.append(min(body[pos], 1))
+                    pos += 1
+                writer.write(bytes([0x90, 2 + len(granted)]) + packet_id + bytes(granted))
+            elif kind == 10:  # UNSUBSCRIBE
+                writer.write(b'\xb0\x02' + body[0:2])
+            elif kind == 12:  # PINGREQ
+                writer.write(b'\xd0\x00')
+            elif kind == 14:  # DISCONNECT
+                return
+            await writer.drain()
+    except (asyncio.IncompleteReadError, ConnectionError, ssl.SSLError, ValueError):
+        pass
+    finally:
+        writer.close()
+
+
+def make_tls_context(ca_file, cert_file, key_file):
+    ctx = ssl.create_default_context(ssl.Purpose.CLIENT_AUTH, cafile=ca_file)
+    ctx.load_cert_chain(cert_file, key_file)
+    ctx.verify_mode = ssl.CERT_REQUIRED  # same as aws-iot-core: client certificate is mandatory
+    return ctx
+
+
+class Broker:
+    """runs the broker on a background thread with its own event loop"""
+
+    def __init__(self, host, port, ca_file, cert_file, key_file):
+        self.stats = BrokerStats()
+        self.host, self.port = host, port
+        self.ctx = make_tls_context(ca_file, cert_file, key_file)
+        self.loop = asyncio.new_event_loop()
+        self.ready = threading.Event()
+        self.thread = threading.Thread(target=self._run, daemon=True)
+
+    def _run(self):
+        asyncio.set_event_loop(self.loop)
+        server = self.loop.run_until_complete(asyncio.start_server(
+            lambda r, w: serve_client(r, w, self.stats), self.host, self.port, ssl=self.ctx))
+        self.ready.set()
+        try:
+            self.loop.run_forever()
+        finally:
+            server.close()
+
+    def start(self):
+        self.thread.start()
+        self.ready.wait()
+
+    def stop(self):
+        self.loop.call_soon_threadsafe(self.loop.stop)
+        self.thread.join(timeout=5)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument("--host", default="127.0.0.1")
+    parser.add_argument("--port", type=int, default=8883)
+    parser.add_argument("--ca", required=True, help="CA which signed the client certificates")
+    parser.add_argument("--cert", required=True, help="server certificate")
+    parser.add_argument("--key", required=True, help="server private key")
+    args = parser.parse_args()
+    broker = Broker(args.host, args.port, args.ca, args.cert, args.key)
+    broker.start()
+    print("broker listening on %s:%d" % (args.host, args.port))
+    try:
+        while True:
+            time.sleep(5)
+            count, _, _, _ = broker.stats.snapshot()
+            print("publishes received: %d" % count)
+    except KeyboardInterrupt:
+        broker.stop()
+
+
+if __name__ == "__main__":
+    main()
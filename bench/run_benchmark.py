@@ -0,0 +1,252 @@
+#!/usr/bin/env python3
+"""End-to-end throughput benchmark of the agent against a local MQTT broker stand-in.
+
+Generates a throw-away test CA with server and client certificates, starts the stand-in
+broker(mqtt_standin_broker.py) and the agent connected to it, then N clients stream ndjson
+publish requests into the domain socket. Every request carries its send time, the broker
+takes the time on arrival. Reported: messages/sec, end-to-end latency percentiles, cpu time
+and memory of the agent. With --baseline the result is compared to an earlier --json-out
+and the run fails if throughput or p99 latency regressed by more than --max-regression %.
+"""
+import argparse
+import json
+import multiprocessing
+import os
+import shutil
+import signal
+import socket
+import subprocess
+import sys
+import tempfile
+import time
+
+sys.path.insert(0, os.path.dirname(os.path.abspath(__file__)))
+from mqtt_standin_broker import Broker  # noqa: E402
+
+IPC_SOCKET = "/tmp/aws-iot-demo-agent-ipc-node"  # fixed in main.cpp
+CLIENT_BATCH = 32  # ndjson lines per send() when running unthrottled
+
+
+def openssl(*args):
+    subprocess.run(["openssl"] + list(args), check=True, stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+
+
+def make_certs(workdir):
+    """test CA, server certificate for localhost and a client certificate, all valid for a day"""
+    paths = {name: os.path.join(workdir, name) for name in
+             ("ca.key", "ca.pem", "server.key", "server.pem", "client.key", "client.pem", "san.ext")}
+    if all(os.path.exists(p) for p in paths.values()):
+        return paths
+    with open(paths["san.ext"], "w") as f:
+        f.write("subjectAltName=DNS:localhost,IP:127.0.0.1\n")
+    openssl("req", "-x509", "-newkey", "rsa:2048", "-nodes", "-days", "1", "-subj", "/CN=bench-test-ca",
+            "-keyout", paths["ca.key"], "-out", paths["ca.pem"])
+    for name, cn in (("server", "localhost"), ("client", "bench-agent")):
+        csr = os.path.join(workdir, name + ".csr")
+        openssl("req", "-newkey", "rsa:2048", "-nodes", "-subj", "/CN=" + cn,
+                "-keyout", paths[name + ".key"], "-out", csr)
+        extra = ["-extfile", paths["san.ext"]] if name == "server" else []
+        openssl("x509", "-req", "-in", csr, "-CA", paths["ca.pem"], "-CAkey", paths["ca.key"], "-CAcreateserial",
+                "-days", "1", "-out", paths[name + ".pem"], *extra)
+    return paths
+
+
+def run_client(client_id, messages, payload_size, rate, start_event, result_queue):
+    """one domain-socket producer, sends messages as fast as possible or at rate msgs/sec"""
+    sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+    sock.connect(IPC_SOCKET)
+    pad = "x" * payload_size
+    interval_ns = int(1e9 / rate) if rate > 0 else 0
+    batch = 1 if rate > 0 else CLIENT_BATCH
+    start_event.wait()
+    start_ns = time.monotonic_ns()
+    next_ns = start_ns
+    seq = 0
+    while seq < messages:
+        if interval_ns:
+            delay = next_ns - time.monotonic_ns()
+            if delay > 0:
+                time.sleep(delay / 1e9)
+            next_ns += interval_ns
+        lines = []
+        for _ in range(min(batch, messages - seq)):
+            lines.append('{"topic":"bench/c%d","data":{"ts":%d,"c":%d,"seq":%d,"pad":"%s"}}\n'
+                         % (client_id, time.monotonic_ns(), client_id, seq, pad))
+            seq += 1
+        sock.sendall("".join(lines).encode())
+    sock.close()
+    result_queue.put((client_id, start_ns, time.monotonic_ns()))
+
+
+def proc_stats(pid):
+    """cpu seconds(user+system) and memory(kB) of a process"""
+    with open("/proc/%d/stat" % pid) as f:
+        fields = f.read().rsplit(")", 1)[1].split()
+    ticks = os.sysconf("SC_CLK_TCK")
+    cpu = (int(fields[11]) + int(fields[12])) / ticks
+    mem = {}
+    with open("/proc/%d/status" % pid) as f:
+        for line in f:
+            if line.startswith(("VmRSS:", "VmHWM:")):
+                mem[line.split(":")[0]] = int(line.split()[1])
+    return cpu, mem.get("VmRSS", 0), mem.get("VmHWM", 0)
+
+
+def read_metrics(path):
+    try:
+        sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        sock.settimeout(2)
+        sock.connect(path)
+        sock.sendall(b"json\n")
+        data = b""
+        while True:
+            chunk = sock.recv(65536)
+            if not chunk:
+                break
+            data += chunk
+        return json.loads(data)
+    except (OSError, ValueError):
+        return None
+
+
+def percentile(sorted_values, p):
+    if not sorted_values:
+        return 0
+    index = min(len(sorted_values) - 1, int(len(sorted_values) * p / 100.0))
+    return sorted_values[index]
+
+
+def wait_for(predicate, timeout):
+    deadline = time.monotonic() + timeout
+    while time.monotonic() < deadline:
+        if predicate():
+            return True
+        time.sleep(0.05)
+    return False
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--agent", required=True, help="path of the aws-iot-pubsub-agent binary")
+    parser.add_argument("--clients", type=int, default=4, help="concurrent domain-socket clients")
+    parser.add_argument("--messages", type=int, default=20000, help="messages per client")
+    parser.add_argument("--payload-size", type=int, default=64, help="bytes of padding per message")
+    parser.add_argument("--rate", type=float, default=0, help="messages/sec per client, 0=unthrottled")
+    parser.add_argument("--port", type=int, default=18883, help="tcp port of the broker stand-in")
+    parser.add_argument("--workdir", help="directory for certificates and logs(default: a temporary one)")
+    parser.add_argument("--agent-args", default="", help="additional agent options, e.g \"--pub_qos 0\"")
+    parser.add_argument("--timeout", type=float, default=60, help="max seconds without progress")
+    parser.add_argument("--json-out", help="write the results to this file")
+    parser.add_argument("--baseline", help="results of an earlier run(--json-out) to compare against")
+    parser.add_argument("--max-regression", type=float, default=10, help="allowed regression in percent")
+    args = parser.parse_args()
+
+    if os.path.exists(IPC_SOCKET):
+        probe = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        busy = probe.connect_ex(IPC_SOCKET) == 0
+        probe.close()
+        if busy:
+            print("another agent is serving %s, stop it first" % IPC_SOCKET)
+            return 2
+        os.unlink(IPC_SOCKET)  # stale, the agent signals readiness by creating it
+    workdir = args.workdir or tempfile.mkdtemp(prefix="agent-bench-")
+    os.makedirs(workdir, exist_ok=True)
+    certs = make_certs(workdir)
+    metrics_socket = os.path.join(workdir, "metrics.sock")
+
+    broker = Broker("127.0.0.1", args.port, certs["ca.pem"], certs["server.pem"], certs["server.key"])
+    broker.start()
+
+    agent_log = open(os.path.join(workdir, "agent.log"), "w")
+    agent_cmd = [args.agent, "--endpoint", "localhost", "--port_override", str(args.port),
+                 "--ca_file", certs["ca.pem"], "--cert", certs["client.pem"], "--key", certs["client.key"],
+                 "--client_id", "bench-agent", "--count", "0", "--metrics_socket", metrics_socket] + args.agent_args.split()
+    agent = subprocess.Popen(agent_cmd, stdout=agent_log, stderr=subprocess.STDOUT)
+    result = {}
+    try:
+        # the agent is ready once it is connected to the broker and serves the domain socket
+        if not wait_for(lambda: broker.stats.connects > 0 and os.path.exists(IPC_SOCKET), 20) or agent.poll() is not None:
+            print("agent did not connect, see %s" % agent_log.name)
+            return 2
+        time.sleep(0.5)
+
+        total = args.clients * args.messages
+        start_event = multiprocessing.Event()
+        results = multiprocessing.Queue()
+        clients = [multiprocessing.Process(target=run_client, args=(i, args.messages, args.payload_size, args.rate,
+                                                                    start_event, results))
+                   for i in range(args.clients)]
+        for c in clients:
+            c.start()
+        time.sleep(0.2)  # clients are connected and waiting
+        cpu_start, _, _ = proc_stats(agent.pid)
+        start_event.set()
+
+        # done when everything arrived, or when nothing arrived for --timeout seconds
+        received, last_progress = 0, time.monotonic()
+        while received < total and time.monotonic() - last_progress < args.timeout:
+            time.sleep(0.1)
+            count = broker.stats.snapshot()[0]
+            if count > received:
+                received, last_progress = count, time.monotonic()
+        cpu_end, rss_kb, hwm_kb = proc_stats(agent.pid)
+        for c in clients:
+            c.join(timeout=5)
+        starts = [results.get(timeout=5)[1] for _ in clients]
+
+        count, latencies, _, last_rx_ns = broker.stats.snapshot()
+        latencies.sort()
+        elapsed = (last_rx_ns - min(starts)) / 1e9 if count else 0
+        result = {
+            "clients": args.clients,
+            "messages": total,
+            "received": count,
+            "elapsed_s": round(elapsed, 3),
+            "msgs_per_sec": round(count / elapsed, 1) if elapsed > 0 else 0,
+            "latency_p50_us": percentile(latencies, 50) // 1000,
+            "latency_p99_us": percentile(latencies, 99) // 1000,
+            "latency_p999_us": percentile(latencies, 99.9) // 1000,
+            "latency_max_us": (latencies[-1] // 1000) if latencies else 0,
+            "agent_cpu_s": round(cpu_end - cpu_start, 3),
+            "agent_cpu_percent": round(100 * (cpu_end - cpu_start) / elapsed, 1) if elapsed > 0 else 0,
+            "agent_rss_kb": rss_kb,
+            "agent_rss_peak_kb": hwm_kb,
+            "agent_metrics": read_metrics(metrics_socket),
+        }
+    finally:
+        agent.send_signal(signal.SIGTERM)
+        try:
+            agent.wait(timeout=5)
+        except subprocess.TimeoutExpired:
+            agent.kill()
+        broker.stop()
+        agent_log.close()
+
+    print("messages      : %d of %d received in %.3f s" % (result["received"], result["messages"], result["elapsed_s"]))
+    print("throughput    : %.1f msgs/sec" % result["msgs_per_sec"])
+    print("latency       : p50 %d us, p99 %d us, p99.9 %d us, max %d us" % (
+        result["latency_p50_us"], result["latency_p99_us"], result["latency_p999_us"], result["latency_max_us"]))
+    print("agent         : cpu %.3f s(%.1f%%), rss %d kB, peak rss %d kB" % (
+        result["agent_cpu_s"], result["agent_cpu_percent"], result["agent_rss_kb"], result["agent_rss_peak_kb"]))
+    if args.json_out:
+        with open(args.json_out, "w") as f:
+            json.dump(result, f, indent=2)
+    if not args.workdir:
+        shutil.rmtree(workdir, ignore_errors=True)
+
+    ret = 0 if result["received"] == result["messages"] else 1
+    if args.baseline:
+        with open(args.baseline) as f:
+            base = json.load(f)
+        limit = 1 + args.max_regression / 100.0
+        if result["msgs_per_sec"] * limit < base["msgs_per_sec"]:
+            print("REGRESSION: throughput %.1f < baseline %.1f" % (result["msgs_per_sec"], base["msgs_per_sec"]))
+            ret = 1
+        if result["latency_p99_us"] > base["latency_p99_us"] * limit:
+            print("REGRESSION: p99 latency %d us > baseline %d us" % (result["latency_p99_us"], base["latency_p99_us"]))
+            ret = 1
+    return ret
+
+
+if __name__ == "__main__":
+    sys.exit(main())
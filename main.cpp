@@ -13,20 +13,43 @@
 #include <mutex>
 #include <thread>
 #include <sys/stat.h>
-#include <fstream>
 //#include <aws/common/CommandLineUtils.h>
 #include "CommandLineUtils.h"
 #include "LinuxDomainSocketSrv.h"
 #include "Publisher.h"
+#include "ProcessUtils.h"
+#include "SubscriberHandler.h"
+#include "SubscriberDispatcher.h"
+#include "SubscriptionRouter.h"
+#include "PublishSource.h"
+#include "PublishScheduler.h"
+#include "PayloadCodec.h"
+#include "SpoolLog.h"
+#include "MetricsServer.h"
+#include "ShmRingSrv.h"
+#include <signal.h>
 static const char* linuxDomainSockPath = "/tmp/aws-iot-demo-agent-ipc-node";
 using namespace Aws::Crt;
 
 //custom extensions to sample program
-#define MAX_PAYLOAD_SIZE 4096 //lets limit the message size to 4kb
-#define SUBSCRIBER_DATA_FILE "/tmp/subscriber-data-file.txt"
 #define INIT_ACCESSORY_FILE_PATH "/usr/sbin/init-accessories.sh"
-String InvokeShellCommand(const char* command);
-bool IsValidFile(const char* filepath);
+
+//"a,b,c" -> {"a","b","c"}, empty items are skipped
+static std::vector<std::string> SplitList(const std::string &list, char sep)
+{
+    std::vector<std::string> items;
+    size_t pos = 0;
+    while (pos <= list.length())
+    {
+        size_t end = list.find(sep, pos);
+        if (end == std::string::npos)
+            end = list.length();
+        if (end > pos)
+            items.push_back(list.substr(pos, end - pos));
+        pos = end + 1;
+    }
+    return items;
+}
 
 int main(int argc, char *argv[])
 {
@@ -37,7 +60,7 @@ int main(int argc, char *argv[])
      */
     ApiHandle apiHandle;
     uint32_t messageCount = 10;
-    uint32_t intervalSec = 1;
+    uint32_t intervalMs = 1000;
     /*********************** Parse Arguments ***************************/
     Utils::CommandLineUtils cmdUtils = Utils::CommandLineUtils();
     cmdUtils.RegisterProgramName("basic_pub_sub");
@@ -50,8 +73,43 @@ int main(int argc, char *argv[])
     cmdUtils.RegisterCommand("count", "<int>", "The number of messages to send (optional, default='10')");
     cmdUtils.RegisterCommand("port_override", "<int>", "The port override to use when connecting (optional)");
     cmdUtils.RegisterCommand("pub_interval", "<int>", "Specify wait time(in seconds) between two publish messages (optional, default=1)");
+    cmdUtils.RegisterCommand("pub_interval_ms", "<int>", "Specify wait time(in milliseconds) between two publish messages, overrides pub_interval (optional)");
+    cmdUtils.RegisterCommand("pub_jobs", "<path>", "File with additional periodic publish jobs, one per line: <topic> <interval_ms> <count> <message> (optional)");
+    cmdUtils.RegisterCommand("message_mode", "<str>", "If message is a script: oneshot: run it for every publish, resident: keep it running and read one line per publish (optional, default=oneshot)");
     cmdUtils.RegisterCommand("subtopic", "<str>", "subscribe to a topic(optional, default=test/topic)");
     cmdUtils.RegisterCommand("subtopic_handler", "<str>", "a handler script to take action when message arrives");
+    cmdUtils.RegisterCommand("subscriptions", "<path>", "File with additional subscriptions, one per line: <filter> [handler] [mode=..] [workers=..] [framing=..] (optional)");
+    cmdUtils.RegisterCommand("subtopic_handler_mode", "<str>", "oneshot: run handler per message, stream: keep handler running and write messages to its stdin (optional, default=oneshot)");
+    cmdUtils.RegisterCommand("subtopic_handler_workers", "<int>", "Number of handler processes in stream mode (optional, default=1)");
+    cmdUtils.RegisterCommand("subtopic_handler_framing", "<str>", "Message framing on handler stdin in stream mode: ndjson|length (optional, default=ndjson)");
+    cmdUtils.RegisterCommand("sub_dispatch_workers", "<int>", "Number of threads running the subtopic handler (optional, default=1, more than 1 does not keep message order)");
+    cmdUtils.RegisterCommand("sub_queue_size", "<int>", "Max number of received messages waiting for the handler (optional, default=256)");
+    cmdUtils.RegisterCommand("sub_queue_policy", "<str>", "What to do when handler queue is full: block|drop-oldest|reject (optional, default=drop-oldest)");
+    cmdUtils.RegisterCommand("pub_queue_size", "<int>", "Max number of pending publish messages (optional, default=1024)");
+    cmdUtils.RegisterCommand("pub_queue_policy", "<str>", "What to do when publish queue is full: block|drop-oldest|reject (optional, default=block)");
+    cmdUtils.RegisterCommand("pub_qos", "<int>", "QoS of published topics without a topic policy: 0|1 (optional, default=1)");
+    cmdUtils.RegisterCommand("pub_topic_policy", "<str>", "Comma separated <topic filter>=<0|1>[:retain] list of per topic QoS/retain (optional)");
+    cmdUtils.RegisterCommand("sub_qos", "<int>", "QoS of subscriptions, qos= in the subscriptions file overrides it: 0|1 (optional, default=1)");
+    cmdUtils.RegisterCommand("pub_max_inflight", "<int>", "Max number of publishes waiting for PUBACK per connection, queue is not drained beyond (optional, default=100, 0=unlimited)");
+    cmdUtils.RegisterCommand("pub_connections", "<int>", "MQTT connections used for publishing, connection N>0 uses client id <client_id>-N (optional, default=1, max=16)");
+    cmdUtils.RegisterCommand("pub_aggregate_count", "<int>", "Publish records of aggregated topics as one json array of up to N records (optional, default=off)");
+    cmdUtils.RegisterCommand("pub_aggregate_ms", "<int>", "Max time(in milliseconds) a record waits for aggregation (optional, default=200)");
+    cmdUtils.RegisterCommand("pub_aggregate_topics", "<str>", "Comma separated topic filters which are aggregated (optional, default=#)");
+    cmdUtils.RegisterCommand("pub_compress", "<str>", "Comma separated <topic filter>=<deflate|zstd>[:<dict id>] list of compressed topics (optional, default=off)");
+    cmdUtils.RegisterCommand("compress_level", "<int>", "Compression level 1-22, deflate uses at most 9 (optional, default=3)");
+    cmdUtils.RegisterCommand("compress_min_size", "<int>", "Payloads smaller than this are not compressed (optional, default=64)");
+    cmdUtils.RegisterCommand("compress_dicts", "<str>", "Comma separated <id>:<path> list of compression dictionaries, id 1..255 (optional)");
+    cmdUtils.RegisterCommand("sub_decompress", "<int>", "1: decompress marked incoming payloads before the handler runs (optional, default=0)");
+    cmdUtils.RegisterCommand("spool_dir", "<path>", "Store publish messages in this directory and send them again after a reconnect or restart (optional, default=off)");
+    cmdUtils.RegisterCommand("spool_max_size", "<int>", "Max disk space(in MB) used by the spool, oldest messages are dropped beyond (optional, default=16)");
+    cmdUtils.RegisterCommand("spool_sync_ms", "<int>", "Max time(in milliseconds) till stored messages are synced to disk (optional, default=100)");
+    cmdUtils.RegisterCommand("stats_interval", "<int>", "Print statistics every N seconds (optional, default=0=off)");
+    cmdUtils.RegisterCommand("metrics_socket", "<path>", "Unix socket serving metrics as prometheus text or json (optional, default=<ipc socket>-metrics)");
+    cmdUtils.RegisterCommand("shm_dir", "<path>", "Directory for shared-memory rings of local producers, e.g /dev/shm/aws-iot-pubsub-agent (optional, default=off)");
+    cmdUtils.RegisterCommand("ipc_framing", "<str>", "Message framing on the domain socket, auto detects it per connection: auto|ndjson|length (optional, default=auto)");
+    cmdUtils.RegisterCommand("ipc_dgram_socket", "<path>", "Additional SOCK_DGRAM socket, one publish message per datagram (optional, default=off)");
+    cmdUtils.RegisterCommand("ipc_ack", "<str>", "Acks sent for domain socket requests with an \"id\": accepted|delivered|all|none (optional, default=all)");
+    cmdUtils.RegisterCommand("ipc_client_credit", "<int>", "Max messages of one domain socket client queued or in flight, the client is not read beyond (optional, default=256, 0=unlimited)");
 
     cmdUtils.AddLoggingCommands();
     const char **const_argv = (const char **)argv;
@@ -73,12 +131,310 @@ int main(int argc, char *argv[])
         }
     }
 
-    if (cmdUtils.HasCommand("pub_interval"))
+    if (cmdUtils.HasCommand("pub_interval_ms"))
+    {
+        int interval = atoi(cmdUtils.GetCommand("pub_interval_ms").c_str());
+        if (interval > 0)
+        {
+            intervalMs = interval;
+        }
+    }
+    else if (cmdUtils.HasCommand("pub_interval"))
     {
         int interval = atoi(cmdUtils.GetCommand("pub_interval").c_str());
         if (interval > 0)
         {
-            intervalSec = interval;
+            intervalMs = 1000 * interval;
+        }
+    }
+
+    size_t pubQueueSize = PUBLISH_QUEUE_DEFAULT_SIZE;
+    if (cmdUtils.HasCommand("pub_queue_size"))
+    {
+        int size = atoi(cmdUtils.GetCommand("pub_queue_size").c_str());
+        if (size > 0)
+        {
+            pubQueueSize = size;
+        }
+    }
+    RING_POLICY pubQueuePolicy = RING_POLICY_BLOCK;
+    if (cmdUtils.HasCommand("pub_queue_policy"))
+    {
+        pubQueuePolicy = RingPolicyFromString(cmdUtils.GetCommand("pub_queue_policy").c_str());
+        if (pubQueuePolicy == RING_POLICY_NONE)
+        {
+            fprintf(stdout, "invalid pub_queue_policy, using block\n");
+            pubQueuePolicy = RING_POLICY_BLOCK;
+        }
+    }
+
+    TopicPolicy pubDefaultPolicy;
+    if (cmdUtils.HasCommand("pub_qos"))
+    {
+        int qos = atoi(cmdUtils.GetCommand("pub_qos").c_str());
+        if (qos == 0 || qos == 1)
+        {
+            pubDefaultPolicy.Qos = qos;
+        }
+        else
+        {
+            fprintf(stdout, "invalid pub_qos, using 1\n");
+        }
+    }
+    std::vector<std::pair<std::string, TopicPolicy>> pubTopicPolicies;
+    for (const std::string &item : SplitList(cmdUtils.GetCommandOrDefault("pub_topic_policy", "").c_str(), ','))
+    {
+        //<filter>=<qos>[:retain]
+        size_t eq = item.rfind('=');
+        std::string value = (eq == std::string::npos) ? "" : item.substr(eq + 1);
+        if (value != "0" && value != "1" && value != "0:retain" && value != "1:retain")
+        {
+            fprintf(stdout, "invalid pub_topic_policy entry %s\n", item.c_str());
+            exit(-1);
+        }
+        pubTopicPolicies.push_back(std::make_pair(item.substr(0, eq), TopicPolicy(value[0] - '0', value.length() > 1)));
+    }
+    int subQos = 1;
+    if (cmdUtils.HasCommand("sub_qos"))
+    {
+        subQos = atoi(cmdUtils.GetCommand("sub_qos").c_str());
+        if (subQos != 0 && subQos != 1)
+        {
+            fprintf(stdout, "invalid sub_qos, using 1\n");
+            subQos = 1;
+        }
+    }
+
+    size_t pubMaxInFlight = PUBLISH_INFLIGHT_DEFAULT_WINDOW;
+    if (cmdUtils.HasCommand("pub_max_inflight"))
+    {
+        int window = atoi(cmdUtils.GetCommand("pub_max_inflight").c_str());
+        if (window >= 0)
+        {
+            pubMaxInFlight = window;
+        }
+    }
+    size_t pubConnections = 1;
+    if (cmdUtils.HasCommand("pub_connections"))
+    {
+        int count = atoi(cmdUtils.GetCommand("pub_connections").c_str());
+        if (count > 0 && count <= PUBLISH_MAX_CONNECTIONS)
+        {
+            pubConnections = count;
+        }
+        else
+        {
+            fprintf(stdout, "invalid pub_connections, using 1\n");
+        }
+    }
+
+    //aggregation is enabled by either of count or time window
+    AggregatePolicy aggregatePolicy;
+    if (cmdUtils.HasCommand("pub_aggregate_count") || cmdUtils.HasCommand("pub_aggregate_ms"))
+    {
+        aggregatePolicy.MaxRecords = PUBLISH_AGGREGATE_DEFAULT_RECORDS;
+        if (cmdUtils.HasCommand("pub_aggregate_count"))
+        {
+            int count = atoi(cmdUtils.GetCommand("pub_aggregate_count").c_str());
+            if (count > 0)
+            {
+                aggregatePolicy.MaxRecords = count;
+            }
+        }
+        if (cmdUtils.HasCommand("pub_aggregate_ms"))
+        {
+            int window = atoi(cmdUtils.GetCommand("pub_aggregate_ms").c_str());
+            if (window > 0)
+            {
+                aggregatePolicy.WindowMs = window;
+            }
+        }
+    }
+    std::vector<std::string> aggregateTopics = SplitList(cmdUtils.GetCommandOrDefault("pub_aggregate_topics", "#").c_str(), ',');
+
+    //compression: dictionaries first, topics refer to them by id
+    PayloadCodec payloadCodec;
+    if (cmdUtils.HasCommand("compress_level"))
+    {
+        String level = cmdUtils.GetCommand("compress_level");
+        char *end = NULL;
+        long value = strtol(level.c_str(), &end, 10);
+        if (level.empty() || *end != '\0' || value < CODEC_MIN_LEVEL || value > CODEC_MAX_LEVEL || payloadCodec.setLevel((int)value) != 0)
+        {
+            fprintf(stdout, "invalid compress_level %s, has to be %d-%d\n", level.c_str(), CODEC_MIN_LEVEL, CODEC_MAX_LEVEL);
+            exit(-1);
+        }
+    }
+    if (cmdUtils.HasCommand("compress_min_size"))
+    {
+        payloadCodec.setMinSize(atoi(cmdUtils.GetCommand("compress_min_size").c_str()));
+    }
+    for (const std::string &item : SplitList(cmdUtils.GetCommandOrDefault("compress_dicts", "").c_str(), ','))
+    {
+        size_t colon = item.find(':');
+        if (colon == std::string::npos || payloadCodec.loadDictionary(atoi(item.c_str()), item.substr(colon + 1).c_str()) != 0)
+        {
+            fprintf(stdout, "invalid compress_dicts entry %s\n", item.c_str());
+            exit(-1);
+        }
+    }
+    for (const std::string &item : SplitList(cmdUtils.GetCommandOrDefault("pub_compress", "").c_str(), ','))
+    {
+        //<filter>=<algo>[:<dict id>]
+        size_t eq = item.rfind('=');
+        size_t colon = item.find(':', eq == std::string::npos ? 0 : eq);
+        std::string algo = (eq == std::string::npos) ? "" : item.substr(eq + 1, colon == std::string::npos ? std::string::npos : colon - eq - 1);
+        int dictId = (colon == std::string::npos) ? 0 : atoi(item.c_str() + colon + 1);
+        if (eq == std::string::npos || payloadCodec.addTopic(item.substr(0, eq), compress_algo_from_string(algo.c_str()), dictId) != 0)
+        {
+            fprintf(stdout, "invalid pub_compress entry %s\n", item.c_str());
+            exit(-1);
+        }
+    }
+    bool subDecompress = false;
+    if (cmdUtils.HasCommand("sub_decompress"))
+    {
+        subDecompress = atoi(cmdUtils.GetCommand("sub_decompress").c_str()) != 0;
+    }
+    //store-and-forward spool on disk
+    TopicPublisher::SpoolLog spoolLog;
+    bool spoolEnabled = false;
+    if (cmdUtils.HasCommand("spool_dir"))
+    {
+        size_t spoolMaxSize = SPOOL_DEFAULT_MAX_SIZE;
+        unsigned int spoolSyncMs = SPOOL_DEFAULT_SYNC_MS;
+        if (cmdUtils.HasCommand("spool_max_size"))
+        {
+            int size = atoi(cmdUtils.GetCommand("spool_max_size").c_str());
+            if (size > 0)
+            {
+                spoolMaxSize = (size_t)size * 1024 * 1024;
+            }
+        }
+        if (cmdUtils.HasCommand("spool_sync_ms"))
+        {
+            int ms = atoi(cmdUtils.GetCommand("spool_sync_ms").c_str());
+            if (ms > 0)
+            {
+                spoolSyncMs = ms;
+            }
+        }
+        if (spoolLog.open(cmdUtils.GetCommand("spool_dir").c_str(), spoolMaxSize, SPOOL_DEFAULT_SEGMENT_SIZE, spoolSyncMs) != 0)
+        {
+            exit(-1);
+        }
+        spoolEnabled = true;
+    }
+    uint32_t statsIntervalMs = 0;
+    if (cmdUtils.HasCommand("stats_interval"))
+    {
+        int interval = atoi(cmdUtils.GetCommand("stats_interval").c_str());
+        if (interval > 0)
+        {
+            statsIntervalMs = 1000 * interval;
+        }
+    }
+
+    IPC_FRAMING ipcFraming = IPC_FRAMING_AUTO;
+    if (cmdUtils.HasCommand("ipc_framing"))
+    {
+        ipcFraming = ipc_framing_from_string(cmdUtils.GetCommand("ipc_framing").c_str());
+        if (ipcFraming == IPC_FRAMING_NONE)
+        {
+            fprintf(stdout, "invalid ipc_framing, using auto\n");
+            ipcFraming = IPC_FRAMING_AUTO;
+        }
+    }
+
+    int ipcAckStages = IPC_ACK_ALL;
+    if (cmdUtils.HasCommand("ipc_ack"))
+    {
+        String stages = cmdUtils.GetCommand("ipc_ack");
+        ipcAckStages = ipc_ack_stages_from_string(stages.c_str(), stages.length());
+        if (ipcAckStages < 0)
+        {
+            fprintf(stdout, "invalid ipc_ack, using all\n");
+            ipcAckStages = IPC_ACK_ALL;
+        }
+    }
+
+    size_t ipcClientCredit = IPC_CLIENT_CREDIT_DEFAULT;
+    if (cmdUtils.HasCommand("ipc_client_credit"))
+    {
+        int credit = atoi(cmdUtils.GetCommand("ipc_client_credit").c_str());
+        if (credit >= 0)
+        {
+            ipcClientCredit = credit;
+        }
+    }
+
+    HANDLER_MODE handlerMode = HANDLER_MODE_ONESHOT;
+    if (cmdUtils.HasCommand("subtopic_handler_mode"))
+    {
+        handlerMode = handler_mode_from_string(cmdUtils.GetCommand("subtopic_handler_mode").c_str());
+        if (handlerMode == HANDLER_MODE_NONE)
+        {
+            fprintf(stdout, "invalid subtopic_handler_mode, using oneshot\n");
+            handlerMode = HANDLER_MODE_ONESHOT;
+        }
+    }
+    int handlerWorkers = 1;
+    if (cmdUtils.HasCommand("subtopic_handler_workers"))
+    {
+        int workers = atoi(cmdUtils.GetCommand("subtopic_handler_workers").c_str());
+        if (workers > 0)
+        {
+            handlerWorkers = workers;
+        }
+    }
+    IPC_FRAMING handlerFraming = IPC_FRAMING_NDJSON;
+    if (cmdUtils.HasCommand("subtopic_handler_framing"))
+    {
+        handlerFraming = ipc_framing_from_string(cmdUtils.GetCommand("subtopic_handler_framing").c_str());
+        if (handlerFraming != IPC_FRAMING_NDJSON && handlerFraming != IPC_FRAMING_LENGTH_PREFIX)
+        {
+            fprintf(stdout, "invalid subtopic_handler_framing, using ndjson\n");
+            handlerFraming = IPC_FRAMING_NDJSON;
+        }
+    }
+
+    int dispatchWorkers = 1;
+    if (cmdUtils.HasCommand("sub_dispatch_workers"))
+    {
+        int workers = atoi(cmdUtils.GetCommand("sub_dispatch_workers").c_str());
+        if (workers > 0)
+        {
+            dispatchWorkers = workers;
+        }
+    }
+    size_t dispatchQueueSize = DISPATCH_QUEUE_DEFAULT_SIZE;
+    if (cmdUtils.HasCommand("sub_queue_size"))
+    {
+        int size = atoi(cmdUtils.GetCommand("sub_queue_size").c_str());
+        if (size > 0)
+        {
+            dispatchQueueSize = size;
+        }
+    }
+    RING_POLICY dispatchQueuePolicy = RING_POLICY_DROP_OLDEST;
+    if (cmdUtils.HasCommand("sub_queue_policy"))
+    {
+        dispatchQueuePolicy = RingPolicyFromString(cmdUtils.GetCommand("sub_queue_policy").c_str());
+        if (dispatchQueuePolicy == RING_POLICY_NONE)
+        {
+            fprintf(stdout, "invalid sub_queue_policy, using drop-oldest\n");
+            dispatchQueuePolicy = RING_POLICY_DROP_OLDEST;
+        }
+    }
+
+    SOURCE_MODE sourceMode = SOURCE_MODE_ONESHOT;
+    if (cmdUtils.HasCommand("message_mode"))
+    {
+        sourceMode = source_mode_from_string(cmdUtils.GetCommand("message_mode").c_str());
+        if (sourceMode == SOURCE_MODE_NONE)
+        {
+            fprintf(stdout, "invalid message_mode, using oneshot\n");
+            sourceMode = SOURCE_MODE_ONESHOT;
         }
     }
 
@@ -116,11 +472,85 @@ int main(int argc, char *argv[])
         exit(-1);
     }
 
+    signal(SIGPIPE, SIG_IGN);//a handler or ipc client which went away must not kill the agent
+
+    //all subscriptions(--subtopic and --subscriptions file) share one router, the handlers of matching
+    //filters run on the dispatcher worker threads. stream mode starts the handler processes right away
+    TopicSubscriber::HandlerOptions handlerOptions;
+    handlerOptions.Mode = handlerMode;
+    handlerOptions.Framing = handlerFraming;
+    handlerOptions.Workers = handlerWorkers;
+    handlerOptions.Qos = subQos;
+    TopicSubscriber::SubscriptionRouter subscriptionRouter;
+    //check if subscribe topic handler binary exists
+    subscriptionRouter.addSubscription(subtopic.c_str(), IsValidFile(subTopicHandler.c_str()) ? subTopicHandler.c_str() : "", handlerOptions);
+    if (cmdUtils.HasCommand("subscriptions"))
+        subscriptionRouter.loadFile(cmdUtils.GetCommand("subscriptions").c_str(), handlerOptions);
+    auto onDispatch = [&subscriptionRouter, &payloadCodec, subDecompress](const std::string &topic, const PayloadSpan &payload) {
+        //payload is passed to handlers as it is(binary safe, any size), compressed ones are restored first
+        PayloadSpan data = payload;
+        if (subDecompress && payloadCodec.decompress(data) < 0)
+        {
+            fprintf(stdout, "dropping message on %s, unable to decompress\n", topic.c_str());
+            return;
+        }
+        subscriptionRouter.route(topic, data);
+    };
+    TopicSubscriber::SubscriberDispatcher subscriberDispatcher(onDispatch, dispatchWorkers, dispatchQueueSize, dispatchQueuePolicy);
+
     /* Get a MQTT client connection from the command parser */
     auto connection = cmdUtils.BuildMQTTConnection();
-    TopicPublisher::Publisher publisher(connection);//this will start a monoshot thread
+    TopicPublisher::Publisher publisher(connection,pubQueueSize,pubQueuePolicy);//this will start a monoshot thread
+    //more connections only publish(aws-iot-core limits the publish rate per connection), topics are
+    //spread over all of them by hash, subscriptions stay on the first one
+    std::vector<std::shared_ptr<Mqtt::MqttConnection>> pubConnectionPool;
+    for (size_t i = 1; i < pubConnections; i++)
+    {
+        pubConnectionPool.push_back(cmdUtils.BuildMQTTConnection());
+        publisher.addConnection(pubConnectionPool.back());
+    }
+    if (publisher.setAggregation(aggregatePolicy, aggregateTopics) != 0)
+    {
+        exit(-1);
+    }
+    publisher.setInFlightWindow(pubMaxInFlight);
+    publisher.setDefaultPolicy(pubDefaultPolicy);
+    for (const auto &policy : pubTopicPolicies)
+    {
+        if (publisher.setTopicPolicy(policy.first, policy.second) != 0)
+        {
+            exit(-1);
+        }
+    }
+    if (payloadCodec.enabled())
+    {
+        publisher.setCodec(&payloadCodec);
+    }
+    if (spoolEnabled)
+    {
+        publisher.setSpool(&spoolLog);
+    }
     //start linux-domain-socket server
-    DomainSock::LinuxDomainSocketSrv DomainSocket(linuxDomainSockPath,&publisher);
+    String ipcDgramSockPath = cmdUtils.GetCommandOrDefault("ipc_dgram_socket", "");
+    DomainSock::LinuxDomainSocketSrv DomainSocket(linuxDomainSockPath,&publisher,ipcFraming,
+                                                  ipcDgramSockPath.empty() ? NULL : ipcDgramSockPath.c_str());
+    DomainSocket.setAckStages(ipcAckStages);
+    //all clients together never hold more than the publisher can queue and keep in flight(also without
+    //a per-client credit), an unlimited in-flight window has no such bound
+    DomainSocket.setCredit(ipcClientCredit, pubMaxInFlight ? pubQueueSize + pubConnections * (pubMaxInFlight + PUBLISH_BACKLOG_MAX) : 0);
+    //high-rate producers may publish through shared-memory rings instead
+    std::unique_ptr<ShmIpc::ShmRingSrv> shmServer;
+    if (cmdUtils.HasCommand("shm_dir"))
+    {
+        shmServer.reset(new ShmIpc::ShmRingSrv(cmdUtils.GetCommand("shm_dir").c_str(), &publisher));
+        if (shmServer->Start() != 0)
+        {
+            exit(-1);
+        }
+    }
+    //metrics of all components are served on a second socket next to it
+    String metricsSockPath = cmdUtils.GetCommandOrDefault("metrics_socket", String(linuxDomainSockPath) + METRICS_SOCKET_SUFFIX);
+    Metrics::MetricsServer metricsServer(metricsSockPath.c_str());
 
     /*
      * In a real world application you probably don't want to enforce synchronous behavior
@@ -141,15 +571,20 @@ int main(int argc, char *argv[])
         else
         {
             fprintf(stdout, "Connection completed with return code %d\n", returnCode);
+            publisher.setOnline(true);//sends what is left in the spool of a previous run
             connectionCompletedPromise.set_value(true);
         }
     };
 
     auto onInterrupted = [&](Mqtt::MqttConnection &, int error) {
         fprintf(stdout, "Connection interrupted with error %s\n", ErrorDebugString(error));
+        publisher.setOnline(false);//with a spool, messages are only stored till the connection is back
     };
 
-    auto onResumed = [&](Mqtt::MqttConnection &, Mqtt::ReturnCode, bool) { fprintf(stdout, "Connection resumed\n"); };
+    auto onResumed = [&](Mqtt::MqttConnection &, Mqtt::ReturnCode, bool) {
+        fprintf(stdout, "Connection resumed\n");
+        publisher.setOnline(true);//stored messages are sent in order before newer ones
+    };
 
     /*
      * Invoked when a disconnect message has completed.
@@ -161,10 +596,40 @@ int main(int argc, char *argv[])
         }
     };
 
+    std::mutex receiveMutex;
+    std::condition_variable receiveSignal;
+    uint32_t receivedCount = 0;
+
+    /*
+     * This is invoked upon the receipt of a Publish on any subscribed topic(once per message, even
+     * if more than one filter matches), routing to the handlers is done by subscriptionRouter.
+     */
+    auto onMessage = [&](Mqtt::MqttConnection &,
+                         const String &topic,
+                         const ByteBuf &byteBuf,
+                         bool /*dup*/,
+                         Mqtt::QOS /*qos*/,
+                         bool /*retain*/) {
+        {
+            std::lock_guard<std::mutex> lock(receiveMutex);
+            ++receivedCount;
+            //fprintf(stdout, "Publish #%d received on topic %s\n", receivedCount, topic.c_str());
+            //fprintf(stdout, "Message: ");
+            //fwrite(byteBuf.buffer, 1, byteBuf.len, stdout);
+            //fprintf(stdout, "\n");
+        }
+
+        //handlers run on a dispatcher worker thread, this thread only queues a copy of the payload
+        subscriberDispatcher.dispatch(topic.c_str(), byteBuf.buffer, byteBuf.len);
+
+        receiveSignal.notify_all();
+    };
+
     connection->OnConnectionCompleted = std::move(onConnectionCompleted);
     connection->OnDisconnect = std::move(onDisconnect);
     connection->OnConnectionInterrupted = std::move(onInterrupted);
     connection->OnConnectionResumed = std::move(onResumed);
+    connection->SetOnMessageHandler(std::move(onMessage));//has to be set before connecting
 
     /*
      * Actually perform the connect dance.
@@ -176,116 +641,155 @@ int main(int argc, char *argv[])
         exit(-1);
     }
 
-    if (connectionCompletedPromise.get_future().get())
+    //the other connections of the pool, each with its own client id
+    std::vector<std::promise<bool>> poolCompletedPromises(pubConnectionPool.size());
+    for (size_t i = 0; i < pubConnectionPool.size(); i++)
     {
-        std::mutex receiveMutex;
-        std::condition_variable receiveSignal;
-        uint32_t receivedCount = 0;
-
-        /*
-         * This is invoked upon the receipt of a Publish on a subscribed topic.
-         */
-        auto onMessage = [&](Mqtt::MqttConnection &,
-                             const String &topic,
-                             const ByteBuf &byteBuf,
-                             bool /*dup*/,
-                             Mqtt::QOS /*qos*/,
-                             bool /*retain*/) {
-            {
-                std::lock_guard<std::mutex> lock(receiveMutex);
-                ++receivedCount;
-                //fprintf(stdout, "Publish #%d received on topic %s\n", receivedCount, topic.c_str());
-                //fprintf(stdout, "Message: ");
-                //fwrite(byteBuf.buffer, 1, byteBuf.len, stdout);
-                //fprintf(stdout, "\n");
-
-                //a handler needs to process incoming message
-                //check if user has passed a handler binary or script, and let it process the data
-                char incomingMsg[MAX_PAYLOAD_SIZE];
-                if(byteBuf.len<MAX_PAYLOAD_SIZE)
-                {
-                    strncpy((char*)incomingMsg,(char*)byteBuf.buffer,byteBuf.len);
-                    incomingMsg[byteBuf.len] = '\0';
-                    if(IsValidFile(subTopicHandler.c_str())) //check if subscribe topic handler binay exists
-                    {
-                        //pass the incoming payload to handler via file
-                        String dataIn(incomingMsg);
-                        std::ofstream subscrData(SUBSCRIBER_DATA_FILE,std::ofstream::out | std::ofstream::trunc);
-                        subscrData << dataIn << std::endl;
-                        subscrData.close();
-                        String invokeCommand = subTopicHandler + " " + SUBSCRIBER_DATA_FILE;
-                        //e.g "/usr/sbin/blink-led.sh /tmp/incoming-data.json"
-                        InvokeShellCommand(invokeCommand.c_str());
-                    }
-                    //else
-                        //fprintf(stdout, "handler for incoming topic not found\n");
-                }
-            }
-
-            receiveSignal.notify_all();
+        size_t index = i + 1;//index of the connection in the publisher
+        std::promise<bool> *completed = &poolCompletedPromises[i];
+        auto &poolConnection = pubConnectionPool[i];
+        poolConnection->OnConnectionCompleted = [&publisher, index, completed](Mqtt::MqttConnection &, int errorCode, Mqtt::ReturnCode, bool) {
+            if (errorCode)
+                fprintf(stdout, "Connection %zu failed with error %s\n", index, ErrorDebugString(errorCode));
+            else
+                publisher.setOnline(true, index);
+            completed->set_value(errorCode == 0);
         };
+        poolConnection->OnConnectionInterrupted = [&publisher, index](Mqtt::MqttConnection &, int error) {
+            fprintf(stdout, "Connection %zu interrupted with error %s\n", index, ErrorDebugString(error));
+            publisher.setOnline(false, index);
+        };
+        poolConnection->OnConnectionResumed = [&publisher, index](Mqtt::MqttConnection &, Mqtt::ReturnCode, bool) {
+            fprintf(stdout, "Connection %zu resumed\n", index);
+            publisher.setOnline(true, index);
+        };
+        String poolClientId = clientId + "-" + std::to_string(index).c_str();
+        if (!poolConnection->Connect(poolClientId.c_str(), false /*cleanSession*/, 1000 /*keepAliveTimeSecs*/))
+        {
+            fprintf(stderr, "MQTT Connection %zu failed with error %s\n", index, ErrorDebugString(poolConnection->LastError()));
+            exit(-1);
+        }
+    }
+    //every connection has to be up, the publisher hashes topics over all of them
+    bool connected = connectionCompletedPromise.get_future().get();
+    if (!connected)
+        fprintf(stderr, "MQTT Connection 0(%s) failed, exiting\n", clientId.c_str());
+    for (size_t i = 0; i < poolCompletedPromises.size(); i++)
+    {
+        if (!poolCompletedPromises[i].get_future().get())
+        {
+            fprintf(stderr, "MQTT Connection %zu(%s-%zu) failed, exiting\n", i + 1, clientId.c_str(), i + 1);
+            connected = false;
+        }
+    }
 
+    if (connected)
+    {
         /*
          * Subscribe for incoming publish messages on topic.
          */
-        std::promise<void> subscribeFinishedPromise;
-        auto onSubAck =
-            [&](Mqtt::MqttConnection &, uint16_t packetId, const String &topic, Mqtt::QOS QoS, int errorCode) {
-                if (errorCode)
-                {
-                    fprintf(stderr, "Subscribe failed with error %s\n", aws_error_debug_str(errorCode));
-                    exit(-1);
-                }
-                else
-                {
-                    if (!packetId || QoS == AWS_MQTT_QOS_FAILURE)
+        //one SUBSCRIBE packet per qos, messages are delivered through the OnMessageHandler
+        auto onFilterMessage = [](Mqtt::MqttConnection &, const String &, const ByteBuf &, bool, Mqtt::QOS, bool) {};
+        for (int qos = 0; qos <= 1; qos++)
+        {
+            std::promise<void> subscribeFinishedPromise;
+            auto onSubAck =
+                [&](Mqtt::MqttConnection &, uint16_t packetId, const Vector<String> &topics, Mqtt::QOS QoS, int errorCode) {
+                    if (errorCode)
                     {
-                        fprintf(stderr, "Subscribe rejected by the broker.");
+                        fprintf(stderr, "Subscribe failed with error %s\n", aws_error_debug_str(errorCode));
                         exit(-1);
                     }
                     else
                     {
-                        fprintf(stdout, "Subscribe on topic %s on packetId %d Succeeded\n", topic.c_str(), packetId);
+                        if (!packetId || QoS == AWS_MQTT_QOS_FAILURE)
+                        {
+                            fprintf(stderr, "Subscribe rejected by the broker.");
+                            exit(-1);
+                        }
+                        else
+                        {
+                            for (const String &topic : topics)
+                                fprintf(stdout, "Subscribe on topic %s on packetId %d Succeeded\n", topic.c_str(), packetId);
+                        }
                     }
-                }
-                subscribeFinishedPromise.set_value();
-            };
+                    subscribeFinishedPromise.set_value();
+                };
 
-        connection->Subscribe(subtopic.c_str(), AWS_MQTT_QOS_AT_LEAST_ONCE, onMessage, onSubAck);
-        subscribeFinishedPromise.get_future().wait();
+            Vector<std::pair<const char *, Mqtt::OnMessageReceivedHandler>> topicFilters;
+            for (size_t i = 0; i < subscriptionRouter.filters().size(); i++)
+            {
+                if (subscriptionRouter.filterQos(i) == qos)
+                    topicFilters.push_back(std::make_pair(subscriptionRouter.filters()[i].c_str(), Mqtt::OnMessageReceivedHandler(onFilterMessage)));
+            }
+            if (topicFilters.empty())
+                continue;
+            connection->Subscribe(topicFilters, qos ? AWS_MQTT_QOS_AT_LEAST_ONCE : AWS_MQTT_QOS_AT_MOST_ONCE, onSubAck);
+            subscribeFinishedPromise.get_future().wait();
+        }
 
 	if ( IsValidFile(INIT_ACCESSORY_FILE_PATH) )
 		InvokeShellCommand(INIT_ACCESSORY_FILE_PATH);
 
-        uint32_t publishedCount = 0;
-        String msgPayload;
-        while (publishedCount < messageCount)
+        //check if message is a string or path to a script, script is started without a shell
+        //(once per publish, or only once in resident mode)
+        //serialized the publish requests through publisher thread(external publish request may come from linux-domain-socket)
+        TopicPublisher::PublishScheduler scheduler(&publisher);
+        if(messagePayload != "") //if empty string, then dont publish anything
         {
-            if(messagePayload != "") //if empty string, then dont publish anything
-            {
-                //check if message is a string or path to a shell-script
-                if(IsValidFile(messagePayload.c_str())) //its a file in the rootfs
-                    msgPayload=InvokeShellCommand(messagePayload.c_str());//e.g /usr/sbin/read-temperature.sh shall print json string
-                else //else its just a string
-                    msgPayload=messagePayload;
-
-                //ByteBuf payload = ByteBufFromArray((const uint8_t *)msgPayload.data(), msgPayload.length());
-                //auto onPublishComplete = [topic](Mqtt::MqttConnection &, uint16_t, int)
-                //{
-                //    fprintf(stdout, "Publish Complete on topic %s\n",topic.c_str());
-                //};
-                //connection->Publish(topic.c_str(), AWS_MQTT_QOS_AT_LEAST_ONCE, false, payload, onPublishComplete);
-
-                //serialized the publish requests through publisher thread(external publish request may come from linux-domain-socket)
-                std::string tp(topic.c_str());
-                std::string pl(msgPayload.c_str());
-                publisher.publishTopic(tp,pl);
-            }
-            if(messageCount>=0)//if count == -1 then run the loop forever till SIGTERM is received
-                ++publishedCount;
-
-            std::this_thread::sleep_for(std::chrono::milliseconds(1000 * intervalSec));
+            //if count == -1 then run the job forever till SIGTERM is received
+            int64_t jobCount = (messageCount == (uint32_t)-1) ? -1 : (int64_t)messageCount;
+            if(messageCount > 0)
+                scheduler.addJob(topic.c_str(), intervalMs, jobCount, TopicPublisher::CreatePublishSource(messagePayload.c_str(), sourceMode));
         }
+        if (cmdUtils.HasCommand("pub_jobs"))
+            scheduler.loadJobFile(cmdUtils.GetCommand("pub_jobs").c_str(), sourceMode);
+        if (statsIntervalMs > 0)
+        {
+            std::vector<InFlightStats> previous(publisher.connectionCount());//throughput since the last interval
+            scheduler.addTask(statsIntervalMs, [&publisher, &subscriberDispatcher, &payloadCodec, &spoolLog, spoolEnabled, statsIntervalMs, previous]() mutable {
+                InFlightStats inflight;
+                publisher.getInFlightStats(inflight);
+                fprintf(stdout, "publish: %llu sent %llu acked %llu failed, in flight %zu/%zu(max %zu, window full %llu times), ack latency avg %.1f max %llu ms\n",
+                        (unsigned long long)inflight.Sent, (unsigned long long)inflight.Acked, (unsigned long long)inflight.Failed,
+                        inflight.InFlight, inflight.Window, inflight.HighWater, (unsigned long long)inflight.WindowFull,
+                        inflight.Acked ? (double)inflight.AckLatencySumMs / inflight.Acked : 0.0, (unsigned long long)inflight.AckLatencyMaxMs);
+                for (const auto &error : inflight.Errors)
+                    fprintf(stdout, "publish error %s: %llu\n", ErrorDebugString(error.first), (unsigned long long)error.second);
+                double seconds = statsIntervalMs / 1000.0;
+                for (size_t i = 0; i < previous.size() && previous.size() > 1; i++)
+                {
+                    InFlightStats conn;
+                    publisher.getInFlightStats(i, conn);
+                    fprintf(stdout, "connection %zu: %llu sent %llu acked %llu failed, in flight %zu queued %zu, %.1f msgs/s %.1f KB/s\n",
+                            i, (unsigned long long)conn.Sent, (unsigned long long)conn.Acked, (unsigned long long)conn.Failed,
+                            conn.InFlight, conn.Queued, (conn.Sent - previous[i].Sent) / seconds,
+                            (conn.BytesSent - previous[i].BytesSent) / seconds / 1024);
+                    previous[i] = conn;
+                }
+                DispatchStats dispatch;
+                subscriberDispatcher.getStats(dispatch);
+                fprintf(stdout, "subscribe: %llu handled %llu dropped %llu rejected, queued %zu/%zu(max %zu)\n",
+                        (unsigned long long)dispatch.Handled, (unsigned long long)dispatch.Dropped, (unsigned long long)dispatch.Failed,
+                        dispatch.Queue.Depth, dispatch.Queue.Capacity, dispatch.Queue.HighWater);
+                CodecStats stats;
+                payloadCodec.getStats(stats);
+                fprintf(stdout, "compress: %llu msgs %llu skipped ratio %.3f cpu %.3f ms, decompress: %llu msgs cpu %.3f ms, errors %llu\n",
+                        (unsigned long long)stats.Compressed, (unsigned long long)stats.Skipped,
+                        stats.CompressIn ? (double)stats.CompressOut / stats.CompressIn : 1.0, stats.CompressCpuNs / 1e6,
+                        (unsigned long long)stats.Decompressed, stats.DecompressCpuNs / 1e6, (unsigned long long)stats.Errors);
+                if (spoolEnabled)
+                {
+                    TopicPublisher::SpoolStats spool;
+                    spoolLog.getStats(spool);
+                    fprintf(stdout, "spool: %llu appended %llu replayed %llu acked %llu pending %llu dropped %llu rewinds %llu syncs %llu segments\n",
+                            (unsigned long long)spool.Appended, (unsigned long long)spool.Replayed, (unsigned long long)spool.Acked,
+                            (unsigned long long)spool.Pending, (unsigned long long)spool.Dropped, (unsigned long long)spool.Rewinds,
+                            (unsigned long long)spool.Syncs, (unsigned long long)spool.Segments);
+                }
+            });
+        }
+        scheduler.run();
 
         {
             std::unique_lock<std::mutex> receivedLock(receiveMutex);
@@ -294,17 +798,23 @@ int main(int argc, char *argv[])
 
         /* Just wait here(processing subscribed topics) till SIGTERM is sent to this process */
         fprintf(stdout, "Just Waiting for SIGTERM or CTRL+x\n");
+        scheduler.runTasks();//statistics keep being printed, returns right away without tasks
         while(1)
                 std::this_thread::sleep_for(std::chrono::milliseconds(1000));
         /*
-         * Unsubscribe from the topic.
+         * Unsubscribe from the topics.
          */
-        std::promise<void> unsubscribeFinishedPromise;
-        connection->Unsubscribe(
-            subtopic.c_str(), [&](Mqtt::MqttConnection &, uint16_t, int) { unsubscribeFinishedPromise.set_value(); });
-        unsubscribeFinishedPromise.get_future().wait();
+        for (const std::string &filter : subscriptionRouter.filters())
+        {
+            std::promise<void> unsubscribeFinishedPromise;
+            connection->Unsubscribe(
+                filter.c_str(), [&](Mqtt::MqttConnection &, uint16_t, int) { unsubscribeFinishedPromise.set_value(); });
+            unsubscribeFinishedPromise.get_future().wait();
+        }
 
         /* Disconnect */
+        for (auto &poolConnection : pubConnectionPool)
+            poolConnection->Disconnect();
         if (connection->Disconnect())
         {
             connectionClosedPromise.get_future().wait();
@@ -312,35 +822,10 @@ int main(int argc, char *argv[])
     }
     else
     {
+        for (auto &poolConnection : pubConnectionPool)
+            poolConnection->Disconnect();
+        connection->Disconnect();
         exit(-1);
     }
     return 0;
 }
-/*****************************************************************************/
-//custom extensions to sample program
-//from a security perspective this is not a good idea to allow invoking remote commands,
-//but as a demo application, we will allow this and we assume user of this binary knows how to use it
-String InvokeShellCommand(const char* command)
-{
-    std::array<char, 128> buffer;
-    String result;
-    std::unique_ptr<FILE, decltype(&pclose)> pipe(popen(command, "r"), pclose);
-    if (!pipe) {
-        throw std::runtime_error("popen() failed!");
-    }
-    while (fgets(buffer.data(), buffer.size(), pipe.get()) != nullptr) {
-        result += buffer.data();
-    }
-    return result;
-}
-//check if this is a valid file in the filesystem
-bool IsValidFile(const char* filepath)
-{
-        struct stat buffer;
-        if(stat(filepath,&buffer)!=0)
-                return false;
-        if(buffer.st_mode & S_IFREG)
-                return true;
-        return false;//it could be a directory
-}
-/*****************************************************************************/